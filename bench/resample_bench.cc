@@ -0,0 +1,80 @@
+/** Times Resampler against QImage::scaled, smooth, reducing photos of
+ * 12, 24 and 50 MP to fit a 4K screen
+ *
+ *   resample_bench [runs]
+ *
+ * Each time is the median of the runs (default 5), after one run to warm up.
+ */
+
+#include <QImage>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+#include <fmt/core.h>
+#include "resample.hh"
+
+
+namespace {
+
+/** A photo-like image: smooth gradients with some fine detail */
+QImage
+photo(int w, int h)
+{
+    QImage img(w, h, QImage::Format_RGB32);
+    for(int y = 0; y < h; ++y) {
+        auto *line = reinterpret_cast<QRgb *>(img.scanLine(y));
+        for(int x = 0; x < w; ++x)
+            line[x] = qRgb(x * 255 / w, y * 255 / h, 128 + 100 * std::sin(x / 7.0) * std::cos(y / 5.0));
+    }
+    return img;
+}
+
+
+/** Median of runs timings of fn, in ms */
+double
+median_ms(int runs, std::function<QImage()> const &fn)
+{
+    using clock = std::chrono::steady_clock;
+    (void)fn();
+    std::vector<double> ms;
+    for(int k = 0; k < runs; ++k) {
+        auto const t0 = clock::now();
+        QImage const out{fn()};
+        ms.push_back(std::chrono::duration<double, std::milli>(clock::now() - t0).count());
+        if(out.isNull())
+            std::exit(EXIT_FAILURE);
+    }
+    std::nth_element(ms.begin(), ms.begin() + ms.size() / 2, ms.end());
+    return ms[ms.size() / 2];
+}
+
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int const runs = argc > 1 ? std::max(1, std::atoi(argv[1])) : 5;
+    QSize const screen{3840, 2160};
+    struct { char const *name; QSize size; } const photos[] = {
+        {"12 MP", {4000, 3000}},
+        {"24 MP", {6000, 4000}},
+        {"50 MP", {8688, 5792}},
+    };
+
+    auto resampler = Resampler::shared();
+    fmt::print("Resampler kernels: {}, {} runs each\n", Resampler::isa(), runs);
+    fmt::print("{:>6}  {:>11}  {:>12}  {:>11}  {:>7}\n", "source", "target", "QImage (ms)", "ours (ms)", "speedup");
+    for(auto const &p : photos) {
+        QImage const src{photo(p.size.width(), p.size.height())};
+        QSize const target{p.size.scaled(screen, Qt::KeepAspectRatio)};
+        double const qt = median_ms(runs, [&] { return src.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation); });
+        double const ours = median_ms(runs, [&] { return resampler->scale(src, QRectF(src.rect()), target); });
+        fmt::print("{:>6}  {:>11}  {:>12.1f}  {:>11.1f}  {:>6.1f}x\n", p.name,
+                   fmt::format("{}x{}", target.width(), target.height()), qt, ours, qt / ours);
+    }
+    return EXIT_SUCCESS;
+}
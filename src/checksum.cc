@@ -0,0 +1,250 @@
+#include "checksum.hh"
+#include "image.hh"
+#include "preview.hh"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fcntl.h>
+#include <latch>
+#include <unistd.h>
+#include <QFile>
+#include <QSaveFile>
+#include <QTextStream>
+
+
+namespace {
+
+constexpr std::uint64_t c1 = 0x87c37b91114253d5ULL;
+constexpr std::uint64_t c2 = 0x4cf5ad432745937fULL;
+
+inline std::uint64_t
+fmix(std::uint64_t k) noexcept
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+inline std::uint64_t
+load64(unsigned char const *p) noexcept
+{
+    // Little endian, as the reference implementation on x86
+    std::uint64_t k = 0;
+    for(int i = 7; i >= 0; --i)
+        k = (k << 8) | p[i];
+    return k;
+}
+
+}
+
+
+void
+hash128::block(unsigned char const *p) noexcept
+{
+    std::uint64_t k1 = load64(p), k2 = load64(p + 8);
+    k1 *= c1; k1 = std::rotl(k1, 31); k1 *= c2; h1_ ^= k1;
+    h1_ = std::rotl(h1_, 27); h1_ += h2_; h1_ = h1_ * 5 + 0x52dce729;
+    k2 *= c2; k2 = std::rotl(k2, 33); k2 *= c1; h2_ ^= k2;
+    h2_ = std::rotl(h2_, 31); h2_ += h1_; h2_ = h2_ * 5 + 0x38495ab5;
+}
+
+
+void
+hash128::update(void const *data, std::size_t len) noexcept
+{
+    auto const *p = static_cast<unsigned char const *>(data);
+    len_ += len;
+    if(ntail_) {
+        std::size_t n = std::min(len, sizeof(tail_) - ntail_);
+        std::memcpy(tail_ + ntail_, p, n);
+        ntail_ += n;
+        p += n;
+        len -= n;
+        if(ntail_ < sizeof(tail_))
+            return;
+        block(tail_);
+        ntail_ = 0;
+    }
+    for(; len >= 16; p += 16, len -= 16)
+        block(p);
+    std::memcpy(tail_, p, len);
+    ntail_ = len;
+}
+
+
+QByteArray
+hash128::digest() const
+{
+    std::uint64_t h1 = h1_, h2 = h2_, k1 = 0, k2 = 0;
+    unsigned char const *t = tail_;
+    switch(ntail_) {
+    case 15: k2 ^= std::uint64_t(t[14]) << 48; [[fallthrough]];
+    case 14: k2 ^= std::uint64_t(t[13]) << 40; [[fallthrough]];
+    case 13: k2 ^= std::uint64_t(t[12]) << 32; [[fallthrough]];
+    case 12: k2 ^= std::uint64_t(t[11]) << 24; [[fallthrough]];
+    case 11: k2 ^= std::uint64_t(t[10]) << 16; [[fallthrough]];
+    case 10: k2 ^= std::uint64_t(t[9]) << 8; [[fallthrough]];
+    case 9:  k2 ^= std::uint64_t(t[8]);
+             k2 *= c2; k2 = std::rotl(k2, 33); k2 *= c1; h2 ^= k2;
+             [[fallthrough]];
+    case 8:  k1 ^= std::uint64_t(t[7]) << 56; [[fallthrough]];
+    case 7:  k1 ^= std::uint64_t(t[6]) << 48; [[fallthrough]];
+    case 6:  k1 ^= std::uint64_t(t[5]) << 40; [[fallthrough]];
+    case 5:  k1 ^= std::uint64_t(t[4]) << 32; [[fallthrough]];
+    case 4:  k1 ^= std::uint64_t(t[3]) << 24; [[fallthrough]];
+    case 3:  k1 ^= std::uint64_t(t[2]) << 16; [[fallthrough]];
+    case 2:  k1 ^= std::uint64_t(t[1]) << 8; [[fallthrough]];
+    case 1:  k1 ^= std::uint64_t(t[0]);
+             k1 *= c1; k1 = std::rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+    h1 ^= len_; h2 ^= len_;
+    h1 += h2; h2 += h1;
+    h1 = fmix(h1); h2 = fmix(h2);
+    h1 += h2; h2 += h1;
+
+    QByteArray out(16, '\0');
+    for(int i = 0; i < 8; ++i) {
+        out[i] = static_cast<char>(h1 >> (8 * i));
+        out[8 + i] = static_cast<char>(h2 >> (8 * i));
+    }
+    return out;
+}
+
+
+Checksummer::Checksummer(QString const &memo, unsigned threads) : memo_(memo), dirty_(false), pool_(threads)
+{
+    if(memo_.isEmpty())
+        return;
+    QFile f(memo_);
+    if(!f.open(QIODevice::ReadOnly | QIODevice::Text))
+        return;
+    // One file per line: digest size mtime path (the path last as it may contain spaces)
+    QTextStream in(&f);
+    QString line;
+    while(in.readLineInto(&line)) {
+        QStringList fields = line.split(' ');
+        if(fields.size() < 4)
+            continue;
+        known k{fields[1].toLongLong(), fields[2].toLongLong(), QByteArray::fromHex(fields[0].toLatin1())};
+        if(k.digest.size() != 16)
+            continue;
+        remember(line.section(' ', 3), k);
+    }
+    dirty_ = false;
+}
+
+
+Checksummer::~Checksummer()
+{
+    save();
+}
+
+
+std::shared_ptr<Checksummer>
+Checksummer::shared()
+{
+    static std::shared_ptr<Checksummer> memo = std::make_shared<Checksummer>(imgex_cache_dir() + "/checksums");
+    return memo;
+}
+
+
+void
+Checksummer::remember(QString const &path, known const &k)
+{
+    auto p = files_.find(path);
+    if(p != files_.end())
+        by_digest_.remove(p->digest, path);
+    files_.insert(path, k);
+    by_digest_.insert(k.digest, path);
+    dirty_ = true;
+}
+
+
+QByteArray
+Checksummer::remembered(ImageFile const &imgf) const
+{
+    std::lock_guard<std::mutex> lk(mtx_);
+    auto p = files_.constFind(imgf.getPath());
+    if(p != files_.constEnd() && p->size == imgf.getSize() && p->mtime == imgf.getModified())
+        return p->digest;
+    return QByteArray();
+}
+
+
+QByteArray
+Checksummer::checksum(ImageFile const &imgf)
+{
+    QString const path{imgf.getPath()};
+    if(QByteArray known = remembered(imgf); !known.isEmpty())
+        return known;
+    // Not holding the lock while we read the file
+    QByteArray digest = hash_file(path);
+    if(digest.isEmpty())
+        return digest;
+    std::lock_guard<std::mutex> lk(mtx_);
+    remember(path, known{imgf.getSize(), imgf.getModified(), digest});
+    return digest;
+}
+
+
+void
+Checksummer::checksum(std::vector<ImageFile> &files)
+{
+    std::latch done(files.size());
+    for(auto &f : files)
+        pool_.submit([this, &f, &done] {
+            f.setChecksum(checksum(f));
+            done.count_down();
+        });
+    done.wait();
+}
+
+
+QStringList
+Checksummer::files_with(QByteArray const &digest) const
+{
+    std::lock_guard<std::mutex> lk(mtx_);
+    return by_digest_.values(digest);
+}
+
+
+void
+Checksummer::save()
+{
+    std::lock_guard<std::mutex> lk(mtx_);
+    if(!dirty_ || memo_.isEmpty())
+        return;
+    QSaveFile f(memo_);
+    if(!f.open(QIODevice::WriteOnly | QIODevice::Text))
+        return;
+    QTextStream out(&f);
+    for(auto p = files_.constBegin(); p != files_.constEnd(); ++p)
+        out << p->digest.toHex() << ' ' << p->size << ' ' << p->mtime << ' ' << p.key() << '\n';
+    out.flush();
+    if(f.commit())
+        dirty_ = false;
+}
+
+
+QByteArray
+Checksummer::hash_file(QString const &path)
+{
+    // Plain large sequential reads rather than mmap: a card pulled out while we
+    // read it gives a read error instead of SIGBUS, and the hash keeps up with
+    // any card reader so the device sets the pace either way
+    QByteArray const fn{QFile::encodeName(path)};
+    int fd = ::open(fn.constData(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return QByteArray();
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    hash128 h;
+    std::vector<char> buf(4 << 20);
+    ssize_t n;
+    while((n = ::read(fd, buf.data(), buf.size())) > 0)
+        h.update(buf.data(), n);
+    ::close(fd);
+    return n < 0 ? QByteArray() : h.digest();
+}
@@ -0,0 +1,93 @@
+#ifndef __IMGEX_CHECKSUM_H
+#define __IMGEX_CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <QByteArray>
+#include <QHash>
+#include <QMultiHash>
+#include <QString>
+#include <QStringList>
+#include "workers.hh"
+
+class ImageFile;
+
+
+/** Streaming 128 bit non-cryptographic hash (MurmurHash3, x64 128 bit variant).
+ * Data may be fed in pieces of any size; the result is the same as hashing it in one go.
+ */
+class hash128 final {
+    std::uint64_t h1_, h2_;
+    std::uint64_t len_;
+    /** Bytes not yet making up a whole 16 byte block */
+    unsigned char tail_[16];
+    std::size_t ntail_;
+
+    void block(unsigned char const *) noexcept;
+public:
+    explicit hash128(std::uint64_t seed = 0) noexcept : h1_(seed), h2_(seed), len_(0), tail_(), ntail_(0) {}
+    void update(void const *data, std::size_t len) noexcept;
+    /** The 16 byte digest (does not change the state, so more data may follow) */
+    [[nodiscard]] QByteArray digest() const;
+};
+
+
+/** Checksummer computes and remembers the content checksums of image files.
+ *
+ * A file whose size and modification time are unchanged since it was last
+ * checksummed is not read again; what we know is kept in a small file so this
+ * holds across runs.  The checksum identifies a photo independently of where
+ * it is stored, so the same photo on a second card is recognised without
+ * decoding it.
+ */
+class Checksummer final {
+public:
+    /** \param memo file remembering checksums across runs (none if empty)
+     * \param threads threads for checksumming many files at once */
+    explicit Checksummer(QString const &memo = QString(), unsigned threads = 4);
+    /** Saves what we know to the memo file */
+    ~Checksummer();
+    Checksummer(Checksummer const &) = delete;
+    Checksummer &operator=(Checksummer const &) = delete;
+
+    /** Shared by the application, remembering checksums in the imgex cache directory */
+    static std::shared_ptr<Checksummer> shared();
+
+    /** Checksum of a file, empty if it cannot be read; safe to call from any thread */
+    [[nodiscard]] QByteArray checksum(ImageFile const &);
+
+    /** The checksum we remember for an unchanged file, empty if we would have to read it */
+    [[nodiscard]] QByteArray remembered(ImageFile const &) const;
+
+    /** Checksum many files in parallel, storing the result in each */
+    void checksum(std::vector<ImageFile> &);
+
+    /** Paths of the files known to have the given checksum */
+    [[nodiscard]] QStringList files_with(QByteArray const &digest) const;
+
+    /** Write the memo file, if anything has changed */
+    void save();
+
+    /** Read a whole file and hash it; empty on a read error */
+    [[nodiscard]] static QByteArray hash_file(QString const &path);
+
+private:
+    struct known {
+        qint64 size, mtime;
+        QByteArray digest;
+    };
+    QString memo_;
+    mutable std::mutex mtx_;
+    QHash<QString, known> files_;
+    QMultiHash<QByteArray, QString> by_digest_;
+    bool dirty_;
+    WorkerPool pool_;
+
+    void remember(QString const &path, known const &);
+};
+
+
+#endif
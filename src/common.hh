@@ -0,0 +1,21 @@
+#ifndef __IMGEX_COMMON_H
+#define __IMGEX_COMMON_H
+
+#include <cstdlib>
+
+
+/** The value of environment variable name as a decimal number, or dflt if
+ * it is unset, empty or not entirely digits */
+inline unsigned long
+env_number(char const *name, unsigned long dflt) noexcept
+{
+    char const *val = getenv(name);
+    if(!val || !*val)
+        return dflt;
+    char *end;
+    unsigned long n = strtoul(val, &end, 10);
+    return *end ? dflt : n;
+}
+
+
+#endif
@@ -7,6 +7,33 @@
 #include <QPainter>
 
 
+namespace {
+
+/** The pixels of a rectangle's outline, as drawn by a one pixel pen, with a
+ * pixel to spare either side */
+QRegion
+outline(QRect r)
+{
+    if(r.isNull())
+        return QRegion();
+    QRect const o{r.adjusted(-1, -1, 2, 2)};
+    QRegion reg{QRect(o.left(), o.top(), o.width(), 3)};
+    reg += QRect(o.left(), o.bottom() - 2, o.width(), 3);
+    reg += QRect(o.left(), o.top(), 3, o.height());
+    reg += QRect(o.right() - 2, o.top(), 3, o.height());
+    return reg;
+}
+
+}
+
+
+QRegion
+XILDecorator::bounds() const
+{
+    return owner_ ? QRegion(owner_->box()) : QRegion();
+}
+
+
 XILDecorator::event_status_t
 XILDecorator::event_status_or(event_status_t a, event_status_t b) noexcept
 {
@@ -80,7 +107,7 @@ XILMouseEventDecorator::mMove(QMouseEvent const &ev)
 		QPoint loc = ev.pos();
         delta = loc-oldq_;
         oldq_ = loc;
-        owner_->mkexpose();
+        // Subclasses redraw what they change by returning EV_REDRAW
         return event_status_t::EV_DONE;
 	}
     return event_status_t::EV_NOP;
@@ -157,13 +184,28 @@ XILCropDecorator::mMove(const QMouseEvent &qev)
 }
 
 
+QRect
+XILCropDecorator::frame() const
+{
+    if(!crop_.isNull())
+        return crop_;
+    return owner_->box().adjusted(0, 0, -1, -1);
+}
+
+
+QRegion
+XILCropDecorator::bounds() const
+{
+    // Just the frame: moving a corner repaints two thin strips of the image, not all of it
+    return outline(frame());
+}
+
+
 void
 XILCropDecorator::render(QPainter &qp)
 {
-    if(crop_.isNull()) {
-        crop_ = owner_->box();
-        crop_.adjust(0, 0, -1, -1);
-    }
+    if(crop_.isNull())
+        crop_ = frame();
     qp.save();
     qp.setPen(Qt::SolidLine);
     qp.setPen(Qt::white);
@@ -179,8 +221,8 @@ XILCropDecorator::to_transform(Transformable &image, Transformable::transform &)
 }
 
 
-void
-BorderDecorator::render(QPainter &qp)
+QRect
+BorderDecorator::frame() const
 {
 	// default is parent box
 	QRect box{box_.isNull() ? owner_->box() : box_};
@@ -188,6 +230,21 @@ BorderDecorator::render(QPainter &qp)
 	box &= owner_->box();
 	// Shrink to fit inside window
 	box.adjust(0, 0, -1, -1);
+	return box;
+}
+
+
+QRegion
+BorderDecorator::bounds() const
+{
+	return outline(frame());
+}
+
+
+void
+BorderDecorator::render(QPainter &qp)
+{
+	QRect const box{frame()};
 	qp.save();
 	qp.setPen(col_);
 	qp.setBrush(Qt::NoBrush);
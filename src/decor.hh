@@ -7,6 +7,7 @@
 
 #include <QPainter>
 #include <QRect>
+#include <QRegion>
 #include <QColor>
 #include "xwin.hh"
 
@@ -45,9 +46,13 @@ public:
     virtual event_status_t handleEvent(QEvent &) override;
 
     virtual void render(QPainter &qp) override;
+    QRegion bounds() const override;
 
     void to_transform(Transformable &image, Transformable::transform &transform) const override;
 
+private:
+    /** The crop rectangle, the whole image until one is chosen */
+    QRect frame() const;
 };
 
 /** Simple decorator which draws a border around the image */
@@ -56,11 +61,14 @@ class BorderDecorator : public XILDecorator {
 private:
 	QRect box_;
 	QColor col_;
+	/** The rectangle drawn, in local coordinates */
+	QRect frame() const;
 public:
 	/** Create in local coordinates
 	 * If created with a null box, will use its owner's border */
 	BorderDecorator(QRect qr, QColor qc) : box_(qr), col_(qc) {}
 	virtual void render(QPainter &) override;
+	QRegion bounds() const override;
 
     void to_transform(Transformable &image, Transformable::transform &transform) const override;
 };
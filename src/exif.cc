@@ -0,0 +1,207 @@
+#include "exif.hh"
+#include <algorithm>
+#include <unistd.h>
+
+
+namespace {
+
+inline std::uint32_t be16(unsigned char const *p) noexcept { return p[0] << 8 | p[1]; }
+inline std::uint32_t le16(unsigned char const *p) noexcept { return p[1] << 8 | p[0]; }
+inline std::uint32_t be32(unsigned char const *p) noexcept { return be16(p) << 16 | be16(p + 2); }
+inline std::uint32_t le32(unsigned char const *p) noexcept { return le16(p + 2) << 16 | le16(p); }
+
+inline bool
+read_at(int fd, void *buf, std::size_t n, std::int64_t off) noexcept
+{
+    return pread(fd, buf, n, off) == static_cast<ssize_t>(n);
+}
+
+// TIFF tags we look for
+enum : unsigned {
+    tag_width = 256, tag_height = 257, tag_compression = 259,
+    tag_strip_offsets = 273, tag_strip_bytes = 279,
+    tag_subifds = 330, tag_jpeg_offset = 513, tag_jpeg_length = 514,
+    tag_exif_ifd = 34665
+};
+
+/** Compression values meaning JPEG (old and new style) */
+inline bool is_jpeg(std::uint32_t compression) noexcept { return compression == 6 || compression == 7; }
+
+}
+
+
+ExifReader::ExifReader(int fd) : fd_(fd)
+{
+    unsigned char h[4];
+    if(!read_at(fd_, h, 4, 0))
+        return;
+    if(h[0] == 'I' && h[1] == 'I' && h[2] == '*' && h[3] == 0) {
+        parse_tiff(0);
+        return;
+    }
+    if(h[0] == 'M' && h[1] == 'M' && h[2] == 0 && h[3] == '*') {
+        parse_tiff(0);
+        return;
+    }
+    if(h[0] != 0xff || h[1] != 0xd8)
+        return;
+    // JPEG: the TIFF structure is in the APP1 segment starting "Exif\0\0"
+    std::int64_t pos = 2;
+    unsigned char m[10];
+    for(int segments = 0; segments < 64 && read_at(fd_, m, 10, pos) && m[0] == 0xff; ++segments) {
+        unsigned const marker = m[1];
+        if(marker == 0xda || marker == 0xd9)
+            break;
+        if(marker == 0xe1 && std::equal(m + 4, m + 10, "Exif\0\0")) {
+            parse_tiff(pos + 10);
+            break;
+        }
+        pos += 2 + be16(m + 2);
+    }
+}
+
+
+void
+ExifReader::parse_tiff(std::int64_t base)
+{
+    unsigned char h[8];
+    if(!read_at(fd_, h, 8, base))
+        return;
+    bool const be = h[0] == 'M';
+    parse_ifd(base, be, be ? be32(h + 4) : le32(h + 4), 0);
+}
+
+
+void
+ExifReader::parse_ifd(std::int64_t base, bool big_endian, std::uint32_t ifd, int depth)
+{
+    auto u16 = big_endian ? be16 : le16;
+    auto u32 = big_endian ? be32 : le32;
+
+    // Follow the chain of IFDs (IFD0, IFD1, ...) at this level
+    for(int chain = 0; ifd && chain < 8 && depth < 4; ++chain) {
+        if(!seen_.insert(base + ifd).second)
+            return;
+        unsigned char cnt[2];
+        if(!read_at(fd_, cnt, 2, base + ifd))
+            return;
+        unsigned const n = u16(cnt);
+        if(n == 0 || n > 1024)
+            return;
+        std::vector<unsigned char> dir(12 * n + 4);
+        if(!read_at(fd_, dir.data(), dir.size(), base + ifd + 2))
+            return;
+
+        std::uint32_t compression = 0, strip = 0, strip_bytes = 0, jpeg = 0, jpeg_bytes = 0;
+        std::vector<std::uint32_t> children;
+        for(unsigned i = 0; i < n; ++i) {
+            unsigned char const *e = dir.data() + 12 * i;
+            unsigned const tag = u16(e), type = u16(e + 2);
+            std::uint32_t const count = u32(e + 4);
+            // SHORT values sit in the first two bytes of the value field
+            std::uint32_t const value = type == 3 ? u16(e + 8) : u32(e + 8);
+            switch(tag) {
+            case tag_compression: compression = value; break;
+            // Previews are stored in one strip; anything else is image data
+            case tag_strip_offsets: if(count == 1) strip = value; break;
+            case tag_strip_bytes: if(count == 1) strip_bytes = value; break;
+            case tag_jpeg_offset: jpeg = value; break;
+            case tag_jpeg_length: jpeg_bytes = value; break;
+            case tag_exif_ifd: children.push_back(value); break;
+            case tag_subifds:
+                if(count == 1) {
+                    children.push_back(value);
+                } else if(count <= 16) {
+                    // More than one offset doesn't fit in the entry
+                    unsigned char offs[64];
+                    if(read_at(fd_, offs, 4 * count, base + value))
+                        for(std::uint32_t k = 0; k < count; ++k)
+                            children.push_back(u32(offs + 4 * k));
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        if(jpeg && jpeg_bytes)
+            add(base + jpeg, jpeg_bytes);
+        if(is_jpeg(compression) && strip && strip_bytes)
+            add(base + strip, strip_bytes);
+        for(auto c : children)
+            parse_ifd(base, big_endian, c, depth + 1);
+        ifd = u32(dir.data() + 12 * n);
+    }
+}
+
+
+void
+ExifReader::add(std::int64_t offset, std::int64_t length)
+{
+    preview p{offset, length, 0, 0};
+    unsigned frame = 0;
+    if(!jpeg_size(fd_, offset, p.width, p.height, &frame))
+        return;
+    // Raw data in DNG and CR2 is lossless JPEG, which is not a preview and Qt can't decode
+    if(frame != 0xc0 && frame != 0xc1 && frame != 0xc2)
+        return;
+    if(std::none_of(previews_.begin(), previews_.end(), [offset](preview const &q) { return q.offset == offset; }))
+        previews_.push_back(p);
+}
+
+
+ExifReader::preview const *
+ExifReader::largest() const noexcept
+{
+    auto p = std::max_element(previews_.begin(), previews_.end(), [](preview const &a, preview const &b) {
+        return std::uint64_t(a.width) * a.height < std::uint64_t(b.width) * b.height;
+    });
+    return p == previews_.end() ? nullptr : &*p;
+}
+
+
+QByteArray
+ExifReader::read(preview const &p) const
+{
+    QByteArray data(p.length, Qt::Uninitialized);
+    if(!read_at(fd_, data.data(), data.size(), p.offset))
+        return QByteArray();
+    return data;
+}
+
+
+bool
+ExifReader::jpeg_size(int fd, std::int64_t start, std::uint32_t &width, std::uint32_t &height, unsigned *frame)
+{
+    unsigned char m[9];
+    if(!read_at(fd, m, 2, start) || m[0] != 0xff || m[1] != 0xd8)
+        return false;
+    std::int64_t pos = start + 2;
+    // Plenty for any real file, and guards against loops in corrupt ones
+    for(int segments = 0; segments < 512; ++segments) {
+        if(!read_at(fd, m, 4, pos) || m[0] != 0xff)
+            return false;
+        unsigned const marker = m[1];
+        if(marker == 0xff) {
+            ++pos; // fill byte
+            continue;
+        }
+        if(marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) {
+            pos += 2; // markers without a length
+            continue;
+        }
+        if(marker == 0xd9 || marker == 0xda)
+            return false; // end of image or start of scan before any frame
+        bool const sof = marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+        if(sof) {
+            if(!read_at(fd, m, 9, pos))
+                return false;
+            height = be16(m + 5);
+            width = be16(m + 7);
+            if(frame)
+                *frame = marker;
+            return true;
+        }
+        pos += 2 + be16(m + 2);
+    }
+    return false;
+}
@@ -0,0 +1,61 @@
+#ifndef __IMGEX_EXIF_H
+#define __IMGEX_EXIF_H
+
+#include <cstdint>
+#include <set>
+#include <vector>
+#include <QByteArray>
+
+
+/** ExifReader finds the preview images embedded in camera files.
+ *
+ * Camera JPEGs carry a thumbnail in their EXIF data, and the TIFF based RAW
+ * formats (CR2, NEF, ARW, DNG, ...) carry one or more JPEG previews, often
+ * screen sized or larger.  They cost a fraction of decoding the main image,
+ * which in the case of RAW files Qt cannot decode at all.
+ *
+ * This is just enough of a TIFF parser to walk the IFDs (including SubIFDs
+ * and the EXIF IFD) and collect the JPEG streams they point to.
+ */
+class ExifReader final {
+public:
+    struct preview {
+        /** Location of the JPEG stream in the file */
+        std::int64_t offset, length;
+        /** Dimensions from the stream's frame header */
+        std::uint32_t width, height;
+    };
+
+    /** Parse a JPEG or TIFF based file; the descriptor is read with pread and not closed */
+    explicit ExifReader(int fd);
+
+    [[nodiscard]] std::vector<preview> const &previews() const noexcept { return previews_; }
+
+    /** The preview with the most pixels, nullptr if there are none */
+    [[nodiscard]] preview const *largest() const noexcept;
+
+    /** The JPEG data of a preview, empty on a read error */
+    [[nodiscard]] QByteArray read(preview const &) const;
+
+    /** Read the dimensions from the frame header of a JPEG stream starting at start
+     * (at its SOI marker), skipping EXIF and other segments
+     * \param frame if not null, set to the start of frame marker (0xc0 baseline, 0xc2 progressive, ...)
+     * \return false if no frame header was found */
+    static bool jpeg_size(int fd, std::int64_t start, std::uint32_t &width, std::uint32_t &height,
+                          unsigned *frame = nullptr);
+
+private:
+    int fd_;
+    std::vector<preview> previews_;
+    /** IFDs seen, guarding against loops in corrupt files */
+    std::set<std::int64_t> seen_;
+
+    /** Parse a TIFF structure whose header starts at base */
+    void parse_tiff(std::int64_t base);
+    void parse_ifd(std::int64_t base, bool big_endian, std::uint32_t ifd, int depth);
+    /** Add the JPEG stream at offset if it is one Qt can decode */
+    void add(std::int64_t offset, std::int64_t length);
+};
+
+
+#endif
@@ -1,6 +1,8 @@
 #include "image.hh"
 #include <cstdlib>
+#include <QDateTime>
 #include <QFile>
+#include <QFileInfo>
 #include <QString>
 
 
@@ -12,24 +14,34 @@
  * store a one-byte file with the drive letter. */
 static QString driveletter("drive");
 
-ImageFile::ImageFile( QString const &fn )
+ImageFile::ImageFile( QString const &fn ) : size_(-1), mtime_(0)
 {
-	/** This location is used only for test/development */
-	QString mount{"/Pictures/"};
-	char const *home = getenv("HOME");
-	if( home )
-		    mount = home + mount;
-	if(!mount.endsWith('/'))
-	    mount += '/';
-
-	path_ = mount + fn;
+	if(fn.startsWith('/')) {
+		path_ = fn;
+	} else {
+		/** This location is used only for test/development */
+		QString mount{"/Pictures/"};
+		char const *home = getenv("HOME");
+		if( home )
+			    mount = home + mount;
+		if(!mount.endsWith('/'))
+		    mount += '/';
+
+		path_ = mount + fn;
+	}
+	// A file which does not exist is reported when it is loaded
+	QFileInfo info(path_);
+	if(info.exists()) {
+		size_ = info.size();
+		mtime_ = info.lastModified().toMSecsSinceEpoch();
+	}
 /*
 	QString filename(path_.c_str());
 
 	// raise exception unless file exists and is readable (we open it as an image later)
 	QFile img(filename);
 */
-	// TODO: checksum the file
+	// The checksum is filled in by Checksummer, which reads the whole file
 	// read the drive letter which should be in a fixed location
 /*
 	QFile drive(filename);
@@ -45,6 +57,13 @@ ImageFile::ImageFile( QString const &fn )
 }
 
 
+ImageFile::ImageFile( QString const &path, char drive ) : ImageFile(path)
+{
+	if(drive)
+		drives_.insert(drive);
+}
+
+
 ImageFile::~ImageFile() noexcept
 {
 }
@@ -56,6 +75,12 @@ Image::Image(ImageFile const &imgf) : Transformable(imgf), wf_(), imgf_(imgf)
 }
 
 
+Image::Image(ImageFile const &imgf, QPixmap pixels, float reduction, std::shared_ptr<void const> hold) :
+        Transformable(pixels, reduction, std::move(hold)), wf_(), imgf_(imgf)
+{
+}
+
+
 Image::~Image() noexcept
 {
 }
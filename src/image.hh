@@ -3,6 +3,7 @@
 
 
 #include <set>
+#include <QByteArray>
 #include <QString>
 #include <QPixmap>
 #include "transform.hh"
@@ -18,11 +19,25 @@ class ImageFile final {
 	// status
 	/** Drives/locations this file is located on, each drive is identified by a single letter */
 	std::set<char> drives_;
+	/** File identity as of construction: size in bytes and modification time (ms since epoch) */
+	qint64 size_;
+	qint64 mtime_;
+	/** Content checksum, empty if not (yet) known */
+	QByteArray checksum_;
 public:
 	// can throw std::ios_base::failure
+	/** A relative path is taken relative to the test mount point ~/Pictures */
 	ImageFile(const QString &path);
+	/** File found on a drive (e.g. by ImageIndex), with the drive's identifier (0 if none) */
+	ImageFile(const QString &path, char drive);
 	~ImageFile() noexcept;
 	QString getPath() const noexcept { return path_; }
+	std::set<char> const &getDrives() const noexcept { return drives_; }
+	qint64 getSize() const noexcept { return size_; }
+	qint64 getModified() const noexcept { return mtime_; }
+	QByteArray getChecksum() const noexcept { return checksum_; }
+	/** Set by Checksummer */
+	void setChecksum(QByteArray const &sum) { checksum_ = sum; }
 };
 
 
@@ -32,11 +47,14 @@ public:
 	independently of its placement in a window. */
 
 class Image final : public Transformable {
-	// TODO: checksum
 	ImageFile const imgf_;
     transform wf_;
 public:
 	Image( ImageFile const &imgf );
+	/** Create from pixels already decoded (e.g. by ImageLoader)
+	 * \param reduction source pixels per pixel if decoded at reduced size or a preview
+	 * \param hold the pixels' holder, if SourceRegistry shares them */
+	Image( ImageFile const &imgf, QPixmap pixels, float reduction = 1.0f, std::shared_ptr<void const> hold = {} );
 	virtual ~Image();
     Image(Image &) = delete;
     Image(Image &&) = delete;
@@ -45,6 +63,10 @@ public:
     /** The image we're holding (Transformable::img_)
      * Qt docs say QPixmap can be passed by value */
     [[nodiscard]] const QPixmap getImage() const { return img_; }
+	/** The file the image was loaded from */
+	[[nodiscard]] ImageFile const &getFile() const noexcept { return imgf_; }
+	/** Content checksum identifying the image wherever it is stored (empty if unknown) */
+	[[nodiscard]] QByteArray getChecksum() const noexcept { return imgf_.getChecksum(); }
 	/** Returns a filename (basename) identifying the file */
 	[[nodiscard]] QString getFilename() const noexcept;
     /** Add a transform to the transform for this image, taking ownership */
@@ -1,6 +1,6 @@
 CONFIG += c++2a
 CONFIG += warn_on
 CONFIG += debug
-HEADERS = xwin.hh image.hh common.hh transform.hh decor.hh
-SOURCES = xwin.cc image.cc main.cc transform.cc decor.cc
+HEADERS = checksum.hh xwin.hh image.hh journal.hh common.hh transform.hh decor.hh exif.hh loader.hh memory.hh preview.hh resample.hh scanner.hh source.hh spatial.hh tiled.hh workers.hh
+SOURCES = checksum.cc xwin.cc image.cc journal.cc main.cc transform.cc decor.cc exif.cc loader.cc memory.cc preview.cc resample.cc scanner.cc source.cc spatial.cc tiled.cc workers.cc
 TARGET = imgex
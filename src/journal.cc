@@ -0,0 +1,327 @@
+#include "journal.hh"
+#include "checksum.hh"
+#include "image.hh"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <ios>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <QFile>
+
+
+namespace {
+
+/** Start of a journal file: magic and version (2: moves on the canvas of all screens, as sessions) */
+char const journal_magic[8] = {'I', 'X', 'J', 'N', 2, 0, 0, 0};
+
+/** How long edits may wait to be written */
+constexpr auto write_interval = std::chrono::milliseconds(200);
+/** Compact when the file has this many entries more than there are images */
+constexpr std::size_t compact_after = 4096;
+
+
+bool
+write_all(int fd, char const *p, std::size_t n) noexcept
+{
+    while(n) {
+        ssize_t w = ::write(fd, p, n);
+        if(w < 0) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+}
+
+
+Journal::Journal(QString const &path) : path_(path), fd_(-1), recovered_(), mtx_(), queue_(), next_id_(0),
+                                        requested_(0), done_(0), clear_(false), stop_(false), state_(),
+                                        garbage_(0), rewrite_(false)
+{
+    fd_ = ::open(QFile::encodeName(path_).constData(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd_ < 0)
+        throw std::ios_base::failure("Cannot open journal " + path_.toStdString());
+    replay();
+    for(auto const &[id, q] : state_) {
+        std::string const &p = q.payload;
+        image im{QString(), 0, 0, 0, QByteArray(), Transformable::transform()};
+        if(p.size() < 18)
+            continue;
+        std::memcpy(&im.size, p.data(), 8);
+        std::memcpy(&im.mtime, p.data() + 8, 8);
+        im.drive = p[16];
+        std::size_t const clen = std::min<std::size_t>(static_cast<unsigned char>(p[17]), p.size() - 18);
+        im.checksum = QByteArray(p.data() + 18, clen);
+        im.path = QFile::decodeName(QByteArray(p.data() + 18 + clen, p.size() - 18 - clen));
+        if(q.e.crop[2] > 0 && q.e.crop[3] > 0)
+            im.tx.crop_ = QRect(q.e.crop[0], q.e.crop[1], q.e.crop[2], q.e.crop[3]);
+        im.tx.zoom_ = q.e.zoom;
+        im.tx.move_ = QPoint(q.e.move[0], q.e.move[1]);
+        recovered_.push_back(im);
+    }
+    // Whoever restores the images adds them again; until then, the file keeps them
+    if(!state_.empty())
+        next_id_ = state_.rbegin()->first + 1;
+    if(recovered_.empty())
+        compact();
+    else
+        rewrite_ = true;
+    state_.clear();
+    writer_ = std::thread(&Journal::write_loop, this);
+}
+
+
+Journal::~Journal()
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    ::close(fd_);
+}
+
+
+QString
+Journal::for_session(QString const &session)
+{
+    return session + ".journal";
+}
+
+
+Journal::entry
+Journal::make(kind type, std::uint32_t id, Transformable::transform const &tx) noexcept
+{
+    entry e{};
+    e.id = id;
+    e.type = type;
+    if(tx.crop_.isValid()) {
+        e.crop[0] = tx.crop_.x();
+        e.crop[1] = tx.crop_.y();
+        e.crop[2] = tx.crop_.width();
+        e.crop[3] = tx.crop_.height();
+    }
+    e.zoom = tx.zoom_;
+    e.move[0] = tx.move_.x();
+    e.move[1] = tx.move_.y();
+    return e;
+}
+
+
+void
+Journal::seal(queued &q) noexcept
+{
+    q.e.length = static_cast<std::uint32_t>(q.payload.size());
+    q.e.check = 0;
+    hash128 h;
+    h.update(&q.e, sizeof(q.e));
+    h.update(q.payload.data(), q.payload.size());
+    QByteArray const d{h.digest()};
+    std::memcpy(&q.e.check, d.constData(), sizeof(q.e.check));
+}
+
+
+void
+Journal::push(entry e, std::string payload)
+{
+    queue_.push_back(queued{e, std::move(payload)});
+}
+
+
+std::uint32_t
+Journal::add(ImageFile const &imgf, Transformable::transform const &tx)
+{
+    // Identity and checksum first, then the path filling the rest
+    std::string payload(18, '\0');
+    std::int64_t const size = imgf.getSize(), mtime = imgf.getModified();
+    std::memcpy(payload.data(), &size, 8);
+    std::memcpy(payload.data() + 8, &mtime, 8);
+    auto const &drives = imgf.getDrives();
+    payload[16] = drives.empty() ? 0 : *drives.begin();
+    QByteArray const sum{imgf.getChecksum().left(255)};
+    payload[17] = static_cast<char>(sum.size());
+    payload.append(sum.constData(), sum.size());
+    payload.append(QFile::encodeName(imgf.getPath()).constData());
+
+    std::lock_guard<std::mutex> lk(mtx_);
+    std::uint32_t const id = next_id_++;
+    push(make(k_add, id, tx), std::move(payload));
+    return id;
+}
+
+
+void
+Journal::edit(std::uint32_t id, Transformable::transform const &tx)
+{
+    entry const e{make(k_edit, id, tx)};
+    // No wakeup: the writer comes round within write_interval anyway
+    std::lock_guard<std::mutex> lk(mtx_);
+    push(e);
+}
+
+
+void
+Journal::remove(std::uint32_t id)
+{
+    entry const e{make(k_remove, id, Transformable::transform())};
+    std::lock_guard<std::mutex> lk(mtx_);
+    push(e);
+}
+
+
+void
+Journal::clear()
+{
+    std::unique_lock<std::mutex> lk(mtx_);
+    queue_.clear();
+    clear_ = true;
+    std::uint64_t const r = ++requested_;
+    wake_.notify_one();
+    written_.wait(lk, [this, r] { return done_ >= r; });
+}
+
+
+void
+Journal::flush()
+{
+    std::unique_lock<std::mutex> lk(mtx_);
+    std::uint64_t const r = ++requested_;
+    wake_.notify_one();
+    written_.wait(lk, [this, r] { return done_ >= r; });
+}
+
+
+void
+Journal::write_loop()
+{
+    std::unique_lock<std::mutex> lk(mtx_);
+    for(;;) {
+        wake_.wait_for(lk, write_interval, [this] { return stop_ || requested_ != done_; });
+        std::vector<queued> batch;
+        batch.swap(queue_);
+        bool const clear = clear_, stop = stop_;
+        std::uint64_t const req = requested_;
+        clear_ = false;
+        lk.unlock();
+
+        // Entries queued after a clear are in the batch
+        if(clear || (rewrite_ && !batch.empty())) {
+            state_.clear();
+            for(auto &q : batch)
+                apply(q);
+            compact();
+            rewrite_ = false;
+        } else if(!batch.empty()) {
+            append(batch);
+        }
+        if(garbage_ > compact_after)
+            compact();
+
+        lk.lock();
+        done_ = req;
+        written_.notify_all();
+        if(stop && queue_.empty())
+            break;
+    }
+}
+
+
+void
+Journal::apply(queued &q)
+{
+    switch(q.e.type) {
+    case k_add:
+        state_[q.e.id] = std::move(q);
+        break;
+    case k_edit:
+        if(auto p = state_.find(q.e.id); p != state_.end()) {
+            std::copy(q.e.crop, q.e.crop + 4, p->second.e.crop);
+            p->second.e.zoom = q.e.zoom;
+            std::copy(q.e.move, q.e.move + 2, p->second.e.move);
+        }
+        ++garbage_;
+        break;
+    case k_remove:
+        state_.erase(q.e.id);
+        garbage_ += 2;
+        break;
+    }
+}
+
+
+void
+Journal::append(std::vector<queued> &batch)
+{
+    std::string buf;
+    for(auto &q : batch) {
+        seal(q);
+        buf.append(reinterpret_cast<char const *>(&q.e), sizeof(q.e));
+        buf.append(q.payload);
+        apply(q);
+    }
+    // One write and one sync for everything that came in since last time
+    if(write_all(fd_, buf.data(), buf.size()))
+        ::fdatasync(fd_);
+}
+
+
+void
+Journal::compact()
+{
+    std::string buf(journal_magic, sizeof(journal_magic));
+    for(auto &[id, q] : state_) {
+        seal(q);
+        buf.append(reinterpret_cast<char const *>(&q.e), sizeof(q.e));
+        buf.append(q.payload);
+    }
+    // Written aside and renamed over the journal, so a crash leaves one or the other
+    QByteArray const tmp{QFile::encodeName(path_ + ".new")};
+    int fd = ::open(tmp.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return;
+    if(!write_all(fd, buf.data(), buf.size()) || ::fdatasync(fd) || ::rename(tmp.constData(), QFile::encodeName(path_).constData())) {
+        ::close(fd);
+        ::unlink(tmp.constData());
+        return;
+    }
+    ::close(fd_);
+    fd_ = fd;
+    garbage_ = 0;
+}
+
+
+void
+Journal::replay()
+{
+    struct stat st;
+    if(fstat(fd_, &st) || static_cast<std::size_t>(st.st_size) < sizeof(journal_magic))
+        return;
+    std::string buf(st.st_size, '\0');
+    if(::pread(fd_, buf.data(), buf.size(), 0) != static_cast<ssize_t>(buf.size()))
+        return;
+    if(!std::equal(journal_magic, journal_magic + sizeof(journal_magic), buf.data()))
+        return;
+    std::size_t pos = sizeof(journal_magic);
+    while(buf.size() - pos >= sizeof(entry)) {
+        queued q;
+        std::memcpy(&q.e, buf.data() + pos, sizeof(entry));
+        if(q.e.length > buf.size() - pos - sizeof(entry))
+            break;
+        q.payload.assign(buf.data() + pos + sizeof(entry), q.e.length);
+        std::uint32_t const check = q.e.check;
+        seal(q);
+        // The end of an entry being written when we crashed
+        if(q.e.check != check)
+            break;
+        pos += sizeof(entry) + q.e.length;
+        apply(q);
+    }
+}
@@ -0,0 +1,136 @@
+#ifndef __IMGEX_JOURNAL_H
+#define __IMGEX_JOURNAL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <QByteArray>
+#include <QString>
+#include "transform.hh"
+
+class ImageFile;
+
+
+/** Journal records the edits to a session as they happen, so a crash loses
+ * at most the last fraction of a second.
+ *
+ * Each edit is a small fixed size entry carrying the image's whole transform
+ * (in source pixels, as Session), so the latest entry for an image is its
+ * state.  Recording an edit just queues it; a background thread appends the
+ * queue to the journal file with a single write and a single fdatasync.  When
+ * enough entries have accumulated, the thread compacts the journal into one
+ * entry per image, written to a new file which atomically replaces the old.
+ *
+ * A journal left over from a run which didn't finish (a clean exit saves the
+ * session and clears the journal) is replayed when it is opened.
+ */
+class Journal final {
+public:
+    /** An image as rebuilt from the journal */
+    struct image {
+        QString path;
+        char drive;
+        std::int64_t size, mtime;
+        QByteArray checksum;
+        /** Transform in source pixels */
+        Transformable::transform tx;
+    };
+
+    /** Open the journal, replaying what is in it (see recovered), and start writing
+     * \throws std::ios_base::failure if the file can't be opened */
+    explicit Journal(QString const &path);
+    /** Writes what is queued */
+    ~Journal();
+    Journal(Journal const &) = delete;
+    Journal &operator=(Journal const &) = delete;
+
+    /** The images found in the journal when it was opened, lowest first */
+    [[nodiscard]] std::vector<image> const &recovered() const noexcept { return recovered_; }
+
+    /** Record a new image, returning the number identifying it to the journal
+     * \param tx its transform in source pixels */
+    std::uint32_t add(ImageFile const &, Transformable::transform const &tx);
+    /** Record an image's new transform (in source pixels); cheap enough to call on every edit */
+    void edit(std::uint32_t id, Transformable::transform const &tx);
+    /** Record an image leaving the session */
+    void remove(std::uint32_t id);
+
+    /** Empty the journal, e.g. once the session has been saved */
+    void clear();
+
+    /** Wait until everything recorded so far is on disk */
+    void flush();
+
+    /** Name of the journal going with a session file */
+    static QString for_session(QString const &session);
+
+private:
+    enum kind : std::uint8_t { k_add = 1, k_edit, k_remove };
+
+    /** An entry as written; an add is followed by its payload (see add) */
+    struct entry {
+        /** Bytes of payload following */
+        std::uint32_t length;
+        /** Hash of the entry (with check 0) and its payload, to find a torn end after a crash */
+        std::uint32_t check;
+        std::uint32_t id;
+        kind type;
+        std::uint8_t reserved[3];
+        std::int32_t crop[4];
+        float zoom;
+        std::int32_t move[2];
+        std::uint32_t reserved2;
+    };
+
+    struct queued {
+        entry e;
+        std::string payload;
+    };
+
+    QString const path_;
+    int fd_;
+    std::vector<image> recovered_;
+
+    std::mutex mtx_;
+    /** Signalled to stop the writer early: to stop, flush or clear */
+    std::condition_variable wake_;
+    /** Signalled by the writer when it has written everything up to a generation */
+    std::condition_variable written_;
+    std::vector<queued> queue_;
+    std::uint32_t next_id_;
+    /** Number of requests to write out (flush, clear) and how many have been done */
+    std::uint64_t requested_, done_;
+    bool clear_, stop_;
+
+    /** The latest entry for each live image, as the writer has written them; only the writer uses it */
+    std::map<std::uint32_t, queued> state_;
+    /** Entries in the file beyond one per live image */
+    std::size_t garbage_;
+    /** The file still holds what was recovered, to be replaced once the images are added again */
+    bool rewrite_;
+
+    std::thread writer_;
+
+    /** Queue an entry; call with mtx_ held */
+    void push(entry e, std::string payload = std::string());
+    void write_loop();
+    /** Apply an entry to state_ */
+    void apply(queued &);
+    /** Append entries to the file and sync it */
+    void append(std::vector<queued> &);
+    /** Rewrite the file from state_ */
+    void compact();
+    /** Read the file into state_, stopping at the first damaged entry */
+    void replay();
+
+    static void seal(queued &) noexcept;
+    static entry make(kind, std::uint32_t id, Transformable::transform const &) noexcept;
+};
+
+
+#endif
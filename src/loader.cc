@@ -0,0 +1,282 @@
+#include "loader.hh"
+#include "checksum.hh"
+#include "common.hh"
+#include "exif.hh"
+#include "image.hh"
+#include "preview.hh"
+#include <condition_variable>
+#include <cstdlib>
+#include <fcntl.h>
+#include <mutex>
+#include <unistd.h>
+#include <QBuffer>
+#include <QFile>
+#include <QImageReader>
+#include <QMetaObject>
+#include <QObject>
+
+
+namespace {
+
+/** Convert a decoded image to the format drawn fastest: RGB32 if every pixel is
+ * opaque (whatever the file's format said), else premultiplied ARGB32.
+ * Done once, off the GUI thread, so drawing never converts and an opaque
+ * image can hide what is under it (see Transformable::opaque_area) */
+QImage
+normalise(QImage img)
+{
+    if(img.isNull() || img.format() == QImage::Format_RGB32)
+        return img;
+    if(!img.hasAlphaChannel())
+        return img.convertToFormat(QImage::Format_RGB32);
+    if(img.format() != QImage::Format_ARGB32_Premultiplied)
+        img = img.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    for(int y = 0; y < img.height(); ++y) {
+        auto const *row = reinterpret_cast<QRgb const *>(img.constScanLine(y));
+        for(int x = 0; x < img.width(); ++x)
+            if(qAlpha(row[x]) != 255)
+                return img;
+    }
+    // All opaque: the same bytes, read as RGB32
+    img.reinterpretAsFormat(QImage::Format_RGB32);
+    return img;
+}
+
+}
+
+
+/** Byte budget for decoded images which have not yet been consumed.
+ * Workers block in acquire() when the budget is exhausted; the budget is
+ * released when the result has been delivered (or discarded). */
+class ImageLoader::budget {
+    mutable std::mutex mtx_;
+    std::condition_variable freed_;
+    std::size_t const limit_;
+    std::size_t used_;
+    bool closed_;
+public:
+    explicit budget(std::size_t limit) : limit_(limit), used_(0), closed_(false) {}
+
+    /** Reserve n bytes, returns false if the loader is shutting down.
+     * A single image larger than the whole budget is let through when nothing else is pending */
+    bool acquire(std::size_t n)
+    {
+        std::unique_lock<std::mutex> lk(mtx_);
+        freed_.wait(lk, [this, n] { return closed_ || used_ == 0 || used_ + n <= limit_; });
+        if(closed_)
+            return false;
+        used_ += n;
+        return true;
+    }
+
+    void release(std::size_t n)
+    {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            used_ -= n;
+        }
+        freed_.notify_all();
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            closed_ = true;
+        }
+        freed_.notify_all();
+    }
+
+    std::size_t used() const
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return used_;
+    }
+};
+
+
+namespace {
+
+/** Holds a reservation against the budget for as long as a result is in flight */
+class reservation {
+    std::shared_ptr<ImageLoader::budget> budget_;
+    std::size_t bytes_;
+public:
+    reservation(std::shared_ptr<ImageLoader::budget> b, std::size_t n) : budget_(std::move(b)), bytes_(n) {}
+    ~reservation() { budget_->release(bytes_); }
+    reservation(reservation const &) = delete;
+    reservation &operator=(reservation const &) = delete;
+};
+
+
+/** Decoded size in bytes at 32 bits per pixel */
+std::size_t
+image_bytes(QSize sz) noexcept
+{
+    if(!sz.isValid())
+        return 0;
+    return static_cast<std::size_t>(sz.width()) * static_cast<std::size_t>(sz.height()) * 4;
+}
+
+
+/** Decode the largest preview embedded in a camera file (see ExifReader), reduced to fit
+ * \param source size of the main image, if known */
+ImageLoader::result
+embedded_preview(QString const &path, QSize source, QSize fit)
+{
+    ImageLoader::result res;
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return res;
+    QByteArray jpeg;
+    QSize size;
+    {
+        ExifReader exif(fd);
+        if(auto p = exif.largest()) {
+            jpeg = exif.read(*p);
+            size = QSize(p->width, p->height);
+        }
+    }
+    ::close(fd);
+    if(jpeg.isEmpty())
+        return res;
+    QBuffer buf(&jpeg);
+    QImageReader rd(&buf, "jpeg");
+    int const d = ImageLoader::reduction_for(size, fit);
+    if(d > 1)
+        rd.setScaledSize(QSize((size.width() + d - 1) / d, (size.height() + d - 1) / d));
+    if(!rd.read(&res.image))
+        return ImageLoader::result();
+    res.image = normalise(std::move(res.image));
+    // RAW files may be readable only through their preview
+    res.source_size = source.isValid() ? source : size;
+    res.reduction = static_cast<float>(res.source_size.width()) / res.image.width();
+    res.interim = true;
+    return res;
+}
+
+}
+
+
+ImageLoader::ImageLoader(unsigned threads, std::size_t max_bytes, std::shared_ptr<PreviewCache> cache,
+                         std::shared_ptr<Checksummer> checksums) :
+        budget_(std::make_shared<budget>(max_bytes)), cache_(std::move(cache)), checksums_(std::move(checksums)),
+        pool_(threads)
+{
+}
+
+
+ImageLoader::ImageLoader() : ImageLoader(env_number("IMGEX_LOAD_THREADS", 0),
+                                         env_number("IMGEX_LOAD_BUDGET", 512) << 20,
+                                         PreviewCache::shared(), Checksummer::shared())
+{
+}
+
+
+ImageLoader::~ImageLoader()
+{
+    // Unblock workers waiting for budget; pool_ then joins them
+    budget_->close();
+}
+
+
+int
+ImageLoader::reduction_for(QSize source, QSize fit) noexcept
+{
+    if(!source.isValid() || !fit.isValid())
+        return 1;
+    int d = 1;
+    // Halving is fine while the image still covers all of fit: a portrait
+    // photo zoomed to fill a landscape screen's width needs its pixels then
+    while(d < 8 && 2 * d * fit.width() <= source.width() && 2 * d * fit.height() <= source.height())
+        d *= 2;
+    return d;
+}
+
+
+void
+ImageLoader::load(ImageFile const &imgf, QSize fit, QObject *context, callback_t cb)
+{
+    // imgf is copied (not const) so the checksum can be recorded in it
+    pool_.submit([imgf = ImageFile(imgf), fit, context, cb = std::move(cb), b = budget_, cache = cache_, sums = checksums_]() mutable {
+        // Every image arrives normalised: decoded ones below, cached ones as they were stored
+        auto deliver = [context, &cb, &b](result &&res, std::size_t bytes) {
+            auto held = std::make_shared<reservation>(b, bytes);
+            QMetaObject::invokeMethod(context, [res = std::move(res), cb, held]() mutable {
+                cb(res);
+            }, Qt::QueuedConnection);
+        };
+        result res;
+        // Remembered checksums cost nothing, so the cache is searched before the card is read
+        if(sums && imgf.getChecksum().isEmpty())
+            imgf.setChecksum(sums->remembered(imgf));
+        bool const to_fit = fit.isValid();
+        if(to_fit && cache && (!sums || !imgf.getChecksum().isEmpty())) {
+            // A hit maps the preview in without touching the card at all
+            PreviewCache::entry hit = cache->lookup(imgf, fit);
+            if(!hit.image.isNull()) {
+                std::size_t const bytes = hit.image.sizeInBytes();
+                if(!b->acquire(bytes))
+                    return;
+                res.image = std::move(hit.image);
+                res.source_size = hit.source_size;
+                res.reduction = hit.reduction;
+                res.checksum = imgf.getChecksum();
+                deliver(std::move(res), bytes);
+                return;
+            }
+        }
+        QImageReader rd(imgf.getPath());
+        res.source_size = rd.size();
+        if(to_fit) {
+            // Something to look at while the image itself is read and decoded
+            result early = embedded_preview(imgf.getPath(), res.source_size, fit);
+            if(!early.image.isNull()) {
+                std::size_t const n = early.image.sizeInBytes();
+                if(!b->acquire(n))
+                    return;
+                deliver(std::move(early), n);
+            }
+        }
+        // Reading the whole file for its checksum also brings it into the page cache for the decoder
+        if(sums && imgf.getChecksum().isEmpty())
+            imgf.setChecksum(sums->checksum(imgf));
+        res.checksum = imgf.getChecksum();
+        int const d = reduction_for(res.source_size, fit);
+        res.reduction = d;
+        QSize decoded{res.source_size};
+        if(d > 1) {
+            // Rounding up matches libjpeg's scaled output, so the JPEG plugin
+            // decodes straight to this size without a further resample
+            decoded = QSize((decoded.width() + d - 1) / d, (decoded.height() + d - 1) / d);
+            rd.setScaledSize(decoded);
+        }
+        // Reserve before decoding so the budget bounds memory actually in use
+        std::size_t bytes = image_bytes(decoded);
+        if(bytes && !b->acquire(bytes))
+            return;
+        if(!rd.read(&res.image)) {
+            res.error = rd.errorString();
+            res.image = QImage();
+        } else if(!bytes) {
+            // The reader could not tell us the size up front
+            res.source_size = res.image.size();
+            res.reduction = 1.0f;
+            bytes = image_bytes(res.source_size);
+            if(!b->acquire(bytes))
+                return;
+        }
+        // Normalised before caching, so a hit needs no conversion
+        res.image = normalise(std::move(res.image));
+        if(to_fit && cache && !res.image.isNull())
+            cache->store(imgf, fit, res.image, res.source_size, d);
+        deliver(std::move(res), bytes);
+    });
+}
+
+
+std::size_t
+ImageLoader::pending_bytes() const
+{
+    return budget_->used();
+}
@@ -0,0 +1,93 @@
+#ifndef __IMGEX_LOADER_H
+#define __IMGEX_LOADER_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include "workers.hh"
+
+class Checksummer;
+class ImageFile;
+class PreviewCache;
+class QObject;
+
+
+/** ImageLoader decodes image files on a WorkerPool and hands the pixels back
+ * to the GUI thread.
+ *
+ * Decoded images are produced as QImage, which unlike QPixmap may be created
+ * off the GUI thread; conversion to a pixmap happens in the callback.
+ * Decoded pixels count against a byte budget until the callback has run,
+ * so a full memory card does not queue up gigabytes of images while the
+ * GUI thread is catching up.
+ */
+class ImageLoader final {
+public:
+    /** Outcome of a load, passed to the callback on the GUI thread */
+    struct result {
+        /** Decoded pixels, null if the load failed */
+        QImage image;
+        /** Size of the image as stored in the file */
+        QSize source_size;
+        /** Source pixels per decoded pixel: a power of two when decoded to fit,
+         * 1 for full resolution, anything for an embedded preview */
+        float reduction = 1.0f;
+        /** An embedded preview, delivered ahead of the decoded image which will follow */
+        bool interim = false;
+        /** Content checksum of the file, if it was computed (see ImageFile::setChecksum) */
+        QByteArray checksum;
+        QString error;
+    };
+    typedef std::function<void(result &)> callback_t;
+
+    /** \param threads number of decoding threads, 0 for one per core
+     * \param max_bytes maximum bytes of decoded pixels waiting for the GUI thread
+     * \param cache where to look up and store decoded previews (may be null)
+     * \param checksums checksums files without one before they are loaded (may be null) */
+    ImageLoader(unsigned threads, std::size_t max_bytes, std::shared_ptr<PreviewCache> cache = nullptr,
+                std::shared_ptr<Checksummer> checksums = nullptr);
+    /** Default configuration, overridden by IMGEX_LOAD_THREADS and IMGEX_LOAD_BUDGET (in MB),
+     * using the shared preview cache and checksums */
+    ImageLoader();
+    ~ImageLoader();
+    ImageLoader(ImageLoader const &) = delete;
+    ImageLoader(ImageLoader &&) = delete;
+    ImageLoader &operator=(ImageLoader const &) = delete;
+    ImageLoader &operator=(ImageLoader &&) = delete;
+
+    /** Queue a file for decoding
+     * \param fit size the image will be shown on (e.g. the screen), or an invalid size for full resolution.
+     * Images decoded to fit are served from (and added to) the preview cache.
+     * On a cache miss, the largest preview embedded in the file (EXIF thumbnail,
+     * RAW preview) is delivered first as an interim result
+     * \param context QObject whose (GUI) thread runs the callback; it must outlive the loader
+     * \param cb called with the result once decoded */
+    void load(ImageFile const &, QSize fit, QObject *context, callback_t cb);
+
+    /** Decode-to-fit: the largest power of two reduction (at most 1/8, as
+     * supported by JPEG DCT scaling) which still leaves the image covering
+     * fit in both directions, so it can be zoomed to fill the screen either
+     * way (e.g. a portrait photo to the width of a landscape screen) before
+     * the full resolution is needed */
+    [[nodiscard]] static int reduction_for(QSize source, QSize fit) noexcept;
+
+    /** Bytes of decoded pixels currently held back for the GUI thread */
+    [[nodiscard]] std::size_t pending_bytes() const;
+
+    /** Shared between the loader and results in flight */
+    class budget;
+
+private:
+    std::shared_ptr<budget> budget_;
+    std::shared_ptr<PreviewCache> cache_;
+    std::shared_ptr<Checksummer> checksums_;
+    /** Declared last so the workers are joined before the budget goes */
+    WorkerPool pool_;
+};
+
+
+#endif
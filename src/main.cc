@@ -1,13 +1,23 @@
+#include <QFile>
+#include <QFileInfo>
 #include <QString>
 #include <QScreen>
 #include <algorithm>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <unistd.h>
 #include <iostream>
 #include <fmt/core.h>
+#include "checksum.hh"
 #include "xwin.hh"
 #include "image.hh"
+#include "journal.hh"
+#include "memory.hh"
+#include "preview.hh"
+#include "scanner.hh"
+#include "session.hh"
+#include "source.hh"
 
 /**
  * NOTE this is just a test main program, not a production version
@@ -17,16 +27,57 @@
 int
 main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[])
 {
-	/* Test images to load - find your own and put them in  ~/Pictures (the test mount point) */
+	/* Test images to load - find your own and put them in  ~/Pictures (the test mount point),
+	 * or name a mount point (e.g. a camera card) to load every image found on it,
+	 * or a session file to carry on where it left off */
 	std::list<QString> files{ "testimg0.jpeg",
 							  "testimg1.png",
 							  "testimg2.jpeg",
                               "testimg3.jpg"};
+	char drive = 0;
+	Session restored;
+	char const *session_file = nullptr;
+	if(argc > 1 && QFileInfo(QFile::decodeName(argv[1])).isFile()) {
+		auto const t0 = std::chrono::steady_clock::now();
+		if(!restored.load(argv[1])) {
+			fmt::print(stderr, "Not a session: {}\n", argv[1]);
+			return 1;
+		}
+		auto const us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0);
+		fmt::print(stderr, "Session {}: {} images loaded in {} us\n", argv[1], restored.images().size(), us.count());
+		session_file = argv[1];
+		files.clear();
+	} else if(argc > 1) {
+		ImageIndex index(QFile::decodeName(argv[1]));
+		index.scan();
+		fmt::print(stderr, "Found {} images in {} ({} KB of index)\n", index.size(), argv[1],
+		           index.memory_usage() >> 10);
+		files.clear();
+		for(auto const &e : index)
+			files.push_back(index.path(e));
+		drive = index.drive();
+	}
+	// A journal left by a run which didn't exit cleanly is more recent than any session
+	std::shared_ptr<Journal> journal;
+	try {
+		journal = std::make_shared<Journal>(Journal::for_session(session_file ? QFile::decodeName(session_file) : Session::default_path()));
+	} catch( std::ios_base::failure const &e ) {
+		std::cerr << e.what() << std::endl;
+	}
+	std::vector<Journal::image> recovered;
+	if(journal && !journal->recovered().empty()) {
+		recovered = journal->recovered();
+		fmt::print(stderr, "Recovering {} images from the journal\n", recovered.size());
+		files.clear();
+	}
 	QGuiApplication app(argc, argv);
 
+    // The images, on a canvas which each window shows its screen's part of
+    Collage collage;
+    collage.set_journal(journal);
     std::vector<std::unique_ptr<XWindow>> windows;
     // create a window but don't show it yet
-    windows.emplace_back(std::make_unique<XWindow>());
+    windows.emplace_back(std::make_unique<XWindow>(collage));
     // Compatibility
     XWindow &w = *(windows[0].get());
 
@@ -39,7 +90,7 @@ main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[])
         auto geom = z->geometry();
         if( z != s ) {
             fmt::print(stderr, "Creating window on screen {}\n", c);
-            windows.emplace_back(std::make_unique<XWindow>(z));
+            windows.emplace_back(std::make_unique<XWindow>(collage, z));
         } else {
             fmt::print(stderr, "No window needed for screen {}\n", c);
         }
@@ -56,8 +107,8 @@ main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[])
 
 	for( auto const &fn : files ) {
 		try {
-            ImageFile imf(fn);
-            w.mkimage(imf, fn);
+            ImageFile imf(fn, drive);
+            collage.mkimage(imf, fn);
         } catch(FileNotFound const &f) {
             std::cerr << f.what() << f.filename().toStdString() << std::endl;
 		} catch( std::exception const &e ) {
@@ -67,6 +118,72 @@ main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[])
 		}
 	}
 
+	for( auto const &r : recovered ) {
+		try {
+			ImageFile imf(r.path, r.drive);
+			if(!r.checksum.isEmpty() && imf.getSize() == r.size && imf.getModified() == r.mtime)
+				imf.setChecksum(r.checksum);
+			collage.mkimage(imf, r.path, r.tx);
+		} catch(FileNotFound const &f) {
+			std::cerr << f.what() << f.filename().toStdString() << std::endl;
+		}
+	}
+
+	for( auto const &r : restored.images() ) {
+		if(!recovered.empty())
+			break;
+		QString const fn{QFile::decodeName(r.path.ptr)};
+		try {
+			ImageFile imf(fn, r.drive);
+			// The checksum still holds if the file hasn't changed
+			if(r.checksum_length && imf.getSize() == r.size && imf.getModified() == r.mtime)
+				imf.setChecksum(QByteArray(reinterpret_cast<char const *>(r.checksum), r.checksum_length));
+			collage.mkimage(imf, fn, r.transform());
+		} catch(FileNotFound const &f) {
+			std::cerr << f.what() << f.filename().toStdString() << std::endl;
+		}
+	}
+
 	app.exec();
+
+	Session ses;
+	collage.save(ses);
+	try {
+		ses.persist(session_file);
+		// Saved: nothing left to recover
+		if(journal)
+			journal->clear();
+	} catch( std::ios_base::failure const &e ) {
+		std::cerr << e.what() << std::endl;
+	}
+
+    for( auto const &m : windows ) {
+        auto const st = m->statistics();
+        fmt::print(stderr, "Painting: {} frames for {} invalidations, {} Mpx painted of {} Mpx invalidated, "
+                   "{} Mpx written, {} hidden images skipped\n",
+                   st.frames, st.invalidations, st.painted / 1000000, st.requested / 1000000,
+                   st.writes / 1000000, st.culled);
+    }
+    {
+        auto const mem = collage.memory_use();
+        // Sources are shared by the images of a file, so these are counted by the registry
+        SourceRegistry::shared()->prune();
+        auto const src = SourceRegistry::shared()->statistics();
+        fmt::print(stderr, "Memory: {} MB source ({} decodes of {} files), {} MB zoomed, {} MB mips, {} MB tiles\n",
+                   src.bytes >> 20, src.sources, src.files, mem.derived >> 20, mem.mips >> 20, mem.tiles >> 20);
+    }
+    {
+        auto const st = MemoryBudget::shared()->statistics();
+        fmt::print(stderr, "Memory budget {} MB: exceeded {} times, evicted {} mip pyramids, {} zooms, {} sources ({} MB); "
+                   "{} made again in {} ms\n", MemoryBudget::shared()->limit() >> 20, st.over, st.mips, st.derived,
+                   st.sources, st.bytes >> 20, st.remade,
+                   std::chrono::duration_cast<std::chrono::milliseconds>(st.remade_time).count());
+    }
+    Checksummer::shared()->save();
+    if(auto cache = PreviewCache::shared()) {
+        auto st = cache->statistics();
+        fmt::print(stderr, "Preview cache: {} hits, {} misses, {} stored, {} evicted, {} MB on disk\n",
+                   st.hits, st.misses, st.stores, st.evictions, st.bytes >> 20);
+    }
 	return 0;
 }
@@ -0,0 +1,128 @@
+#include "memory.hh"
+#include "common.hh"
+#include "source.hh"
+#include "xwin.hh"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <QCoreApplication>
+#include <QMetaObject>
+
+
+MemoryBudget::MemoryBudget(std::size_t limit) : limit_(limit), collages_(), clock_(0),
+                                                 stats_{0, 0, 0, 0, 0, 0, std::chrono::steady_clock::duration::zero()},
+                                                 pending_(false)
+{
+}
+
+
+std::shared_ptr<MemoryBudget>
+MemoryBudget::shared()
+{
+    static std::shared_ptr<MemoryBudget> budget =
+            std::make_shared<MemoryBudget>(std::size_t(env_number("IMGEX_MEMORY_BUDGET", 1024)) << 20);
+    return budget;
+}
+
+
+void
+MemoryBudget::attach(Collage *c)
+{
+    if(std::find(collages_.begin(), collages_.end(), c) == collages_.end())
+        collages_.push_back(c);
+}
+
+
+void
+MemoryBudget::detach(Collage *c) noexcept
+{
+    collages_.erase(std::remove(collages_.begin(), collages_.end(), c), collages_.end());
+}
+
+
+void
+MemoryBudget::allocated()
+{
+    auto *app = QCoreApplication::instance();
+    if(pending_ || !app)
+        return;
+    pending_ = true;
+    QMetaObject::invokeMethod(app, [this] {
+        pending_ = false;
+        enforce();
+    }, Qt::QueuedConnection);
+}
+
+
+void
+MemoryBudget::rematerialised(std::chrono::steady_clock::duration took)
+{
+    ++stats_.remade;
+    stats_.remade_time += took;
+}
+
+
+void
+MemoryBudget::enforce()
+{
+    struct candidate {
+        XILImage *img;
+        std::uint64_t drawn;
+        bool shown;
+    };
+    std::vector<XILImage *> imgs;
+    std::unordered_set<XILImage const *> shown;
+    for(Collage *c : collages_) {
+        c->images(imgs);
+        c->on_screen(shown);
+    }
+    // Images using each source, which is freed once none does
+    std::unordered_map<qint64, int> users;
+    std::size_t total = 0;
+    std::vector<candidate> all;
+    all.reserve(imgs.size());
+    for(XILImage *x : imgs) {
+        auto const m = x->memory_use();
+        if(users[x->source_key()]++ == 0)
+            total += m.source;
+        total += m.derived + m.mips;
+        all.push_back(candidate{x, x->last_drawn(), shown.count(x) != 0});
+    }
+    if(total <= limit_)
+        return;
+    ++stats_.over;
+    // Least recently drawn first
+    std::stable_sort(all.begin(), all.end(), [](candidate const &a, candidate const &b) { return a.drawn < b.drawn; });
+
+    auto release = [&](std::size_t bytes, std::uint64_t &count) {
+        if(bytes) {
+            total -= std::min(bytes, total);
+            stats_.bytes += bytes;
+            ++count;
+        }
+        return total <= limit_;
+    };
+    for(auto const &c : all)
+        if(!c.shown && release(c.img->evict_mips(), stats_.mips))
+            return;
+    for(auto const &c : all)
+        if(!c.shown && release(c.img->evict_derived(), stats_.derived))
+            return;
+    for(auto const &c : all) {
+        if(c.shown)
+            continue;
+        qint64 const key = c.img->source_key();
+        std::size_t const bytes = c.img->memory_use().source;
+        if(!c.img->evict_source())
+            continue;
+        ++stats_.sources;
+        if(--users[key] == 0) {
+            total -= std::min(bytes, total);
+            stats_.bytes += bytes;
+            if(total <= limit_)
+                break;
+        }
+    }
+    // The registry lets go of what no image holds now
+    SourceRegistry::shared()->prune();
+}
@@ -0,0 +1,81 @@
+#ifndef __IMGEX_MEMORY_H
+#define __IMGEX_MEMORY_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Collage;
+
+
+/** MemoryBudget keeps the pixels held by the images of a collage within a
+ * number of bytes, by evicting what can be made again.
+ *
+ * Images are stamped with the frame they were last drawn in, and when the
+ * total (sources shared by several images counted once, see SourceRegistry)
+ * is over budget, the least recently drawn give up, in order of how cheap
+ * they are to make again:
+ *  - mip levels of images not on screen, rebuilt as zooming needs them;
+ *  - zoomed pixels of images not on screen, resampled from the source when next drawn;
+ *  - sources of images not on screen, decoded again (from the preview cache,
+ *    usually) when next drawn, and the saved transform replayed on them.
+ * What is on screen, or hidden only by transparent images, is never evicted, so a
+ * budget smaller than the screenful is exceeded rather than thrashed.
+ * Decoded tiles have a capacity of their own (see TiledImage) and are not counted.
+ */
+class MemoryBudget final {
+public:
+    /** \param limit bytes of pixels to hold */
+    explicit MemoryBudget(std::size_t limit);
+    MemoryBudget(MemoryBudget const &) = delete;
+    MemoryBudget &operator=(MemoryBudget const &) = delete;
+
+    /** Shared by the application; the budget is IMGEX_MEMORY_BUDGET MB, 1024 by default */
+    static std::shared_ptr<MemoryBudget> shared();
+
+    [[nodiscard]] std::size_t limit() const noexcept { return limit_; }
+
+    /** Collages whose images count against the budget */
+    void attach(Collage *);
+    void detach(Collage *) noexcept;
+
+    /** The frame count, stamped on images as they are drawn */
+    [[nodiscard]] std::uint64_t now() const noexcept { return clock_; }
+    void tick() noexcept { ++clock_; }
+
+    /** Evict until within budget, or nothing evictable is left */
+    void enforce();
+    /** Pixels have been allocated (decoded, zoomed, a mip level built): enforce
+     * the budget once the event in hand is done, so nothing is evicted from
+     * under the code using it, and once however many allocations come first */
+    void allocated();
+
+    /** Something evicted was made again, taking this long */
+    void rematerialised(std::chrono::steady_clock::duration);
+
+    struct stats {
+        /** Times enforce found the budget exceeded */
+        std::uint64_t over;
+        /** Evictions of mip pyramids, zoomed pixels and sources */
+        std::uint64_t mips, derived, sources;
+        /** Bytes evicted */
+        std::uint64_t bytes;
+        /** Evicted pixels made again, and the time it took (for sources, from the request to the pixels) */
+        std::uint64_t remade;
+        std::chrono::steady_clock::duration remade_time;
+    };
+    [[nodiscard]] stats statistics() const noexcept { return stats_; }
+
+private:
+    std::size_t const limit_;
+    std::vector<Collage *> collages_;
+    std::uint64_t clock_;
+    stats stats_;
+    /** Whether an enforce is queued */
+    bool pending_;
+};
+
+
+#endif
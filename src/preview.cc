@@ -0,0 +1,218 @@
+#include "preview.hh"
+#include "common.hh"
+#include "image.hh"
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+
+namespace {
+
+/** On-disk layout of a preview: this header followed by the pixels,
+ * exactly as QImage holds them, so a mapped file can back a QImage directly */
+struct header {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t width, height, bytes_per_line, format;
+    std::uint32_t source_width, source_height, reduction;
+    std::uint32_t reserved[7];
+};
+static_assert(sizeof(header) == 64, "preview header must keep pixel rows aligned");
+
+constexpr char preview_magic[4] = { 'I', 'X', 'P', 'V' };
+constexpr std::uint32_t preview_version = 1;
+QString const preview_suffix{".ixpv"};
+
+
+/** A mapped preview, unmapped when the QImage using it goes */
+struct mapping {
+    void *addr;
+    std::size_t len;
+};
+
+void
+unmap(void *info)
+{
+    auto *m = static_cast<mapping *>(info);
+    munmap(m->addr, m->len);
+    delete m;
+}
+
+}
+
+
+PreviewCache::PreviewCache(QString const &dir, std::uint64_t capacity) : dir_(dir), capacity_(capacity), bytes_(0),
+                                                                        hits_(0), misses_(0), stores_(0), evictions_(0)
+{
+    QDir d;
+    d.mkpath(dir_);
+    d.setPath(dir_);
+    for(auto const &info : d.entryInfoList(QStringList("*" + preview_suffix), QDir::Files))
+        bytes_ += info.size();
+}
+
+
+QString
+imgex_cache_dir()
+{
+    QString base;
+    if(char const *xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        base = QFile::decodeName(xdg);
+    else if(char const *home = getenv("HOME"))
+        base = QFile::decodeName(home) + "/.cache";
+    else
+        base = QDir::tempPath();
+    base += "/imgex";
+    QDir().mkpath(base);
+    return base;
+}
+
+
+std::shared_ptr<PreviewCache>
+PreviewCache::shared()
+{
+    static std::shared_ptr<PreviewCache> cache = [] {
+        std::uint64_t const mb = env_number("IMGEX_CACHE_SIZE", 1024);
+        if(mb == 0)
+            return std::shared_ptr<PreviewCache>();
+        return std::make_shared<PreviewCache>(imgex_cache_dir() + "/previews", mb << 20);
+    }();
+    return cache;
+}
+
+
+QString
+PreviewCache::entry_path(ImageFile const &imgf, QSize fit) const
+{
+    QCryptographicHash h(QCryptographicHash::Sha1);
+    h.addData(QFile::encodeName(imgf.getPath()));
+    h.addData(QByteArray::number(imgf.getSize()) + ':' + QByteArray::number(imgf.getModified()) + ':'
+              + QByteArray::number(fit.width()) + 'x' + QByteArray::number(fit.height()) + ':');
+    h.addData(imgf.getChecksum());
+    return dir_ + '/' + QString::fromLatin1(h.result().toHex()) + preview_suffix;
+}
+
+
+PreviewCache::entry
+PreviewCache::lookup(ImageFile const &imgf, QSize fit)
+{
+    entry e{QImage(), QSize(), 1};
+    if(imgf.getSize() < 0) {
+        ++misses_;
+        return e;
+    }
+    QByteArray const fn{QFile::encodeName(entry_path(imgf, fit))};
+    int fd = ::open(fn.constData(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        ++misses_;
+        return e;
+    }
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(header)) {
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        // The modification time records use, for LRU eviction
+        futimens(fd, nullptr);
+    }
+    ::close(fd);
+    if(addr == MAP_FAILED) {
+        ++misses_;
+        return e;
+    }
+
+    auto const *h = static_cast<header const *>(addr);
+    std::size_t const len = st.st_size;
+    bool ok = std::equal(preview_magic, preview_magic + 4, h->magic) && h->version == preview_version
+              && h->format > QImage::Format_Invalid && h->format < QImage::NImageFormats
+              && sizeof(header) + static_cast<std::size_t>(h->bytes_per_line) * h->height <= len;
+    if(ok) {
+        auto const *pixels = static_cast<uchar const *>(addr) + sizeof(header);
+        e.image = QImage(pixels, h->width, h->height, h->bytes_per_line, static_cast<QImage::Format>(h->format),
+                         unmap, new mapping{addr, len});
+        e.source_size = QSize(h->source_width, h->source_height);
+        e.reduction = h->reduction;
+    }
+    if(e.image.isNull()) {
+        // QImage does not take ownership of data it rejects
+        munmap(addr, len);
+        ++misses_;
+        return e;
+    }
+    ++hits_;
+    return e;
+}
+
+
+void
+PreviewCache::store(ImageFile const &imgf, QSize fit, QImage const &img, QSize source_size, int reduction)
+{
+    if(img.isNull() || imgf.getSize() < 0)
+        return;
+    header h{};
+    std::copy(preview_magic, preview_magic + 4, h.magic);
+    h.version = preview_version;
+    h.width = img.width();
+    h.height = img.height();
+    h.bytes_per_line = img.bytesPerLine();
+    h.format = img.format();
+    h.source_width = source_size.width();
+    h.source_height = source_size.height();
+    h.reduction = reduction;
+
+    QString const path{entry_path(imgf, fit)};
+    // An entry stored again (by another image of the same file, say) replaces the old one
+    QFileInfo const old{path};
+    std::uint64_t const replaced = old.exists() ? old.size() : 0;
+    // QSaveFile writes to a temporary file and renames it on commit
+    QSaveFile f(path);
+    if(!f.open(QIODevice::WriteOnly))
+        return;
+    f.write(reinterpret_cast<char const *>(&h), sizeof(h));
+    f.write(reinterpret_cast<char const *>(img.constBits()), img.sizeInBytes());
+    if(!f.commit())
+        return;
+    ++stores_;
+    std::lock_guard<std::mutex> lk(mtx_);
+    bytes_ += sizeof(h) + img.sizeInBytes();
+    bytes_ -= std::min(replaced, bytes_);
+    if(bytes_ > capacity_)
+        evict();
+}
+
+
+void
+PreviewCache::evict()
+{
+    // Oldest first; trim to 90% so we don't list the directory on every store
+    QDir d(dir_);
+    auto entries = d.entryInfoList(QStringList("*" + preview_suffix), QDir::Files, QDir::Time | QDir::Reversed);
+    std::uint64_t const target = capacity_ / 10 * 9;
+    std::uint64_t total = 0;
+    for(auto const &info : entries)
+        total += info.size();
+    for(auto const &info : entries) {
+        if(total <= target)
+            break;
+        if(QFile::remove(info.filePath())) {
+            total -= info.size();
+            ++evictions_;
+        }
+    }
+    bytes_ = total;
+}
+
+
+PreviewCache::stats
+PreviewCache::statistics() const
+{
+    std::lock_guard<std::mutex> lk(mtx_);
+    return stats{hits_, misses_, stores_, evictions_, bytes_};
+}
@@ -0,0 +1,79 @@
+#ifndef __IMGEX_PREVIEW_H
+#define __IMGEX_PREVIEW_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+class ImageFile;
+
+
+/** Directory for imgex's caches: $XDG_CACHE_HOME/imgex, ~/.cache/imgex by default */
+QString imgex_cache_dir();
+
+
+/** PreviewCache keeps decoded screen-resolution previews in a local directory
+ * so images on removable media need not be decoded again next time.
+ *
+ * Previews are stored uncompressed and loaded by mapping the file, so a hit
+ * costs a page-in from local disk rather than a JPEG decode from the card.
+ * Entries are keyed by the file's path, size, modification time and
+ * checksum (when known) as well as the size they were decoded to fit.
+ * The cache is shared by all loader threads.
+ */
+class PreviewCache final {
+public:
+    /** A cached preview as returned by lookup */
+    struct entry {
+        /** Pixels, read-only and backed by the mapped file; null on a miss */
+        QImage image;
+        QSize source_size;
+        int reduction;
+    };
+
+    struct stats {
+        std::uint64_t hits, misses, stores, evictions;
+        /** Bytes currently used on disk */
+        std::uint64_t bytes;
+    };
+
+    /** \param dir cache directory, created if needed
+     * \param capacity maximum bytes on disk before the least recently used entries are evicted */
+    PreviewCache(QString const &dir, std::uint64_t capacity);
+    PreviewCache(PreviewCache const &) = delete;
+    PreviewCache &operator=(PreviewCache const &) = delete;
+
+    /** The cache shared by the application, in $XDG_CACHE_HOME/imgex/previews,
+     * capped at IMGEX_CACHE_SIZE MB (default 1024).
+     * Returns null if the cache is disabled (IMGEX_CACHE_SIZE=0) */
+    static std::shared_ptr<PreviewCache> shared();
+
+    /** Find the preview of a file decoded to fit a given size */
+    [[nodiscard]] entry lookup(ImageFile const &, QSize fit);
+
+    /** Store a preview; written atomically so readers never see a partial entry */
+    void store(ImageFile const &, QSize fit, QImage const &img, QSize source_size, int reduction);
+
+    [[nodiscard]] stats statistics() const;
+
+private:
+    QString dir_;
+    std::uint64_t const capacity_;
+    /** Serialises accounting and eviction; reads and writes of entries don't need it */
+    mutable std::mutex mtx_;
+    std::uint64_t bytes_;
+    std::atomic<std::uint64_t> hits_, misses_, stores_, evictions_;
+
+    /** Filename of the entry for a file */
+    QString entry_path(ImageFile const &, QSize fit) const;
+    /** Remove least recently used entries until we are within capacity; call with mtx_ held */
+    void evict();
+};
+
+
+#endif
@@ -0,0 +1,415 @@
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QImageIOHandler>
+#include <QImageReader>
+#include <QPainter>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <ios>
+#include <latch>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <fmt/core.h>
+#include "resample.hh"
+#include "session.hh"
+#include "tiff.hh"
+#include "workers.hh"
+
+/**
+ * imgex-render - render a saved session to an image file, without a display.
+ * Each image's transform is replayed from its source file into an offscreen
+ * QImage, so a collage can be made at any resolution (e.g. by cron, a
+ * wallpaper per monitor).  TIFF output is rendered and written a strip at a
+ * time, for print sizes which wouldn't fit in memory whole.
+ */
+
+
+namespace {
+
+/** Largest output rendered whole (bytes of pixels); larger ones must be TIFF, rendered in strips */
+constexpr std::uint64_t whole_limit = std::uint64_t(1) << 30;
+
+/** An image of the session, placed in the output */
+struct layer {
+    QString path;
+    /** Size of the image in its file */
+    QSize source;
+    /** The transform's plan, in window (not output) pixels */
+    Transformable::transform::plan plan;
+    /** Where it goes in the output */
+    QRect box;
+    /** Its pixels, box.size() of them, when rendered whole; null if it couldn't be read */
+    QImage pixels;
+};
+
+
+bool
+parse_size(char const *arg, QSize &size)
+{
+    int w, h;
+    if(sscanf(arg, "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0)
+        return false;
+    size = QSize(w, h);
+    return true;
+}
+
+
+/** Parse WxH or WxH+X+Y (X and Y may be negative: WxH-X-Y)
+ * @param has_origin set if X and Y were given */
+bool
+parse_geometry(char const *arg, QRect &geometry, bool &has_origin)
+{
+    int w, h, x = 0, y = 0;
+    int const n = sscanf(arg, "%dx%d%d%d", &w, &h, &x, &y);
+    if((n != 2 && n != 4) || w <= 0 || h <= 0)
+        return false;
+    geometry = QRect(x, y, w, h);
+    has_origin = n == 4;
+    return true;
+}
+
+
+/** Render the part of a layer's box (in output pixels) from its file.
+ * Only the source pixels under the part (and the filter's reach around them)
+ * are read, reduced by a whole factor while still larger than the target
+ * (the JPEG decoder then skips most of the work), and resampled the rest of the
+ * way.  Each part is resampled from the source positions the whole would be,
+ * with the filter's reach, so parts rendered separately meet without visible seams */
+QImage
+render_part(layer const &l, QRect part)
+{
+    QRect const &src = l.plan.source;
+    if(src.isEmpty() || part.isEmpty())
+        return QImage();
+    double const kx = double(src.width()) / l.box.width(), ky = double(src.height()) / l.box.height();
+    QRectF const want(src.x() + (part.x() - l.box.x()) * kx, src.y() + (part.y() - l.box.y()) * ky,
+                      part.width() * kx, part.height() * ky);
+
+    QImageReader rd(l.path);
+    QRect all{QPoint(0, 0), l.source};
+    if(rd.supportsOption(QImageIOHandler::ClipRect)) {
+        // Lanczos-3 reaches 3 target pixels either side
+        double const m = 3 * std::max({kx, ky, 1.0}) + 1;
+        all &= want.adjusted(-m, -m, m, m).toAlignedRect();
+        rd.setClipRect(all);
+    }
+    int const d = std::max(1, static_cast<int>(std::min(kx, ky)));
+    if(d > 1)
+        rd.setScaledSize(QSize((all.width() + d - 1) / d, (all.height() + d - 1) / d));
+    QImage img = rd.read();
+    if(img.isNull())
+        return img;
+    double const fx = double(img.width()) / all.width(), fy = double(img.height()) / all.height();
+    QRectF const from((want.x() - all.x()) * fx, (want.y() - all.y()) * fy, want.width() * fx, want.height() * fy);
+    return Resampler::shared()->scale(img, from, part.size());
+}
+
+
+/** A layer's pixels at output size, rendered a band of rows at a time and
+ * shared by the strips crossing the band.  A file is decoded once per band
+ * rather than once per strip (a JPEG is decoded from its top to the bottom of
+ * each clip, so per strip the work grew with the square of the height), and
+ * each band is dropped once the last strip crossing it has drawn it */
+class bands {
+    layer const &l_;
+    /** The part of the layer within the output */
+    QRect const shown_;
+    /** Output rows per band, and per strip */
+    int const rows_, strip_rows_;
+    std::mutex mtx_;
+    /** Rendered bands by number, with the number of strips yet to draw them */
+    std::map<int, std::pair<QImage, int>> held_;
+
+public:
+    bands(layer const &l, QSize output, int rows, int strip_rows) :
+            l_(l), shown_(l.box & QRect(QPoint(0, 0), output)), rows_(rows), strip_rows_(strip_rows), mtx_(), held_()
+    {
+    }
+
+    /** Draw the layer's part of area, the strip at output rows from area.top(), on p */
+    void draw(QPainter &p, QRect area)
+    {
+        QRect const part{shown_ & area};
+        if(part.isEmpty())
+            return;
+        for(int n = (part.top() - shown_.top()) / rows_; n <= (part.bottom() - shown_.top()) / rows_; ++n) {
+            QRect const b{band(n)}, piece{part & b};
+            QImage const px{take(n)};
+            if(!px.isNull())
+                p.drawImage(piece.topLeft() - area.topLeft(), px, piece.translated(-b.topLeft()));
+        }
+    }
+
+private:
+    [[nodiscard]] QRect band(int n) const noexcept
+    {
+        return QRect(shown_.left(), shown_.top() + n * rows_, shown_.width(), rows_) & shown_;
+    }
+
+    /** Band n's pixels, rendering them for the first strip to ask.  Strips of
+     * the same layer wait for each other here; other layers go ahead */
+    QImage take(int n)
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        auto p = held_.find(n);
+        if(p == held_.end()) {
+            QRect const b{band(n)};
+            int const strips = b.bottom() / strip_rows_ - b.top() / strip_rows_ + 1;
+            p = held_.emplace(n, std::make_pair(render_part(l_, b), strips)).first;
+        }
+        // Shared: the pixels outlive the band for as long as the strip draws them
+        QImage px{p->second.first};
+        if(--p->second.second == 0)
+            held_.erase(p);
+        return px;
+    }
+};
+
+
+/** Render the output in strips, each drawn by a worker, and write them in order,
+ * so memory use depends on the width of the output but not its height */
+void
+render_strips(std::vector<layer> const &layers, QSize output, unsigned threads, int dpi, QString const &file)
+{
+    std::mutex mtx;
+    std::condition_variable ready;
+    // Strips rendered, waiting to be written
+    std::map<int, QImage> done;
+    std::deque<bands> banded;
+    // Declared after what its jobs use, so on an exception it joins them first
+    WorkerPool pool(threads);
+    // No more strips in hand than keeps the workers busy, sized so they all take about 256 MB
+    int const ahead = 2 * pool.size();
+    int const rows = std::clamp(static_cast<int>((std::int64_t(256) << 20) / ((ahead + 1) * 4 * std::int64_t(output.width()))),
+                                16, output.height());
+    int const strips = (output.height() + rows - 1) / rows;
+
+    // The layers' bands take about 256 MB more, shared among as many as cross one strip
+    std::size_t crossing = 1;
+    for(int s = 0; s < strips; ++s) {
+        QRect const area(0, s * rows, output.width(), rows);
+        crossing = std::max<std::size_t>(crossing, std::count_if(layers.begin(), layers.end(),
+                                                                 [&](layer const &l) { return l.box.intersects(area); }));
+    }
+    for(auto const &l : layers) {
+        std::int64_t const row_bytes = 4 * std::int64_t(std::max(1, std::min(l.box.width(), output.width())));
+        int const band_rows = static_cast<int>(std::clamp<std::int64_t>((std::int64_t(256) << 20) / crossing / row_bytes,
+                                                                        rows, std::max(rows, l.box.height())));
+        banded.emplace_back(l, output, band_rows, rows);
+    }
+    TiffWriter tiff(file, output, rows, dpi);
+
+    auto submit = [&](int s) {
+        pool.submit([&, s] {
+            QRect const area(0, s * rows, output.width(), std::min(rows, output.height() - s * rows));
+            QImage strip(area.size(), QImage::Format_RGB32);
+            strip.fill(Qt::black);
+            QPainter p(&strip);
+            for(auto &b : banded)
+                b.draw(p, area);
+            p.end();
+            std::lock_guard<std::mutex> lk(mtx);
+            done.emplace(s, std::move(strip));
+            ready.notify_one();
+        });
+    };
+    int next = 0;
+    for(; next < std::min(ahead, strips); ++next)
+        submit(next);
+    for(int s = 0; s < strips; ++s) {
+        QImage strip;
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            ready.wait(lk, [&] { return done.count(s) != 0; });
+            strip = std::move(done[s]);
+            done.erase(s);
+        }
+        if(next < strips)
+            submit(next++);
+        tiff.write(strip);
+    }
+    tiff.finish();
+}
+
+
+void
+usage()
+{
+    fmt::print(stderr, "Usage: imgex-render [-c WxH[+X+Y]] [-s WxH] [-q quality] [-d dpi] [-j threads] session-file output-file\n"
+                       "  -c  part of the canvas to render, at X,Y on the canvas of all screens\n"
+                       "      (default: just enclosing the images; X,Y default to their top left)\n"
+                       "  -s  size of the output (default: the window size)\n"
+                       "  -q  quality for lossy formats, 0-100\n"
+                       "  -d  resolution recorded in TIFF output (default: 300)\n"
+                       "  -j  images decoded at once (default: one per core)\n");
+}
+
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    QRect canvas;
+    bool has_origin = false;
+    QSize output;
+    int quality = -1, dpi = 300;
+    unsigned threads = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "c:s:q:d:j:")) != -1) {
+        switch(opt) {
+        case 'c':
+            if(!parse_geometry(optarg, canvas, has_origin)) {
+                usage();
+                return 2;
+            }
+            break;
+        case 's':
+            if(!parse_size(optarg, output)) {
+                usage();
+                return 2;
+            }
+            break;
+        case 'q':
+            quality = std::clamp(atoi(optarg), 0, 100);
+            break;
+        case 'd':
+            dpi = std::max(1, atoi(optarg));
+            break;
+        case 'j':
+            threads = static_cast<unsigned>(atoi(optarg));
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if(argc - optind != 2) {
+        usage();
+        return 2;
+    }
+    char const *session_file = argv[optind], *output_file = argv[optind + 1];
+    // Image plugins only: no platform plugin, so no display is needed
+    QCoreApplication app(argc, argv);
+    auto const t0 = std::chrono::steady_clock::now();
+
+    Session ses;
+    if(!ses.load(session_file)) {
+        fmt::print(stderr, "Not a session: {}\n", session_file);
+        return 1;
+    }
+    auto const images = ses.images();
+    // Image sizes come from the file headers, which is all we read here
+    std::vector<layer> layers;
+    QRect all;
+    for(auto const &r : images) {
+        layer l{QFile::decodeName(r.path.ptr), QSize(), {}, QRect(), QImage()};
+        l.source = QImageReader(l.path).size();
+        if(!l.source.isValid()) {
+            fmt::print(stderr, "Cannot read {}\n", r.path.ptr);
+            continue;
+        }
+        l.plan = r.transform().compile(l.source);
+        all |= QRect(l.plan.offset, l.plan.size);
+        layers.push_back(std::move(l));
+    }
+    // Images are placed on the canvas of all screens, whose top left may be anywhere
+    if(all.isEmpty())
+        all = QRect(0, 0, 1, 1);
+    if(canvas.isEmpty())
+        canvas = all;
+    else if(!has_origin)
+        canvas.moveTopLeft(all.topLeft());
+    if(output.isEmpty())
+        output = canvas.size();
+    double const sx = double(output.width()) / canvas.width(), sy = double(output.height()) / canvas.height();
+    for(auto &l : layers) {
+        QPoint const at{l.plan.offset - canvas.topLeft()};
+        QPoint const tl(at.x() * sx, at.y() * sy);
+        QPoint const br((at.x() + l.plan.size.width()) * sx, (at.y() + l.plan.size.height()) * sy);
+        l.box = QRect(tl, QSize(std::max(1, br.x() - tl.x()), std::max(1, br.y() - tl.y())));
+    }
+
+    QString const out_name{QFile::decodeName(output_file)};
+    QString const suffix{QFileInfo(out_name).suffix().toLower()};
+    if(suffix == "tif" || suffix == "tiff") {
+        // Print sizes: never the whole output in memory
+        try {
+            render_strips(layers, output, threads, dpi, out_name);
+        } catch( std::ios_base::failure const &e ) {
+            fmt::print(stderr, "{}\n", e.what());
+            return 1;
+        }
+        auto const t1 = std::chrono::steady_clock::now();
+        fmt::print(stderr, "{} images rendered to {}x{} in strips in {} ms\n", layers.size(), output.width(), output.height(),
+                   std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+        return 0;
+    }
+    if(4 * static_cast<std::uint64_t>(output.width()) * output.height() > whole_limit) {
+        fmt::print(stderr, "{}x{} is too large to render whole: write a .tif, which is rendered in strips\n",
+                   output.width(), output.height());
+        return 1;
+    }
+
+    // Decode and scale every image at once; they don't depend on each other
+    {
+        WorkerPool pool(threads);
+        for(auto &l : layers)
+            pool.submit([&l] {
+                l.pixels = render_part(l, l.box);
+                if(l.pixels.isNull())
+                    fmt::print(stderr, "Cannot read {}\n", l.path.toStdString());
+            });
+        pool.wait();
+    }
+    auto const t1 = std::chrono::steady_clock::now();
+
+    // Stack them lowest first, each band of the output drawn by its own thread
+    QImage out(output, QImage::Format_RGB32);
+    if(out.isNull()) {
+        fmt::print(stderr, "Cannot make a {}x{} image\n", output.width(), output.height());
+        return 1;
+    }
+    out.fill(Qt::black);
+    uchar *bits = out.bits();
+    {
+        WorkerPool pool(threads);
+        int const bands = std::max(1, std::min(static_cast<int>(pool.size()), output.height() / 64));
+        std::latch done(bands);
+        for(int b = 0; b < bands; ++b)
+            pool.submit([&, b] {
+                int const y0 = output.height() * b / bands, y1 = output.height() * (b + 1) / bands;
+                // A view of the band's rows, sharing the output's pixels
+                QImage band(bits + static_cast<std::size_t>(y0) * out.bytesPerLine(), output.width(), y1 - y0,
+                            out.bytesPerLine(), out.format());
+                QPainter p(&band);
+                p.translate(0, -y0);
+                QRect const area(0, y0, output.width(), y1 - y0);
+                for(auto const &l : layers)
+                    if(!l.pixels.isNull() && l.box.intersects(area))
+                        p.drawImage(l.box.topLeft(), l.pixels);
+                p.end();
+                done.count_down();
+            });
+        done.wait();
+    }
+
+    if(!out.save(out_name, nullptr, quality)) {
+        fmt::print(stderr, "Cannot write {}\n", output_file);
+        return 1;
+    }
+    auto const t2 = std::chrono::steady_clock::now();
+    using ms = std::chrono::milliseconds;
+    fmt::print(stderr, "{} images rendered to {}x{} in {} ms ({} ms decoding and scaling, {} ms drawing and writing)\n",
+               images.size(), output.width(), output.height(), std::chrono::duration_cast<ms>(t2 - t0).count(),
+               std::chrono::duration_cast<ms>(t1 - t0).count(), std::chrono::duration_cast<ms>(t2 - t1).count());
+    return 0;
+}
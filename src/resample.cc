@@ -0,0 +1,415 @@
+#include "resample.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <latch>
+#include <numbers>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMGEX_X86 1
+#endif
+
+
+namespace {
+
+/** Fixed point precision of the filter weights */
+constexpr int weight_bits = 14;
+constexpr std::int32_t rounding = 1 << (weight_bits - 1);
+
+/** The source pixels contributing to each output pixel along one axis.
+ * Every output pixel has the same number of taps (some weights may be zero),
+ * so the kernels need no per-pixel bounds */
+struct taps {
+    /** First source pixel of each output pixel */
+    std::vector<int> first;
+    /** Taps per output pixel */
+    int n;
+    /** n weights for each output pixel */
+    std::vector<std::int16_t> weights;
+};
+
+
+double
+lanczos3(double x) noexcept
+{
+    if(x == 0.0)
+        return 1.0;
+    if(x <= -3.0 || x >= 3.0)
+        return 0.0;
+    double const px = std::numbers::pi * x;
+    return 3.0 * std::sin(px) * std::sin(px / 3.0) / (px * px);
+}
+
+
+double
+box(double x) noexcept
+{
+    return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+}
+
+
+/** Weights for scaling [offset, offset+length) of size source pixels to out pixels */
+taps
+make_taps(double offset, double length, int size, int out, Resampler::filter f)
+{
+    double const scale = length / out;
+    // Reducing, the filter widens to cover the source pixels merging into one
+    double const width = std::max(scale, 1.0);
+    double const support = (f == Resampler::filter::box ? 0.5 : 3.0) * width;
+    auto const kernel = f == Resampler::filter::box ? box : lanczos3;
+
+    taps t;
+    t.n = std::min(static_cast<int>(std::ceil(support)) * 2 + 1, size);
+    t.first.resize(out);
+    t.weights.assign(static_cast<std::size_t>(out) * t.n, 0);
+    std::vector<double> w(t.n);
+    for(int i = 0; i < out; ++i) {
+        double const centre = offset + (i + 0.5) * scale;
+        int lo = std::clamp(static_cast<int>(std::floor(centre - support + 0.5)), 0, size - 1);
+        int hi = std::clamp(static_cast<int>(std::floor(centre + support + 0.5)), lo + 1, size);
+        hi = std::min(hi, lo + t.n);
+        double sum = 0.0;
+        for(int j = lo; j < hi; ++j)
+            sum += w[j - lo] = kernel((j + 0.5 - centre) / width);
+        // Keep the taps inside the source so the kernels can read all n
+        int const first = std::min(lo, size - t.n);
+        t.first[i] = first;
+        std::int16_t *wt = &t.weights[static_cast<std::size_t>(i) * t.n];
+        if(sum == 0.0) {
+            // Only possible with the box filter at an edge: take the nearest pixel
+            wt[lo - first] = 1 << weight_bits;
+            continue;
+        }
+        for(int j = lo; j < hi; ++j)
+            wt[j - first] = static_cast<std::int16_t>(std::lround(w[j - lo] / sum * (1 << weight_bits)));
+    }
+    return t;
+}
+
+
+inline std::uint32_t
+clamp8(std::int32_t v) noexcept
+{
+    v >>= weight_bits;
+    return v < 0 ? 0 : v > 255 ? 255 : static_cast<std::uint32_t>(v);
+}
+
+
+/** Horizontal pass: scale one row of pixels */
+void
+rows_scalar(std::uint32_t const *src, std::uint32_t *dst, int out, taps const &t)
+{
+    for(int x = 0; x < out; ++x) {
+        std::uint32_t const *p = src + t.first[x];
+        std::int16_t const *w = &t.weights[static_cast<std::size_t>(x) * t.n];
+        std::int32_t c0 = rounding, c1 = rounding, c2 = rounding, c3 = rounding;
+        for(int k = 0; k < t.n; ++k) {
+            std::uint32_t const px = p[k];
+            c0 += static_cast<std::int32_t>(px & 0xff) * w[k];
+            c1 += static_cast<std::int32_t>(px >> 8 & 0xff) * w[k];
+            c2 += static_cast<std::int32_t>(px >> 16 & 0xff) * w[k];
+            c3 += static_cast<std::int32_t>(px >> 24) * w[k];
+        }
+        dst[x] = clamp8(c0) | clamp8(c1) << 8 | clamp8(c2) << 16 | clamp8(c3) << 24;
+    }
+}
+
+
+/** Vertical pass: combine n rows of bytes with weights w */
+void
+columns_scalar(std::uint8_t const *const *rows, int n, std::int16_t const *w, std::uint8_t *dst, int bytes)
+{
+    for(int i = 0; i < bytes; ++i) {
+        std::int32_t c = rounding;
+        for(int k = 0; k < n; ++k)
+            c += rows[k][i] * w[k];
+        dst[i] = static_cast<std::uint8_t>(clamp8(c));
+    }
+}
+
+
+#ifdef IMGEX_X86
+
+/** Two adjacent weights as the 32 bit pattern _mm_madd_epi16 wants */
+inline std::int32_t
+weight_pair(std::int16_t const *w) noexcept
+{
+    std::int32_t p;
+    std::memcpy(&p, w, sizeof(p));
+    return p;
+}
+
+
+__attribute__((target("sse4.1"))) void
+rows_sse41(std::uint32_t const *src, std::uint32_t *dst, int out, taps const &t)
+{
+    // Two pixels widened to 16 bits, rearranged to pair up their channels: b0 b1 g0 g1 r0 r1 a0 a1
+    __m128i const pairs = _mm_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+    for(int x = 0; x < out; ++x) {
+        std::uint32_t const *p = src + t.first[x];
+        std::int16_t const *w = &t.weights[static_cast<std::size_t>(x) * t.n];
+        __m128i acc = _mm_set1_epi32(rounding);
+        int k = 0;
+        for(; k + 1 < t.n; k += 2) {
+            __m128i px = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(p + k)));
+            px = _mm_shuffle_epi8(px, pairs);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weight_pair(w + k))));
+        }
+        if(k < t.n) {
+            __m128i const px = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(static_cast<int>(p[k])));
+            acc = _mm_add_epi32(acc, _mm_mullo_epi32(px, _mm_set1_epi32(w[k])));
+        }
+        acc = _mm_srai_epi32(acc, weight_bits);
+        acc = _mm_packs_epi32(acc, acc);
+        dst[x] = static_cast<std::uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(acc, acc)));
+    }
+}
+
+
+__attribute__((target("sse4.1"))) void
+columns_sse41(std::uint8_t const *const *rows, int n, std::int16_t const *w, std::uint8_t *dst, int bytes)
+{
+    int i = 0;
+    for(; i + 8 <= bytes; i += 8) {
+        __m128i lo = _mm_set1_epi32(rounding), hi = lo;
+        int k = 0;
+        for(; k + 1 < n; k += 2) {
+            __m128i const a = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(rows[k] + i)));
+            __m128i const b = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(rows[k + 1] + i)));
+            __m128i const wp = _mm_set1_epi32(weight_pair(w + k));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wp));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wp));
+        }
+        if(k < n) {
+            __m128i const a = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(rows[k] + i)));
+            __m128i const wp = _mm_set1_epi32(static_cast<std::uint16_t>(w[k]));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, _mm_setzero_si128()), wp));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, _mm_setzero_si128()), wp));
+        }
+        __m128i const v = _mm_packs_epi32(_mm_srai_epi32(lo, weight_bits), _mm_srai_epi32(hi, weight_bits));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(v, v));
+    }
+    for(; i < bytes; ++i) {
+        std::int32_t c = rounding;
+        for(int k = 0; k < n; ++k)
+            c += rows[k][i] * w[k];
+        dst[i] = static_cast<std::uint8_t>(clamp8(c));
+    }
+}
+
+
+__attribute__((target("avx2"))) void
+rows_avx2(std::uint32_t const *src, std::uint32_t *dst, int out, taps const &t)
+{
+    // As rows_sse41, with pixels 0,1 in the low lane and 2,3 in the high lane
+    __m256i const pairs = _mm256_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15,
+                                           0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+    __m256i const spread = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    for(int x = 0; x < out; ++x) {
+        std::uint32_t const *p = src + t.first[x];
+        std::int16_t const *w = &t.weights[static_cast<std::size_t>(x) * t.n];
+        __m256i acc8 = _mm256_setzero_si256();
+        int k = 0;
+        for(; k + 3 < t.n; k += 4) {
+            __m256i px = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const *>(p + k)));
+            px = _mm256_shuffle_epi8(px, pairs);
+            // Weights k, k+1 repeated in the low lane and k+2, k+3 in the high lane
+            __m256i const wp = _mm256_permutevar8x32_epi32(
+                _mm256_castsi128_si256(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(w + k))), spread);
+            acc8 = _mm256_add_epi32(acc8, _mm256_madd_epi16(px, wp));
+        }
+        __m128i acc = _mm_add_epi32(_mm_set1_epi32(rounding),
+                                    _mm_add_epi32(_mm256_castsi256_si128(acc8), _mm256_extracti128_si256(acc8, 1)));
+        for(; k < t.n; ++k) {
+            __m128i const px = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(static_cast<int>(p[k])));
+            acc = _mm_add_epi32(acc, _mm_mullo_epi32(px, _mm_set1_epi32(w[k])));
+        }
+        acc = _mm_srai_epi32(acc, weight_bits);
+        acc = _mm_packs_epi32(acc, acc);
+        dst[x] = static_cast<std::uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(acc, acc)));
+    }
+}
+
+
+__attribute__((target("avx2"))) void
+columns_avx2(std::uint8_t const *const *rows, int n, std::int16_t const *w, std::uint8_t *dst, int bytes)
+{
+    int i = 0;
+    for(; i + 16 <= bytes; i += 16) {
+        __m256i lo = _mm256_set1_epi32(rounding), hi = lo;
+        int k = 0;
+        for(; k + 1 < n; k += 2) {
+            __m256i const a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const *>(rows[k] + i)));
+            __m256i const b = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const *>(rows[k + 1] + i)));
+            __m256i const wp = _mm256_set1_epi32(weight_pair(w + k));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wp));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wp));
+        }
+        if(k < n) {
+            __m256i const a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const *>(rows[k] + i)));
+            __m256i const wp = _mm256_set1_epi32(static_cast<std::uint16_t>(w[k]));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, _mm256_setzero_si256()), wp));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, _mm256_setzero_si256()), wp));
+        }
+        // The unpacks work within 128 bit lanes, and so do the packs, which puts the bytes back in order
+        __m256i v = _mm256_packs_epi32(_mm256_srai_epi32(lo, weight_bits), _mm256_srai_epi32(hi, weight_bits));
+        v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm256_castsi256_si128(v));
+    }
+    for(; i < bytes; ++i) {
+        std::int32_t c = rounding;
+        for(int k = 0; k < n; ++k)
+            c += rows[k][i] * w[k];
+        dst[i] = static_cast<std::uint8_t>(clamp8(c));
+    }
+}
+
+#endif
+
+
+typedef void (*rows_t)(std::uint32_t const *, std::uint32_t *, int, taps const &);
+typedef void (*columns_t)(std::uint8_t const *const *, int, std::int16_t const *, std::uint8_t *, int);
+
+struct kernels {
+    rows_t rows;
+    columns_t columns;
+    char const *isa;
+};
+
+
+/** The kernels this processor runs, best first */
+std::vector<kernels>
+runnable_kernels()
+{
+    std::vector<kernels> k;
+#ifdef IMGEX_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        k.push_back({rows_avx2, columns_avx2, "avx2"});
+    if(__builtin_cpu_supports("sse4.1"))
+        k.push_back({rows_sse41, columns_sse41, "sse4.1"});
+#endif
+    k.push_back({rows_scalar, columns_scalar, "scalar"});
+    return k;
+}
+
+
+std::vector<kernels> const &
+all_kernels()
+{
+    static std::vector<kernels> const k = runnable_kernels();
+    return k;
+}
+
+}
+
+
+Resampler::Resampler(unsigned threads, char const *isa) : pool_(threads), kernels_(0)
+{
+    if(!isa)
+        return;
+    auto const &all = all_kernels();
+    auto const p = std::find_if(all.begin(), all.end(), [isa](kernels const &k) { return std::strcmp(k.isa, isa) == 0; });
+    if(p == all.end())
+        throw std::invalid_argument(std::string("No resampling kernels for ") + isa);
+    kernels_ = p - all.begin();
+}
+
+
+std::shared_ptr<Resampler>
+Resampler::shared()
+{
+    static std::shared_ptr<Resampler> resampler = std::make_shared<Resampler>();
+    return resampler;
+}
+
+
+char const *
+Resampler::isa() noexcept
+{
+    return all_kernels().front().isa;
+}
+
+
+std::vector<char const *>
+Resampler::supported()
+{
+    std::vector<char const *> names;
+    for(auto const &k : all_kernels())
+        names.push_back(k.isa);
+    return names;
+}
+
+
+void
+Resampler::parallel(int rows, std::function<void(int, int)> const &fn)
+{
+    // Bands of fewer than 32 rows cost more to hand over than to do
+    int const bands = std::min(static_cast<int>(pool_.size()), rows / 32);
+    if(bands <= 1) {
+        fn(0, rows);
+        return;
+    }
+    std::latch done(bands);
+    for(int b = 0; b < bands; ++b)
+        pool_.submit([&fn, &done, b, bands, rows] {
+            fn(rows * b / bands, rows * (b + 1) / bands);
+            done.count_down();
+        });
+    done.wait();
+}
+
+
+QImage
+Resampler::scale(QImage const &src, QRectF from, QSize target, filter f)
+{
+    if(src.isNull() || target.isEmpty() || from.isEmpty())
+        return QImage();
+    bool const alpha = src.hasAlphaChannel();
+    QImage::Format const format = alpha ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32;
+    QImage const in = src.format() == format ? src : src.convertToFormat(format);
+    from &= QRectF(in.rect());
+
+    kernels const &k = all_kernels()[kernels_];
+    taps const tx = make_taps(from.x(), from.width(), in.width(), target.width(), f);
+    taps const ty = make_taps(from.y(), from.height(), in.height(), target.height(), f);
+    // Only the source rows some output row needs go through the first pass
+    int const y0 = ty.first.front(), y1 = ty.first.back() + ty.n;
+
+    std::vector<std::uint32_t> mid(static_cast<std::size_t>(y1 - y0) * target.width());
+    parallel(y1 - y0, [&](int begin, int end) {
+        for(int y = begin; y < end; ++y)
+            k.rows(reinterpret_cast<std::uint32_t const *>(in.constScanLine(y0 + y)),
+                   mid.data() + static_cast<std::size_t>(y) * target.width(), target.width(), tx);
+    });
+
+    QImage out(target, format);
+    if(out.isNull())
+        return out;
+    int const bytes = 4 * target.width();
+    parallel(target.height(), [&](int begin, int end) {
+        std::vector<std::uint8_t const *> rows(ty.n);
+        for(int y = begin; y < end; ++y) {
+            for(int j = 0; j < ty.n; ++j)
+                rows[j] = reinterpret_cast<std::uint8_t const *>(mid.data() + static_cast<std::size_t>(ty.first[y] - y0 + j) * target.width());
+            auto *line = reinterpret_cast<std::uint32_t *>(out.scanLine(y));
+            k.columns(rows.data(), ty.n, &ty.weights[static_cast<std::size_t>(y) * ty.n],
+                      reinterpret_cast<std::uint8_t *>(line), bytes);
+            // Lanczos overshoots: keep premultiplied colours within alpha, and RGB32 opaque
+            for(int x = 0; x < target.width(); ++x) {
+                std::uint32_t const px = line[x];
+                if(!alpha) {
+                    line[x] = px | 0xff000000u;
+                    continue;
+                }
+                std::uint32_t const a = px >> 24;
+                line[x] = a << 24 | std::min(px >> 16 & 0xff, a) << 16 | std::min(px >> 8 & 0xff, a) << 8 | std::min(px & 0xff, a);
+            }
+        }
+    });
+    return out;
+}
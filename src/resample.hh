@@ -0,0 +1,62 @@
+#ifndef __IMGEX_RESAMPLE_H
+#define __IMGEX_RESAMPLE_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <QImage>
+#include <QRectF>
+#include <QSize>
+#include "workers.hh"
+
+
+/** Resampler scales images with separable filters, in two passes (rows, then
+ * columns) each split into bands of rows run in parallel.
+ *
+ * Pixels are 32 bit (RGB32 or premultiplied ARGB32; anything else is converted)
+ * and filter weights are 14 bit fixed point, so the inner loops are integer
+ * multiply-adds.  These have AVX2 and SSE4.1 versions chosen at run time, with
+ * a plain C++ version for other processors.
+ *
+ * This replaces QImage::scaled, which is single threaded and, for smooth
+ * scaling, slow on large reductions.
+ */
+class Resampler final {
+public:
+    enum class filter {
+        /** Area average; exact for 2:1 reductions such as mip levels */
+        box,
+        /** Lanczos, 3 lobes: sharp, for everything else */
+        lanczos3
+    };
+
+    /** \param threads threads for the bands, 0 for one per core
+     * \param isa instruction set of the kernels, one of supported(); null for the best.
+     * Any but the best is for testing the kernels against each other */
+    explicit Resampler(unsigned threads = 0, char const *isa = nullptr);
+    Resampler(Resampler const &) = delete;
+    Resampler &operator=(Resampler const &) = delete;
+
+    /** Shared by the application */
+    static std::shared_ptr<Resampler> shared();
+
+    /** Scale the part from of src (which may have fractional edges) to size target.
+     * Safe to call from any thread, but not from a job of this Resampler */
+    [[nodiscard]] QImage scale(QImage const &src, QRectF from, QSize target, filter = filter::lanczos3);
+
+    /** Name of the instruction set the kernels use ("avx2", "sse4.1" or "scalar") */
+    [[nodiscard]] static char const *isa() noexcept;
+    /** Names of the instruction sets this processor has kernels for, best first ("scalar" last) */
+    [[nodiscard]] static std::vector<char const *> supported();
+
+private:
+    WorkerPool pool_;
+    /** Which of supported() the kernels are */
+    std::size_t kernels_;
+
+    /** Run fn(begin, end) over bands of [0, rows) on the pool, returning when all are done */
+    void parallel(int rows, std::function<void(int, int)> const &fn);
+};
+
+
+#endif
@@ -0,0 +1,320 @@
+#include "scanner.hh"
+#include "exif.hh"
+#include "workers.hh"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <QFile>
+
+
+namespace {
+
+/** A directory as found by one scanning thread, before it is merged into the index */
+struct dir_scan {
+    /** Path relative to the mount point, empty for the top */
+    std::string rel;
+    std::string parent;
+    std::int64_t mtime;
+    /** Entries with name offsets into names */
+    std::vector<ImageIndex::entry> files;
+    std::string names;
+};
+
+
+inline std::uint32_t be16(unsigned char const *p) noexcept { return p[0] << 8 | p[1]; }
+inline std::uint32_t le16(unsigned char const *p) noexcept { return p[1] << 8 | p[0]; }
+inline std::uint32_t be32(unsigned char const *p) noexcept { return be16(p) << 16 | be16(p + 2); }
+inline std::uint32_t le32(unsigned char const *p) noexcept { return le16(p + 2) << 16 | le16(p); }
+inline std::uint32_t le24(unsigned char const *p) noexcept { return p[2] << 16 | p[1] << 8 | p[0]; }
+
+inline bool
+read_at(int fd, void *buf, std::size_t n, off_t off) noexcept
+{
+    return pread(fd, buf, n, off) == static_cast<ssize_t>(n);
+}
+
+inline std::int64_t
+mtime_ms(struct stat const &st) noexcept
+{
+    return static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+}
+
+
+/** Image width and length from the first IFD of a TIFF file */
+bool
+tiff_size(int fd, bool big_endian, std::uint32_t ifd, std::uint32_t &width, std::uint32_t &height)
+{
+    auto u16 = big_endian ? be16 : le16;
+    auto u32 = big_endian ? be32 : le32;
+    unsigned char buf[12];
+    if(!read_at(fd, buf, 2, ifd))
+        return false;
+    unsigned const n = std::min(u16(buf), 256u);
+    width = height = 0;
+    for(unsigned i = 0; i < n && !(width && height); ++i) {
+        if(!read_at(fd, buf, 12, ifd + 2 + 12 * i))
+            return false;
+        unsigned const tag = u16(buf), type = u16(buf + 2);
+        // SHORT values sit in the first two bytes of the value field
+        std::uint32_t const value = type == 3 ? u16(buf + 8) : u32(buf + 8);
+        if(tag == 256)
+            width = value;
+        else if(tag == 257)
+            height = value;
+    }
+    return width && height;
+}
+
+}
+
+
+ImageIndex::kind
+ImageIndex::sniff(int fd, std::uint32_t &width, std::uint32_t &height)
+{
+    unsigned char h[32] = {};
+    width = height = 0;
+    ssize_t const n = pread(fd, h, sizeof(h), 0);
+    if(n < 12)
+        return kind::unknown;
+
+    if(h[0] == 0xff && h[1] == 0xd8 && h[2] == 0xff) {
+        ExifReader::jpeg_size(fd, 0, width, height);
+        return kind::jpeg;
+    }
+    if(!std::memcmp(h, "\x89PNG\r\n\x1a\n", 8)) {
+        if(n >= 24) {
+            width = be32(h + 16);
+            height = be32(h + 20);
+        }
+        return kind::png;
+    }
+    if(!std::memcmp(h, "GIF87a", 6) || !std::memcmp(h, "GIF89a", 6)) {
+        width = le16(h + 6);
+        height = le16(h + 8);
+        return kind::gif;
+    }
+    if(h[0] == 'B' && h[1] == 'M' && n >= 26) {
+        if(le32(h + 14) == 12) {
+            width = le16(h + 18);
+            height = le16(h + 20);
+        } else {
+            width = le32(h + 18);
+            // Negative for top-down bitmaps
+            height = static_cast<std::uint32_t>(std::abs(static_cast<std::int32_t>(le32(h + 22))));
+        }
+        return kind::bmp;
+    }
+    // TIFF and the TIFF based camera RAW formats
+    if(!std::memcmp(h, "II*\0", 4) || !std::memcmp(h, "MM\0*", 4)) {
+        bool const be = h[0] == 'M';
+        tiff_size(fd, be, be ? be32(h + 4) : le32(h + 4), width, height);
+        return kind::tiff;
+    }
+    if(!std::memcmp(h, "RIFF", 4) && !std::memcmp(h + 8, "WEBP", 4)) {
+        unsigned char c[18];
+        if(read_at(fd, c, sizeof(c), 12)) {
+            if(!std::memcmp(c, "VP8X", 4)) {
+                width = le24(c + 12) + 1;
+                height = le24(c + 15) + 1;
+            } else if(!std::memcmp(c, "VP8L", 4) && read_at(fd, c, 5, 20)) {
+                std::uint32_t const bits = le32(c + 1);
+                width = (bits & 0x3fff) + 1;
+                height = ((bits >> 14) & 0x3fff) + 1;
+            } else if(!std::memcmp(c, "VP8 ", 4) && read_at(fd, c, 4, 26)) {
+                width = le16(c) & 0x3fff;
+                height = le16(c + 2) & 0x3fff;
+            }
+        }
+        return kind::webp;
+    }
+    if(!std::memcmp(h + 4, "ftyp", 4)) {
+        static char const *const brands[] = { "heic", "heix", "heim", "heis", "hevc", "mif1", "msf1", "avif" };
+        for(auto b : brands)
+            if(!std::memcmp(h + 8, b, 4))
+                return kind::heif;
+    }
+    return kind::unknown;
+}
+
+
+ImageIndex::ImageIndex(QString const &mount) : mount_(mount), drive_(0), read_(0)
+{
+    while(mount_.size() > 1 && mount_.endsWith('/'))
+        mount_.chop(1);
+}
+
+
+void
+ImageIndex::scan(unsigned threads)
+{
+    QByteArray const top{QFile::encodeName(mount_)};
+
+    // The drive identifier is a one byte file at the top of the mount point (see ImageFile)
+    drive_ = 0;
+    if(int fd = ::open((top + "/drive").constData(), O_RDONLY | O_CLOEXEC); fd >= 0) {
+        char d;
+        if(::read(fd, &d, 1) == 1)
+            drive_ = d;
+        ::close(fd);
+    }
+
+    // What the previous scan found, to reuse for unchanged directories
+    std::unordered_map<std::string, std::uint32_t> known;
+    std::vector<std::vector<std::uint32_t>> children(dirs_.size());
+    for(std::uint32_t i = 0; i < dirs_.size(); ++i) {
+        known.emplace(name(dirs_[i].name), i);
+        if(i != dirs_[i].parent)
+            children[dirs_[i].parent].push_back(i);
+    }
+
+    std::mutex mtx;
+    std::vector<dir_scan> found;
+    std::size_t nread = 0;
+    char const drive = drive_;
+    WorkerPool pool(threads);
+
+    std::function<void(std::string, std::string)> visit = [&](std::string rel, std::string parent) {
+        std::string const abs = rel.empty() ? std::string(top.constData()) : top.constData() + ('/' + rel);
+        struct stat st;
+        if(::stat(abs.c_str(), &st) || !S_ISDIR(st.st_mode))
+            return;
+        dir_scan d{std::move(rel), std::move(parent), mtime_ms(st), {}, {}};
+        auto add = [&d](char const *nm, entry e) {
+            e.name = static_cast<std::uint32_t>(d.names.size());
+            d.names.append(nm).push_back('\0');
+            d.files.push_back(e);
+        };
+        std::vector<std::string> subdirs;
+        auto old = known.find(d.rel);
+
+        if(old != known.end() && dirs_[old->second].mtime == d.mtime) {
+            // Unchanged: take the files and subdirectories from the previous scan
+            directory const &od = dirs_[old->second];
+            for(std::uint32_t i = od.first; i < od.first + od.count; ++i)
+                add(name(entries_[i].name), entries_[i]);
+            for(auto c : children[old->second])
+                subdirs.emplace_back(name(dirs_[c].name));
+        } else {
+            // Files we already know need not be sniffed again if unchanged
+            std::unordered_map<std::string, entry const *> before;
+            if(old != known.end()) {
+                directory const &od = dirs_[old->second];
+                for(std::uint32_t i = od.first; i < od.first + od.count; ++i)
+                    before.emplace(name(entries_[i].name), &entries_[i]);
+            }
+            DIR *dir = ::opendir(abs.c_str());
+            if(!dir)
+                return;
+            int const dfd = ::dirfd(dir);
+            while(struct dirent *de = ::readdir(dir)) {
+                // Skip ., .. and hidden files such as .Trashes
+                if(de->d_name[0] == '.')
+                    continue;
+                struct stat fst;
+                // Links are not followed: one to a parent directory would be walked forever
+                if(::fstatat(dfd, de->d_name, &fst, AT_SYMLINK_NOFOLLOW))
+                    continue;
+                if(S_ISDIR(fst.st_mode)) {
+                    subdirs.push_back(d.rel.empty() ? std::string(de->d_name) : d.rel + '/' + de->d_name);
+                    continue;
+                }
+                if(!S_ISREG(fst.st_mode))
+                    continue;
+                entry e{mtime_ms(fst), static_cast<std::int64_t>(fst.st_size), 0, 0, 0, 0, kind::unknown, drive};
+                auto b = before.find(de->d_name);
+                if(b != before.end() && b->second->size == e.size && b->second->mtime == e.mtime) {
+                    e = *b->second;
+                } else {
+                    int fd = ::openat(dfd, de->d_name, O_RDONLY | O_CLOEXEC);
+                    if(fd < 0)
+                        continue;
+                    e.type = sniff(fd, e.width, e.height);
+                    ::close(fd);
+                }
+                if(e.type != kind::unknown)
+                    add(de->d_name, e);
+            }
+            ::closedir(dir);
+            std::lock_guard<std::mutex> lk(mtx);
+            ++nread;
+        }
+        for(auto &s : subdirs)
+            pool.submit([&visit, s = std::move(s), p = d.rel] { visit(s, p); });
+        std::lock_guard<std::mutex> lk(mtx);
+        found.push_back(std::move(d));
+    };
+
+    // Jobs queue their subdirectories before finishing, so the pool only
+    // goes idle when the whole tree has been walked
+    pool.submit([&visit] { visit(std::string(), std::string()); });
+    pool.wait();
+
+    // Merge, in path order so the index doesn't depend on thread timing
+    std::sort(found.begin(), found.end(), [](dir_scan const &a, dir_scan const &b) { return a.rel < b.rel; });
+    std::vector<entry> entries;
+    std::vector<directory> dirs;
+    std::string names;
+    std::unordered_map<std::string, std::uint32_t> index;
+    std::size_t nfiles = 0, nbytes = 0;
+    for(auto const &d : found) {
+        nfiles += d.files.size();
+        nbytes += d.names.size() + d.rel.size() + 1;
+    }
+    entries.reserve(nfiles);
+    dirs.reserve(found.size());
+    names.reserve(nbytes);
+    for(auto &d : found) {
+        auto const i = static_cast<std::uint32_t>(dirs.size());
+        index.emplace(d.rel, i);
+        // Parents sort before their children, so the parent is already indexed
+        auto p = index.find(d.parent);
+        directory dr{d.mtime, static_cast<std::uint32_t>(names.size()), p == index.end() || d.rel.empty() ? i : p->second,
+                     static_cast<std::uint32_t>(entries.size()), static_cast<std::uint32_t>(d.files.size())};
+        names.append(d.rel).push_back('\0');
+        auto const base = static_cast<std::uint32_t>(names.size());
+        names.append(d.names);
+        for(auto e : d.files) {
+            e.dir = i;
+            e.name += base;
+            entries.push_back(e);
+        }
+        dirs.push_back(dr);
+    }
+    entries_.swap(entries);
+    dirs_.swap(dirs);
+    names_.swap(names);
+    read_ = nread;
+}
+
+
+QString
+ImageIndex::relative_path(entry const &e) const
+{
+    std::string rel{name(dirs_[e.dir].name)};
+    if(!rel.empty())
+        rel += '/';
+    rel += name(e.name);
+    return QFile::decodeName(rel.c_str());
+}
+
+
+QString
+ImageIndex::path(entry const &e) const
+{
+    return mount_ + '/' + relative_path(e);
+}
+
+
+std::size_t
+ImageIndex::memory_usage() const noexcept
+{
+    return sizeof(*this) + entries_.capacity() * sizeof(entry) + dirs_.capacity() * sizeof(directory)
+           + names_.capacity();
+}
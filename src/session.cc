@@ -1,17 +1,79 @@
 #include "session.hh"
+#include "image.hh"
+#include <algorithm>
+#include <cstring>
+#include <ios>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <QFile>
+#include <QSaveFile>
 
-/** The base class is a null implementation (does nothing)
- *
- */
+
+namespace {
+
+char const session_magic[4] = {'I', 'X', 'S', 'S'};
+/** 2: move is on the canvas of all screens, no longer in the one window */
+constexpr std::uint32_t session_version = 2;
+
+/** Layout of the start of a session file; the records follow, then the strings.
+ * Fields are in native byte order, as sessions belong to the machine they are made on */
+struct header {
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t id;
+    /** When the session was persisted, ms since epoch */
+    std::int64_t time;
+    std::uint32_t count;
+    /** sizeof(record) when written, so records may grow in later versions */
+    std::uint32_t record_size;
+    /** File offsets of the record table and the string table */
+    std::uint64_t records, strings;
+    std::uint64_t strings_size;
+    std::uint64_t reserved;
+};
+static_assert(sizeof(header) == 64, "session header layout");
+static_assert(sizeof(Session::record) == 72, "session record layout");
+
+}
+
+
+/** The records of a session: either built by Session::add, or mapped from a file */
 class SessionImpl
 {
+public:
+    std::vector<Session::record> records_;
+    /** Paths of the added records; their path.offset fields index into it */
+    std::string strings_;
+    /** The mapped file, if loaded */
+    void *map_;
+    std::size_t len_;
+
+    SessionImpl() : map_(MAP_FAILED), len_(0) {}
+    ~SessionImpl() { unmap(); }
+
+    void unmap() noexcept
+    {
+        if(map_ != MAP_FAILED)
+            munmap(map_, len_);
+        map_ = MAP_FAILED;
+        len_ = 0;
+    }
 
+    std::span<Session::record const> mapped() const noexcept
+    {
+        auto const *h = static_cast<header const *>(map_);
+        return {reinterpret_cast<Session::record const *>(static_cast<char const *>(map_) + h->records), h->count};
+    }
 };
 
 
 
 
-Session::Session() : id_(0), time_(std::chrono::system_clock::now())
+Session::Session() : id_(0), time_(std::chrono::system_clock::now()), impl_(std::make_unique<SessionImpl>())
 {
 }
 
@@ -19,11 +81,138 @@ Session::~Session()
 {
 }
 
+
+Transformable::transform
+Session::record::transform() const noexcept
+{
+    Transformable::transform t;
+    if(crop[2] > 0 && crop[3] > 0)
+        t.crop_ = QRect(crop[0], crop[1], crop[2], crop[3]);
+    t.zoom_ = zoom;
+    t.move_ = QPoint(move[0], move[1]);
+    return t;
+}
+
+
+void
+Session::add(ImageFile const &imgf, Transformable::transform const &tx)
+{
+    record r{};
+    r.path.offset = impl_->strings_.size();
+    impl_->strings_.append(QFile::encodeName(imgf.getPath()).constData()).push_back('\0');
+    r.size = imgf.getSize();
+    r.mtime = imgf.getModified();
+    if(tx.crop_.isValid()) {
+        r.crop[0] = tx.crop_.x();
+        r.crop[1] = tx.crop_.y();
+        r.crop[2] = tx.crop_.width();
+        r.crop[3] = tx.crop_.height();
+    }
+    r.zoom = tx.zoom_;
+    r.move[0] = tx.move_.x();
+    r.move[1] = tx.move_.y();
+    QByteArray const sum{imgf.getChecksum()};
+    r.checksum_length = static_cast<std::uint8_t>(std::min<std::size_t>(sum.size(), sizeof(r.checksum)));
+    std::memcpy(r.checksum, sum.constData(), r.checksum_length);
+    auto const &drives = imgf.getDrives();
+    r.drive = drives.empty() ? 0 : *drives.begin();
+    impl_->records_.push_back(r);
+}
+
+
+QString
+Session::default_path()
+{
+    return access(".", W_OK) == 0 ? QString("imgex.session") : QString("/tmp/imgex.session");
+}
+
+
 void
 Session::persist(char const *filename)
 {
+    QString const fn{filename ? QFile::decodeName(filename) : default_path()};
+
+    auto const &recs = impl_->records_;
+    header h{};
+    std::copy(session_magic, session_magic + 4, h.magic);
+    h.version = session_version;
+    h.id = id_;
+    h.time = std::chrono::duration_cast<std::chrono::milliseconds>(time_.time_since_epoch()).count();
+    h.count = static_cast<std::uint32_t>(recs.size());
+    h.record_size = sizeof(record);
+    h.records = sizeof(header);
+    h.strings = h.records + recs.size() * sizeof(record);
+    h.strings_size = impl_->strings_.size();
+
+    QSaveFile f(fn);
+    if(!f.open(QIODevice::WriteOnly))
+        throw std::ios_base::failure("Cannot write session " + fn.toStdString());
+    f.write(reinterpret_cast<char const *>(&h), sizeof(h));
+    f.write(reinterpret_cast<char const *>(recs.data()), recs.size() * sizeof(record));
+    f.write(impl_->strings_.data(), impl_->strings_.size());
+    if(!f.commit())
+        throw std::ios_base::failure("Cannot write session " + fn.toStdString());
+}
+
+
+bool
+Session::load(char const *filename)
+{
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    void *addr = MAP_FAILED;
+    // Private and writable so the paths can be fixed up in place (copy on write)
+    if(fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(header))
+        addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(addr == MAP_FAILED)
+        return false;
+
+    std::size_t const len = st.st_size;
+    auto const *h = static_cast<header const *>(addr);
+    bool ok = std::equal(session_magic, session_magic + 4, h->magic) && h->version == session_version
+              && h->record_size == sizeof(record) && h->records >= sizeof(header)
+              // Each bound before the sum that relies on it, so a hostile offset cannot wrap
+              && h->records <= len && h->records % alignof(record) == 0
+              && h->count <= (len - h->records) / sizeof(record)
+              && h->records + static_cast<std::uint64_t>(h->count) * sizeof(record) <= h->strings
+              && h->strings <= len && h->strings_size <= len - h->strings
+              // The last path must be terminated
+              && (h->strings_size == 0 || static_cast<char const *>(addr)[h->strings + h->strings_size - 1] == '\0');
+    auto *recs = reinterpret_cast<record *>(static_cast<char *>(addr) + h->records);
+    char const *strings = static_cast<char const *>(addr) + h->strings;
+    for(std::uint32_t i = 0; ok && i < h->count; ++i) {
+        if(recs[i].path.offset >= h->strings_size)
+            ok = false;
+        else
+            recs[i].path.ptr = strings + recs[i].path.offset;
+    }
+    if(!ok) {
+        munmap(addr, len);
+        return false;
+    }
+
+    impl_ = std::make_unique<SessionImpl>();
+    impl_->map_ = addr;
+    impl_->len_ = len;
+    id_ = h->id;
+    time_ = std::chrono::time_point<std::chrono::system_clock>(std::chrono::milliseconds(h->time));
+    return true;
 }
 
+
+std::span<Session::record const>
+Session::images() const noexcept
+{
+    // Added records have their paths as offsets, and are not for reading back
+    if(impl_->map_ != MAP_FAILED)
+        return impl_->mapped();
+    return {};
+}
+
+
 void
 Session::lock()
 {
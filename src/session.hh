@@ -2,10 +2,16 @@
 #define __IMGEX_SESSION_H
 
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <span>
+#include <QString>
+#include "transform.hh"
 
 typedef std::chrono::duration<int64_t> ses_time;
 
+class ImageFile;
 class SessionImpl;
 
 class Session final {
@@ -15,14 +21,59 @@ class Session final {
     std::unique_ptr<SessionImpl> impl_;
 
  public:
+    /** An image in a session, as laid out in the session file.
+     * Transforms are in source (full resolution) pixels, so they don't
+     * depend on the resolution the image was decoded at */
+    struct record {
+        /** The path (NUL terminated): an offset into the file's string table on
+         * disk, fixed up to point into the mapped file when loaded */
+        union {
+            std::uint64_t offset;
+            char const *ptr;
+        } path;
+        /** File identity, as ImageFile */
+        std::int64_t size, mtime;
+        /** Crop x, y, width, height; width 0 if not cropped */
+        std::int32_t crop[4];
+        /** Screen pixels per source pixel */
+        float zoom;
+        /** Top left on the canvas spanning all screens (see Collage) */
+        std::int32_t move[2];
+        std::uint8_t checksum[16];
+        std::uint8_t checksum_length;
+        /** Drive identifier, 0 if none */
+        char drive;
+        std::uint8_t reserved[2];
+
+        /** The transform as recorded */
+        [[nodiscard]] Transformable::transform transform() const noexcept;
+    };
+
     Session();
     ~Session();
+    Session(Session const &) = delete;
+    Session &operator=(Session const &) = delete;
+
+    /** Add an image to the session
+     * \param tx its transform in source pixels (see Transformable::source_transform) */
+    void add(ImageFile const &, Transformable::transform const &tx);
 
     /** Persist all session data into file
      * \param filename - location to write session (filename, directory).
      * location defaults to current working directory if writeable, and /tmp if not */
     void persist(char const *filename = nullptr);
 
+    /** Where persist writes by default */
+    static QString default_path();
+
+    /** Load a session persisted earlier, replacing this one.  The file is
+     * mapped and used in place: there is nothing to parse.
+     * \return false if the file can't be read or isn't a session we understand */
+    bool load(char const *filename);
+
+    /** The images of a loaded session, in the order they were added (which is their stacking order) */
+    [[nodiscard]] std::span<record const> images() const noexcept;
+
     /** Lock session - all images - from mousing etc */
     void lock();
 
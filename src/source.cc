@@ -0,0 +1,103 @@
+#include "source.hh"
+#include "image.hh"
+#include "tiled.hh"
+#include <iterator>
+
+
+std::shared_ptr<SourceRegistry>
+SourceRegistry::shared()
+{
+    static std::shared_ptr<SourceRegistry> reg = std::make_shared<SourceRegistry>();
+    return reg;
+}
+
+
+SourceRegistry::entry &
+SourceRegistry::entry_for(ImageFile const &fn)
+{
+    auto f = files_.find(fn.getPath());
+    // New, or the file was replaced: what we held is of other pixels
+    if(f == files_.end() || f->size != fn.getSize() || f->mtime != fn.getModified())
+        f = files_.insert(fn.getPath(), entry{fn.getSize(), fn.getModified(), QByteArray(), {}, {}});
+    entry &e = *f;
+    if(e.checksum.isEmpty())
+        e.checksum = fn.getChecksum();
+    return e;
+}
+
+
+QPixmap
+SourceRegistry::share(ImageFile const &fn, float reduction, QPixmap pixels, holder &hold)
+{
+    if(pixels.isNull())
+        return pixels;
+    entry &e = entry_for(fn);
+    auto p = e.pixels.find(reduction);
+    if(p != e.pixels.end() && p->second.pixels.size() == pixels.size())
+        if((hold = p->second.users.lock()))
+            return p->second.pixels;
+    // Holders are only counted; what they point to is never read
+    hold = std::make_shared<char const>(0);
+    e.pixels[reduction] = decode{pixels, hold};
+    return pixels;
+}
+
+
+QPixmap
+SourceRegistry::best(ImageFile const &fn, float &reduction, QByteArray &checksum, holder &hold)
+{
+    auto f = files_.find(fn.getPath());
+    if(f == files_.end() || f->size != fn.getSize() || f->mtime != fn.getModified())
+        return QPixmap();
+    // Ordered by reduction, so the first alive is the best
+    for(auto const &[r, d] : f->pixels)
+        if((hold = d.users.lock())) {
+            reduction = r;
+            checksum = f->checksum;
+            return d.pixels;
+        }
+    return QPixmap();
+}
+
+
+std::shared_ptr<TiledImage>
+SourceRegistry::tiles(ImageFile const &fn, QSize screen)
+{
+    entry &e = entry_for(fn);
+    auto t = e.tiles.lock();
+    if(!t) {
+        t = TiledImage::open(fn.getPath(), screen);
+        e.tiles = t;
+    }
+    return t;
+}
+
+
+void
+SourceRegistry::prune()
+{
+    for(auto f = files_.begin(); f != files_.end(); ) {
+        auto &px = f->pixels;
+        for(auto p = px.begin(); p != px.end(); )
+            p = p->second.users.expired() ? px.erase(p) : std::next(p);
+        if(px.empty() && f->tiles.expired())
+            f = files_.erase(f);
+        else
+            ++f;
+    }
+}
+
+
+SourceRegistry::stats
+SourceRegistry::statistics() const
+{
+    stats st{0, 0, 0};
+    for(auto const &e : files_) {
+        if(!e.pixels.empty())
+            ++st.files;
+        st.sources += e.pixels.size();
+        for(auto const &p : e.pixels)
+            st.bytes += pixmap_bytes(p.second.pixels);
+    }
+    return st;
+}
@@ -0,0 +1,98 @@
+#ifndef __IMGEX_SOURCE_H
+#define __IMGEX_SOURCE_H
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <QByteArray>
+#include <QHash>
+#include <QPixmap>
+#include <QSize>
+#include <QString>
+
+class ImageFile;
+class TiledImage;
+
+
+/** SourceRegistry keeps one copy of the decoded pixels of each file, however
+ * many images show it.
+ *
+ * QPixmap is reference counted and the pixels we transform are never modified
+ * (see Transformable::src_), so every Image and XILImage of a file can hold
+ * the same pixmap.  The registry remembers what is held, by file and
+ * reduction, so a file opened again is shown from the pixels already decoded
+ * rather than decoded (and held) a second time.
+ *
+ * Each image using a decode holds a holder for it along with the pixels; the
+ * registry keeps only a weak reference to the holders, so it holds nothing
+ * alive itself: a decode without holders is dropped by prune.
+ *
+ * Pixmaps belong to the GUI thread, and so does the registry.
+ */
+class SourceRegistry final {
+public:
+    SourceRegistry() = default;
+    SourceRegistry(SourceRegistry const &) = delete;
+    SourceRegistry &operator=(SourceRegistry const &) = delete;
+
+    /** Shared by the application */
+    static std::shared_ptr<SourceRegistry> shared();
+
+    /** Marks a decode as in use for as long as it is held (see Transformable::src_hold_) */
+    using holder = std::shared_ptr<void const>;
+
+    /** The pixels of a file decoded with a reduction: those already held if
+     * there are any, else pixels, which are remembered (with the file's checksum)
+     * \param hold set to the decode's holder, to keep with the pixels */
+    [[nodiscard]] QPixmap share(ImageFile const &, float reduction, QPixmap pixels, holder &hold);
+
+    /** The least reduced pixels held of an unchanged file, or a null pixmap
+     * \param reduction set to their reduction
+     * \param checksum set to the file's checksum, if known
+     * \param hold set to the decode's holder, to keep with the pixels */
+    [[nodiscard]] QPixmap best(ImageFile const &, float &reduction, QByteArray &checksum, holder &hold);
+
+    /** The tiles of a file (see TiledImage::open), shared by every image of it; null if not tiled */
+    [[nodiscard]] std::shared_ptr<TiledImage> tiles(ImageFile const &, QSize screen);
+
+    /** Forget the decodes no image holds any more */
+    void prune();
+
+    struct stats {
+        /** Files and decodes held */
+        std::size_t files, sources;
+        /** Bytes of their pixels */
+        std::size_t bytes;
+    };
+    [[nodiscard]] stats statistics() const;
+
+private:
+    struct decode {
+        QPixmap pixels;
+        /** Expired once no image holds the pixels */
+        std::weak_ptr<void const> users;
+    };
+    struct entry {
+        /** The file as decoded, which a changed file no longer matches */
+        qint64 size, mtime;
+        QByteArray checksum;
+        /** Decodes by reduction */
+        std::map<float, decode> pixels;
+        std::weak_ptr<TiledImage> tiles;
+    };
+    QHash<QString, entry> files_;
+
+    /** The entry for a file, emptied if the file has changed since */
+    entry &entry_for(ImageFile const &);
+};
+
+
+/** Bytes of pixels in a pixmap */
+[[nodiscard]] inline std::size_t
+pixmap_bytes(QPixmap const &pm) noexcept
+{
+    return static_cast<std::size_t>(pm.width()) * pm.height() * pm.depth() / 8;
+}
+
+
+#endif
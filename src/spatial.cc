@@ -0,0 +1,170 @@
+#include "spatial.hh"
+#include <algorithm>
+
+
+SpatialIndex::SpatialIndex(int cell) : cell_(std::max(cell, 16)), items_(), cells_(), large_(), found_()
+{
+}
+
+
+QRect
+SpatialIndex::cells_of(QRect box) const noexcept
+{
+    if(box.isEmpty())
+        return QRect();
+    return QRect(QPoint(cell_of(box.left()), cell_of(box.top())), QPoint(cell_of(box.right()), cell_of(box.bottom())));
+}
+
+
+void
+SpatialIndex::add_cells(XILImage *img, item const &it)
+{
+    if(large(it.cells)) {
+        large_.push_back(entry{img, it.box, it.z});
+        return;
+    }
+    for(int y = it.cells.top(); y <= it.cells.bottom(); ++y)
+        for(int x = it.cells.left(); x <= it.cells.right(); ++x)
+            cells_[key(x, y)].push_back(entry{img, it.box, it.z});
+}
+
+
+void
+SpatialIndex::remove_cells(XILImage const *img, item const &it)
+{
+    if(large(it.cells)) {
+        large_.erase(std::remove_if(large_.begin(), large_.end(), [img](entry const &e) { return e.img == img; }), large_.end());
+        return;
+    }
+    for(int y = it.cells.top(); y <= it.cells.bottom(); ++y)
+        for(int x = it.cells.left(); x <= it.cells.right(); ++x) {
+            auto p = cells_.find(key(x, y));
+            if(p == cells_.end())
+                continue;
+            auto &v = p->second;
+            v.erase(std::remove_if(v.begin(), v.end(), [img](entry const &e) { return e.img == img; }), v.end());
+            if(v.empty())
+                cells_.erase(p);
+        }
+}
+
+
+void
+SpatialIndex::insert(XILImage *img, QRect box, std::uint64_t z)
+{
+    erase(img);
+    item const it{box, z, cells_of(box)};
+    items_.emplace(img, it);
+    add_cells(img, it);
+}
+
+
+void
+SpatialIndex::update(XILImage const *img, QRect box)
+{
+    // Only a key: we never change an image
+    auto p = items_.find(const_cast<XILImage *>(img));
+    if(p == items_.end() || p->second.box == box)
+        return;
+    item &it = p->second;
+    QRect const cells{cells_of(box)};
+    if(cells == it.cells) {
+        // The common case, dragging by a few pixels: just the box changes
+        it.box = box;
+        if(large(cells)) {
+            for(auto &e : large_)
+                if(e.img == img)
+                    e.box = box;
+            return;
+        }
+        for(int y = cells.top(); y <= cells.bottom(); ++y)
+            for(int x = cells.left(); x <= cells.right(); ++x)
+                for(auto &e : cells_[key(x, y)])
+                    if(e.img == img)
+                        e.box = box;
+        return;
+    }
+    remove_cells(img, it);
+    it.box = box;
+    it.cells = cells;
+    add_cells(p->first, it);
+}
+
+
+void
+SpatialIndex::erase(XILImage const *img)
+{
+    auto p = items_.find(const_cast<XILImage *>(img));
+    if(p == items_.end())
+        return;
+    remove_cells(img, p->second);
+    items_.erase(p);
+}
+
+
+void
+SpatialIndex::restack(XILImage const *img, std::uint64_t z)
+{
+    auto p = items_.find(const_cast<XILImage *>(img));
+    if(p == items_.end())
+        return;
+    item &it = p->second;
+    it.z = z;
+    if(large(it.cells)) {
+        for(auto &e : large_)
+            if(e.img == img)
+                e.z = z;
+        return;
+    }
+    for(int y = it.cells.top(); y <= it.cells.bottom(); ++y)
+        for(int x = it.cells.left(); x <= it.cells.right(); ++x)
+            for(auto &e : cells_[key(x, y)])
+                if(e.img == img)
+                    e.z = z;
+}
+
+
+XILImage *
+SpatialIndex::at(QPoint pt) const noexcept
+{
+    entry const *top = nullptr;
+    for(auto const &e : large_)
+        if(e.box.contains(pt) && (!top || e.z > top->z))
+            top = &e;
+    auto p = cells_.find(key(cell_of(pt.x()), cell_of(pt.y())));
+    if(p != cells_.end())
+        for(auto const &e : p->second)
+            if(e.box.contains(pt) && (!top || e.z > top->z))
+                top = &e;
+    return top ? top->img : nullptr;
+}
+
+
+void
+SpatialIndex::query(QRect area, std::vector<XILImage *> &out) const
+{
+    out.clear();
+    found_.clear();
+    for(auto const &e : large_)
+        if(e.box.intersects(area))
+            found_.emplace_back(e.z, e.img);
+    QRect const cells{cells_of(area)};
+    for(int y = cells.top(); y <= cells.bottom(); ++y)
+        for(int x = cells.left(); x <= cells.right(); ++x) {
+            auto p = cells_.find(key(x, y));
+            if(p == cells_.end())
+                continue;
+            for(auto const &e : p->second) {
+                QRect const common{e.box & area};
+                if(common.isEmpty())
+                    continue;
+                // An image in several cells is reported by the one holding the top left of its overlap
+                if(cell_of(common.left()) == x && cell_of(common.top()) == y)
+                    found_.emplace_back(e.z, e.img);
+            }
+        }
+    std::sort(found_.begin(), found_.end(), [](auto const &a, auto const &b) { return a.first < b.first; });
+    out.reserve(found_.size());
+    for(auto const &f : found_)
+        out.push_back(f.second);
+}
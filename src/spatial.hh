@@ -0,0 +1,86 @@
+#ifndef __IMGEX_SPATIAL_H
+#define __IMGEX_SPATIAL_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <QPoint>
+#include <QRect>
+
+class XILImage;
+
+
+/** SpatialIndex finds the images at a point or in a rectangle of a window
+ * without looking at the others.
+ *
+ * It is a uniform grid: each cell lists the images overlapping it, with their
+ * boxes and stacking order, so a point query reads one short list and a
+ * rectangle query the lists of the cells it covers.  Moving an image within
+ * the cells it already covers just rewrites its box in them.  An image
+ * covering more than a few dozen cells (zoomed far in, or dragged far off the
+ * window) is kept in a list of its own which every query checks, rather than
+ * in each of what could be millions of cells.
+ */
+class SpatialIndex final {
+public:
+    /** \param cell cell size in pixels; about the size of a small image works best */
+    explicit SpatialIndex(int cell = 256);
+    SpatialIndex(SpatialIndex const &) = delete;
+    SpatialIndex &operator=(SpatialIndex const &) = delete;
+
+    /** Add an image
+     * \param z stacking order, higher on top */
+    void insert(XILImage *, QRect box, std::uint64_t z);
+    /** The image has a new box; nothing happens if it isn't indexed */
+    void update(XILImage const *, QRect box);
+    void erase(XILImage const *);
+    /** Change an image's stacking order */
+    void restack(XILImage const *, std::uint64_t z);
+
+    /** The topmost image containing a point, or nullptr */
+    [[nodiscard]] XILImage *at(QPoint) const noexcept;
+    /** The images intersecting a rectangle, lowest first
+     * \param out replaced by the images; pass the same vector again to save allocating */
+    void query(QRect, std::vector<XILImage *> &out) const;
+
+    [[nodiscard]] std::size_t size() const noexcept { return items_.size(); }
+
+private:
+    struct entry {
+        XILImage *img;
+        QRect box;
+        std::uint64_t z;
+    };
+    struct item {
+        QRect box;
+        std::uint64_t z;
+        /** Cells covered, in cell coordinates */
+        QRect cells;
+    };
+
+    int cell_;
+    std::unordered_map<XILImage *, item> items_;
+    std::unordered_map<std::uint64_t, std::vector<entry>> cells_;
+    /** The images covering too many cells to list in each */
+    std::vector<entry> large_;
+    /** Intersecting entries with their stacking order, reused by query */
+    mutable std::vector<std::pair<std::uint64_t, XILImage *>> found_;
+
+    [[nodiscard]] QRect cells_of(QRect box) const noexcept;
+    /** Whether an item covering these cells goes in large_ */
+    [[nodiscard]] static bool large(QRect cells) noexcept
+    {
+        return std::int64_t(cells.width()) * cells.height() > max_cells;
+    }
+    static constexpr std::int64_t max_cells = 64;
+    [[nodiscard]] int cell_of(int v) const noexcept { return v >= 0 ? v / cell_ : -((-v - 1) / cell_) - 1; }
+    [[nodiscard]] static std::uint64_t key(int x, int y) noexcept
+    {
+        return (std::uint64_t(std::uint32_t(x)) << 32) | std::uint32_t(y);
+    }
+    void add_cells(XILImage *, item const &);
+    void remove_cells(XILImage const *, item const &);
+};
+
+
+#endif
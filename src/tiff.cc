@@ -0,0 +1,138 @@
+#include "tiff.hh"
+#include <algorithm>
+#include <ios>
+#include <string>
+
+
+namespace {
+
+/** Field types */
+constexpr std::uint16_t t_short = 3, t_long = 4, t_rational = 5;
+
+/** Appends TIFF (little endian) fields to a buffer */
+struct out {
+    std::string bytes;
+
+    void u16(std::uint16_t v) { bytes.push_back(v & 0xff); bytes.push_back(v >> 8); }
+    void u32(std::uint32_t v) { u16(v & 0xffff); u16(v >> 16); }
+
+    /** A directory entry whose value fits in the entry */
+    void entry(std::uint16_t tag, std::uint16_t type, std::uint32_t value)
+    {
+        u16(tag);
+        u16(type);
+        u32(1);
+        if(type == t_short) {
+            u16(value);
+            u16(0);
+        } else {
+            u32(value);
+        }
+    }
+    /** A directory entry whose values are at offset */
+    void entry(std::uint16_t tag, std::uint16_t type, std::uint32_t count, std::uint32_t offset)
+    {
+        u16(tag);
+        u16(type);
+        u32(count);
+        u32(offset);
+    }
+};
+
+}
+
+
+TiffWriter::TiffWriter(QString const &path, QSize size, int rows, int dpi) : file_(path), size_(size), written_(0), buf_()
+{
+    if(size.isEmpty() || rows <= 0)
+        throw std::ios_base::failure("Cannot write an empty TIFF");
+    std::uint32_t const strips = (size.height() + rows - 1) / rows;
+    std::uint32_t const row_bytes = 3 * size.width();
+    constexpr std::uint16_t entries = 13;
+    // Header, directory, then the values too large for it, then the pixels
+    std::uint32_t const ifd = 8;
+    std::uint32_t const bits = ifd + 2 + entries * 12 + 4;
+    std::uint32_t const xres = bits + 6 + 2, yres = xres + 8;
+    std::uint64_t const offsets = yres + 8, counts = offsets + 4ull * strips;
+    std::uint64_t const pixels = counts + 4ull * strips;
+    if(pixels + 3ull * size.width() * size.height() > 0xffffffffull)
+        throw std::ios_base::failure("Cannot write a " + std::to_string(size.width()) + "x" + std::to_string(size.height())
+                                     + " TIFF: larger than 4 GB");
+    if(!file_.open(QIODevice::WriteOnly))
+        throw std::ios_base::failure("Cannot write " + path.toStdString());
+
+    out o;
+    o.bytes = "II";
+    o.u16(42);
+    o.u32(ifd);
+    o.u16(entries);
+    o.entry(256, t_long, size.width());
+    o.entry(257, t_long, size.height());
+    o.entry(258, t_short, 3, bits);
+    // No compression, RGB
+    o.entry(259, t_short, 1);
+    o.entry(262, t_short, 2);
+    if(strips == 1)
+        o.entry(273, t_long, pixels);
+    else
+        o.entry(273, t_long, strips, offsets);
+    o.entry(277, t_short, 3);
+    o.entry(278, t_long, rows);
+    if(strips == 1)
+        o.entry(279, t_long, row_bytes * size.height());
+    else
+        o.entry(279, t_long, strips, counts);
+    o.entry(282, t_rational, 1, xres);
+    o.entry(283, t_rational, 1, yres);
+    // Interleaved, resolution in inches
+    o.entry(284, t_short, 1);
+    o.entry(296, t_short, 2);
+    // The only directory
+    o.u32(0);
+    for(int i = 0; i < 3; ++i)
+        o.u16(8);
+    o.u16(0);
+    for(int i = 0; i < 2; ++i) {
+        o.u32(dpi);
+        o.u32(1);
+    }
+    for(std::uint32_t s = 0; s < strips; ++s)
+        o.u32(pixels + s * rows * row_bytes);
+    for(std::uint32_t s = 0; s < strips; ++s)
+        o.u32(std::min<std::uint32_t>(rows, size.height() - s * rows) * row_bytes);
+    if(file_.write(o.bytes.data(), o.bytes.size()) != static_cast<qint64>(o.bytes.size()))
+        throw std::ios_base::failure("Cannot write " + path.toStdString());
+}
+
+
+void
+TiffWriter::write(QImage const &strip)
+{
+    int const n = std::min(strip.height(), size_.height() - written_);
+    if(n <= 0)
+        return;
+    QImage const in = strip.format() == QImage::Format_RGB32 || strip.format() == QImage::Format_ARGB32 ? strip : strip.convertToFormat(QImage::Format_RGB32);
+    int const w = std::min(in.width(), size_.width());
+    std::size_t const row_bytes = 3 * static_cast<std::size_t>(size_.width());
+    buf_.assign(row_bytes * n, 0);
+    for(int y = 0; y < n; ++y) {
+        auto const *src = reinterpret_cast<QRgb const *>(in.constScanLine(y));
+        unsigned char *dst = buf_.data() + y * row_bytes;
+        for(int x = 0; x < w; ++x) {
+            *dst++ = qRed(src[x]);
+            *dst++ = qGreen(src[x]);
+            *dst++ = qBlue(src[x]);
+        }
+    }
+    if(file_.write(reinterpret_cast<char const *>(buf_.data()), buf_.size()) != static_cast<qint64>(buf_.size()))
+        throw std::ios_base::failure("Cannot write " + file_.fileName().toStdString());
+    written_ += n;
+}
+
+
+void
+TiffWriter::finish()
+{
+    if(written_ != size_.height() || !file_.commit())
+        throw std::ios_base::failure("Cannot write " + file_.fileName().toStdString());
+}
@@ -0,0 +1,46 @@
+#ifndef __IMGEX_TIFF_H
+#define __IMGEX_TIFF_H
+
+#include <cstdint>
+#include <vector>
+#include <QImage>
+#include <QSaveFile>
+#include <QSize>
+#include <QString>
+
+
+/** TiffWriter writes an uncompressed RGB TIFF a strip at a time, so an image
+ * far larger than memory can be written as it is rendered.
+ *
+ * Without compression every strip's size and place in the file are known up
+ * front, so the directory is written first and the pixels follow in order.
+ * Classic TIFF addresses 4 GB, which is some 1.4 gigapixels (e.g. 46k x 30k).
+ */
+class TiffWriter final {
+public:
+    /** Start the file, which replaces any existing one once finished
+     * \param rows rows per strip: every strip written but the last has this many
+     * \param dpi resolution recorded for printing
+     * \throws std::ios_base::failure if the file can't be written or the image is too large */
+    TiffWriter(QString const &path, QSize size, int rows, int dpi = 300);
+    TiffWriter(TiffWriter const &) = delete;
+    TiffWriter &operator=(TiffWriter const &) = delete;
+
+    /** Write the next strip, of RGB32 or ARGB32 pixels, the image's width wide */
+    void write(QImage const &strip);
+
+    /** Commit the file once every strip is written
+     * \throws std::ios_base::failure */
+    void finish();
+
+private:
+    QSaveFile file_;
+    QSize size_;
+    /** Rows written so far */
+    int written_;
+    /** One strip's samples, reused */
+    std::vector<unsigned char> buf_;
+};
+
+
+#endif
@@ -0,0 +1,155 @@
+#include "tiled.hh"
+#include "common.hh"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <QImageIOHandler>
+#include <QImageReader>
+#include <QMetaObject>
+#include <QObject>
+
+
+namespace {
+
+/** Images with more pixels than this are tiled (IMGEX_TILE_MP, in megapixels) */
+std::uint64_t
+tile_threshold() noexcept
+{
+    // Zero would tile everything, so it means the default too
+    std::uint64_t mp = env_number("IMGEX_TILE_MP", 100);
+    return (mp ? mp : 100) * 1000000;
+}
+
+}
+
+
+std::shared_ptr<TiledImage>
+TiledImage::open(QString const &path, QSize screen)
+{
+    QImageReader reader(path);
+    QSize const size = reader.size();
+    if(!size.isValid() || static_cast<std::uint64_t>(size.width()) * size.height() <= tile_threshold())
+        return std::shared_ptr<TiledImage>();
+    // Otherwise QImageReader decodes the whole image and copies the tile out of it
+    if(!reader.supportsOption(QImageIOHandler::ClipRect))
+        return std::shared_ptr<TiledImage>();
+    // Enough tiles for the screen several times over, so panning back is free
+    std::size_t const capacity = 4 * std::size_t(screen.width() + 2 * tile_size) * (screen.height() + 2 * tile_size) * 4;
+    return std::make_shared<TiledImage>(path, size, capacity);
+}
+
+
+TiledImage::TiledImage(QString const &path, QSize size, std::size_t capacity) : path_(path), size_(size), levels_(1),
+                                                                                capacity_(capacity), mtx_(), tiles_(), clock_(0), bytes_(0),
+                                                                                pool_(2)
+{
+    // Up to the level that fits in one tile
+    for(int s = std::max(size.width(), size.height()); s > tile_size; s = (s + 1) / 2)
+        ++levels_;
+}
+
+
+int
+TiledImage::level_for(qreal scale) const noexcept
+{
+    if(scale >= 1.0)
+        return 0;
+    // The smallest level still at least as large as the screen wants
+    int const l = static_cast<int>(std::floor(std::log2(1.0 / scale)));
+    return std::clamp(l, 0, levels_ - 1);
+}
+
+
+QRect
+TiledImage::tiles_in(int level, QRect area) const noexcept
+{
+    area &= QRect(QPoint(0, 0), size_);
+    if(area.isEmpty())
+        return QRect();
+    int const span = tile_size << level;
+    return QRect(QPoint(area.left() / span, area.top() / span), QPoint(area.right() / span, area.bottom() / span));
+}
+
+
+QRect
+TiledImage::tile_rect(int level, QPoint tile) const noexcept
+{
+    int const span = tile_size << level;
+    return QRect(tile.x() * span, tile.y() * span, span, span) & QRect(QPoint(0, 0), size_);
+}
+
+
+QImage
+TiledImage::tile(int level, QPoint tile, QObject *context, std::function<void()> ready)
+{
+    std::uint64_t const k = key(level, tile);
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        auto &s = tiles_[k];
+        s.used = ++clock_;
+        if(!s.image.isNull() || s.pending)
+            return s.image;
+        s.pending = true;
+    }
+    pool_.submit([this, k, level, tile, context, ready = std::move(ready)] {
+        QImage img = decode(level, tile);
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            auto p = tiles_.find(k);
+            if(p == tiles_.end())
+                return;
+            // A tile which fails to decode stays pending, so it is not tried again
+            p->second.pending = img.isNull();
+            p->second.image = img;
+            bytes_ += img.sizeInBytes();
+            evict();
+        }
+        if(!img.isNull())
+            QMetaObject::invokeMethod(context, ready, Qt::QueuedConnection);
+    });
+    return QImage();
+}
+
+
+QImage
+TiledImage::decode(int level, QPoint tile) const
+{
+    QRect const src = tile_rect(level, tile);
+    QImageReader reader(path_);
+    // Clipping comes before scaling
+    reader.setClipRect(src);
+    reader.setScaledSize(QSize(std::max(1, src.width() >> level), std::max(1, src.height() >> level)));
+    QImage img = reader.read();
+    if(img.isNull())
+        return img;
+    return img.convertToFormat(img.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+}
+
+
+void
+TiledImage::evict()
+{
+    if(bytes_ <= capacity_)
+        return;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> order;
+    order.reserve(tiles_.size());
+    for(auto const &[k, s] : tiles_)
+        if(!s.pending)
+            order.emplace_back(s.used, k);
+    std::sort(order.begin(), order.end());
+    for(auto const &[used, k] : order) {
+        if(bytes_ <= capacity_ * 3 / 4)
+            break;
+        auto p = tiles_.find(k);
+        bytes_ -= p->second.image.sizeInBytes();
+        tiles_.erase(p);
+    }
+}
+
+
+std::size_t
+TiledImage::memory_usage() const
+{
+    std::lock_guard<std::mutex> lk(mtx_);
+    return bytes_;
+}
@@ -0,0 +1,94 @@
+#ifndef __IMGEX_TILED_H
+#define __IMGEX_TILED_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <QImage>
+#include <QPoint>
+#include <QRect>
+#include <QSize>
+#include <QString>
+#include "workers.hh"
+
+class QObject;
+
+
+/** TiledImage gives the pixels of an image too large to decode whole, such
+ * as a stitched panorama, as 256x256 tiles at a pyramid of levels: level 0 is
+ * full resolution and each level above it half the one below.
+ *
+ * Tiles are decoded on demand, in the background, with QImageReader clipping
+ * to the tile and scaling to the level, so only what is on screen is ever
+ * decoded.  Decoded tiles are kept up to a byte capacity, least recently used
+ * first out, so memory follows the screen area rather than the image area.
+ */
+class TiledImage final {
+public:
+    static constexpr int tile_size = 256;
+
+    /** Tiling for the file at path, or null if it is small enough to decode whole
+     * (or its format can't decode part of an image, which tiling relies on)
+     * \param screen size of the screen, which the tile cache is sized for */
+    static std::shared_ptr<TiledImage> open(QString const &path, QSize screen);
+
+    /** \param size size of the image
+     * \param capacity bytes of decoded tiles to keep */
+    TiledImage(QString const &path, QSize size, std::size_t capacity);
+    TiledImage(TiledImage const &) = delete;
+    TiledImage &operator=(TiledImage const &) = delete;
+
+    [[nodiscard]] QSize size() const noexcept { return size_; }
+    [[nodiscard]] int levels() const noexcept { return levels_; }
+
+    /** The level to draw from at a scale (screen pixels per image pixel) */
+    [[nodiscard]] int level_for(qreal scale) const noexcept;
+
+    /** The tiles of a level (as a rectangle of tile numbers) covering a rectangle of image pixels */
+    [[nodiscard]] QRect tiles_in(int level, QRect area) const noexcept;
+
+    /** The image pixels covered by a tile */
+    [[nodiscard]] QRect tile_rect(int level, QPoint tile) const noexcept;
+
+    /** A tile, or a null image if it has yet to be decoded, in which case it
+     * is queued and ready is called on context's thread once it is available */
+    [[nodiscard]] QImage tile(int level, QPoint tile, QObject *context, std::function<void()> ready);
+
+    /** Bytes held by decoded tiles */
+    [[nodiscard]] std::size_t memory_usage() const;
+
+private:
+    struct slot {
+        QImage image;
+        /** For least recently used eviction */
+        std::uint64_t used;
+        /** Queued for decoding */
+        bool pending;
+    };
+
+    QString const path_;
+    QSize const size_;
+    int levels_;
+    std::size_t const capacity_;
+    mutable std::mutex mtx_;
+    std::unordered_map<std::uint64_t, slot> tiles_;
+    std::uint64_t clock_;
+    std::size_t bytes_;
+    /** Last, so it is joined before the tiles go */
+    WorkerPool pool_;
+
+    static std::uint64_t key(int level, QPoint tile) noexcept
+    {
+        return static_cast<std::uint64_t>(level) << 48 | static_cast<std::uint64_t>(tile.y()) << 24 | static_cast<std::uint32_t>(tile.x());
+    }
+    /** Drop least recently used tiles until within capacity; call with mtx_ held */
+    void evict();
+    /** Decode a tile (off the GUI thread) */
+    QImage decode(int level, QPoint tile) const;
+};
+
+
+#endif
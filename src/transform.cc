@@ -1,9 +1,14 @@
 #include "decor.hh"
 #include "image.hh"
+#include "resample.hh"
+#include "source.hh"
+#include "tiled.hh"
 #include "transform.hh"
 
 #include <algorithm>
+#include <cstdlib>
 #include <iterator>
+#include <QPainter>
 #include <QPixmap>
 #include <iostream>
 
@@ -22,11 +27,13 @@ operator<<(std::ostream &os, Transformable::transform const &wf)
 
 
 
-Transformable::Transformable(const ImageFile &fn) : img_(), cache_(), wbox_(), txfs_()
+Transformable::Transformable(const ImageFile &fn) : img_(), view_(), src_(), src_hold_(), mips_(), tiles_(), wbox_(), txfs_(), reduction_(1.0f)
 {
     QString path{fn.getPath()};
     if(!img_.load(path))
         throw FileNotFound(path);
+    src_ = img_;
+    view_ = img_.rect();
     // XXX for now, all new transformable start at global upper left
     wbox_ = QRect(QPoint(0,0), img_.size());
     // TODO: restore transform associated with ImageFile and run it
@@ -44,7 +51,14 @@ Transformable::add_from_decorator(const XILDecorator &dec)
 void
 Transformable::run()
 {
-    // FIXME
+    auto const p = txfs_.compile(src_.size());
+    if(txfs_.has_zoom() && !tiled()) {
+        render_crop(p.size, Qt::SmoothTransformation);
+    } else {
+        img_ = src_;
+        view_ = p.source;
+    }
+    wbox_ = QRect(p.offset, tiled() ? p.size : view_.size());
 }
 
 
@@ -58,12 +72,26 @@ QRect Transformable::move_to(QPoint point)
 }
 
 QRect Transformable::zoom_to(float g)
+{
+    return zoom_with(g, Qt::SmoothTransformation);
+}
+
+QRect Transformable::zoom_with(float g, Qt::TransformationMode mode)
 {
     txfs_.zoom_ = g;
-    if(cache_.isNull())
-        cache_ = img_.copy();
     QSize target = zoom_box(g);
-    img_ = cache_.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    if(tiled()) {
+        // Drawn from the tiles (see XILImage::render), nothing to resample
+        img_ = src_;
+        view_ = source_rect();
+    } else if(txfs_.has_zoom()) {
+        render_crop(target, mode);
+    } else {
+        // Back to 1:1 is just a view of the source again
+        img_ = src_;
+        view_ = source_rect();
+        target = view_.size();
+    }
 
     QRect oldbox{wbox_};
     // FIXME allow zooming around centre or mouse point
@@ -75,27 +103,104 @@ QRect Transformable::zoom_to(float g)
     return oldbox | wbox_;
 }
 
+QImage Transformable::mip_level(QImage const &src, std::vector<QImage> &mips, QSize target, QRectF &from)
+{
+    QImage level{src};
+    for(std::size_t k = 0; ; ++k) {
+        QSize half{(level.width() + 1) / 2, (level.height() + 1) / 2};
+        // Halving the level halves the crop within it
+        if(from.width() / 2 < target.width() || from.height() / 2 < target.height() || half.width() < 2 || half.height() < 2)
+            return level;
+        // Each level is a 2:1 (box filtered) reduction of the previous one
+        if(k == mips.size())
+            mips.push_back(Resampler::shared()->scale(level, level.rect(), half, Resampler::filter::box));
+        qreal const sx = qreal(half.width()) / level.width(), sy = qreal(half.height()) / level.height();
+        from = QRectF(from.x() * sx, from.y() * sy, from.width() * sx, from.height() * sy);
+        level = mips[k];
+    }
+}
+
+
+QImage Transformable::mip_for(QSize target, QRectF &from)
+{
+    from = source_rect();
+    std::size_t const had = mips_.size();
+    // Raster pixmaps share their pixels with toImage
+    QImage level{mip_level(src_.toImage(), mips_, target, from)};
+    if(mips_.size() != had)
+        allocated();
+    return level;
+}
+
+
+QImage Transformable::resample(QImage const &img, QRectF from, QSize target, Qt::TransformationMode mode)
+{
+    if(mode == Qt::SmoothTransformation)
+        return Resampler::shared()->scale(img, from, target);
+    // Nearest neighbour, for following the wheel
+    QImage out(target, img.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+    QPainter p(&out);
+    p.setCompositionMode(QPainter::CompositionMode_Source);
+    p.drawImage(QRectF(out.rect()), img, from);
+    p.end();
+    return out;
+}
+
+
+void Transformable::render_crop(QSize target, Qt::TransformationMode mode)
+{
+    QRectF from{source_rect()};
+    // Nearest neighbour reads a source pixel per target pixel whatever the scale,
+    // so following the wheel needs no mips (nor the time to build them)
+    QImage const level{mode == Qt::FastTransformation ? src_.toImage() : mip_for(target, from)};
+    // Raster pixmaps share their pixels with toImage and (as an rvalue) fromImage
+    img_ = QPixmap::fromImage(resample(level, from, target, mode));
+    view_ = img_.rect();
+    allocated();
+}
+
+
+std::size_t Transformable::mip_bytes() const noexcept
+{
+    std::size_t n = 0;
+    for(auto const &m : mips_)
+        n += static_cast<std::size_t>(m.sizeInBytes());
+    return n;
+}
+
+
+Transformable::memory Transformable::memory_use() const
+{
+    // img_ is the source itself unless zoomed
+    return memory{pixmap_bytes(src_), img_.cacheKey() == src_.cacheKey() ? 0 : pixmap_bytes(img_), mip_bytes(),
+                  tiles_ ? tiles_->memory_usage() : 0};
+}
+
+
 QRect Transformable::crop(QRect c)
 {
-    // Note that c comes in local coordinates
-    img_ = img_.copy(c);
+    // Note that c comes in local coordinates, which are those of the view:
+    // only the view narrows, the pixels stay where they are
+    if(!tiled())
+        view_ = c.translated(view_.topLeft()) & view_;
 
     QRect oldbox{wbox_}; // note global coordinates (top left rel to parent window)
     // Shift display box so the result image is in the box it was selected from
     wbox_.adjust(c.x(), c.y(), 0, 0);
     wbox_.setSize(c.size());
-    // crop the current pre-zoom image as well
+    // Where a replay must put it
+    txfs_.move_ = wbox_.topLeft();
     if(txfs_.has_zoom()) {
-        // Update the pre-zoomed image by unzooming the current crop instructions
-        auto z = txfs_.zoom_;
-        c.setSize(c.size() / z);
+        // Find the crop in source pixels by unzooming the current crop instructions;
         // topleft is local - relative to the current image
-        c.setTopLeft(c.topLeft() / z);
-        if(!cache_.isNull())
-            cache_ = cache_.copy(c);
+        auto z = txfs_.zoom_;
+        c = QRect(c.topLeft() / z, c.size() / z);
     }
     txfs_.crop_.adjust(c.x(), c.y(), 0, 0);
     txfs_.crop_.setSize(c.size());
+    txfs_.crop_ &= src_.rect();
+    if(tiled())
+        view_ = source_rect();
 
     // Since we crop within the image oldbox should always be the larger
     return oldbox;
@@ -104,8 +209,58 @@ QRect Transformable::crop(QRect c)
 
 void Transformable::copy_from(const Transformable &orig)
 {
-    img_ = orig.img_.copy();
+    // The pyramid stays valid as long as the pixels are the same
+    if(src_.cacheKey() != orig.src_.cacheKey())
+        mips_.clear();
+    img_ = orig.img_;
+    view_ = orig.view_;
+    src_ = orig.src_;
+    src_hold_ = orig.src_hold_;
+    tiles_ = orig.tiles_;
     wbox_ = orig.wbox_;
     txfs_ = orig.txfs_;
-    cache_ = QPixmap();
+    reduction_ = orig.reduction_;
+}
+
+
+Transformable::transform Transformable::source_transform() const noexcept
+{
+    transform t{txfs_};
+    float const r = reduction_;
+    if(t.crop_.isValid())
+        t.crop_ = QRectF(t.crop_.x() * r, t.crop_.y() * r, t.crop_.width() * r, t.crop_.height() * r).toRect();
+    t.zoom_ /= r;
+    return t;
+}
+
+
+void Transformable::restore(transform const &t)
+{
+    float const r = reduction_;
+    txfs_ = t;
+    if(t.crop_.isValid())
+        txfs_.crop_ = QRectF(t.crop_.x() / r, t.crop_.y() / r, t.crop_.width() / r, t.crop_.height() / r).toRect() & src_.rect();
+    txfs_.zoom_ = t.zoom_ * r;
+    // Where the edits would have put us, so run has nothing to report
+    auto const p = txfs_.compile(src_.size());
+    wbox_ = QRect(p.offset, p.size);
+    run();
+}
+
+
+void Transformable::adopt_resolution(QPixmap img, float reduction, std::shared_ptr<void const> hold)
+{
+    if(reduction >= reduction_)
+        return;
+    float const f = reduction_ / reduction;
+    // The crop was recorded in our (reduced) pixel coordinates
+    if(txfs_.crop_.isValid())
+        txfs_.crop_ = QRect(txfs_.crop_.topLeft() * f, txfs_.crop_.size() * f) & img.rect();
+    txfs_.zoom_ /= f;
+    reduction_ = reduction;
+    mips_.clear();
+    src_ = img;
+    src_hold_ = std::move(hold);
+    // Same size on screen, now resampled from the full pixels
+    render_crop(wbox_.size(), Qt::SmoothTransformation);
 }
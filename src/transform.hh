@@ -2,8 +2,12 @@
 #define __IMGEX_TRANSFORM_H
 
 
+#include <cstddef>
 #include <iosfwd>
 #include <list>
+#include <memory>
+#include <vector>
+#include <QImage>
 #include <QRect>
 #include <QPixmap>
 #include <boost/archive/text_oarchive.hpp>
@@ -33,28 +37,74 @@ class XILDecorator;
  * This class is the visitee, being visited by transform through apply.
  */
 class ImageFile;
+class TiledImage;
+class Collage;
 class XWindow;
 class Transformable {
 private:
 
     // XXX temporary hack
+    friend class Collage;
     friend class XWindow;
 public:
-    /** Alias for XILImage's box in parent's coordinates */
+    /** Alias for XILImage's box, placed on the canvas (see Collage) */
     typedef QRect xwParentBox;
 
+    struct transform {
+        // Starting from a new image in upper left (0,0) transformations are applied in the following order
+        // crop in pixmap-local coordinates (same as global as pre-transform images start top left (0,0)
+        QRect crop_;
+        // then zoom to absolute value keeping top left fixed
+        float zoom_;
+        // and finally move top left point to a new location
+        QPoint move_;
+
+        transform() : crop_(), zoom_(1.0), move_(0,0) {}
+
+        bool has_zoom() const noexcept { return std::fabs(zoom_-1.0f) > 1e-4; }
+
+        /** A transform reduced to what it does to an image */
+        struct plan {
+            /** The part of the source which is shown */
+            QRect source;
+            /** Size on screen, the source part scaled by zoom_ */
+            QSize size;
+            /** Top left on screen */
+            QPoint offset;
+        };
+
+        /** Compile for a source image of the given size.
+         * Inline so imgex-render can use it without the windowing code */
+        [[nodiscard]] plan compile(QSize source) const noexcept
+        {
+            QRect const all{QPoint(0, 0), source};
+            plan p{crop_.isValid() ? crop_ & all : all, QSize(), move_};
+            // Rounded as zoom_box
+            p.size = QSize(p.source.width() * zoom_ + 0.99f, p.source.height() * zoom_ + 0.99f);
+            return p;
+        }
+    };
+
     Transformable(ImageFile const &fn);
 
     /** Create a base Transformable
      * Pixmaps are value copyable
      * @param img base pixmap (not null)
+     * @param reduction source pixels per pixel of img, if img was decoded at reduced size
+     * or is an embedded preview
+     * @param hold kept while img is, if SourceRegistry shares it
      */
-    Transformable(QPixmap img) : img_(img), cache_(), wbox_(img.rect()), txfs_() {}
+    Transformable(QPixmap img, float reduction = 1.0f, std::shared_ptr<void const> hold = {}) :
+            img_(img), view_(img.rect()), src_(img), src_hold_(std::move(hold)), mips_(), tiles_(), wbox_(img.rect()), txfs_(),
+            reduction_(reduction) {}
 	virtual ~Transformable() = default;
     // not inline functions defined in transform.cc
     void add_from_decorator(XILDecorator const &dec);
 
-    /** Run the current transform on the current image */
+    /** Run the current transform on the current image
+     * The transform is compiled and the displayed pixels made from src_ in one
+     * resampling, however many edits it records, so a restored session looks
+     * the same as it did when saved */
     virtual void run();
 
     /** reset working copy of image to its Image */
@@ -68,39 +118,113 @@ public:
      * Returns the global rectangle to redraw */
     virtual QRect zoom_to(float);
 
+    /** Zoom as zoom_to, choosing the resampling.  Qt::FastTransformation
+     * from a mip level is cheap enough to follow the wheel at any image size */
+    QRect zoom_with(float, Qt::TransformationMode);
+
+    /** Whether we hold the image at less than its full resolution */
+    [[nodiscard]] bool reduced() const noexcept { return reduction_ > 1.0f; }
+    [[nodiscard]] float reduction() const noexcept { return reduction_; }
+
+    /** Swap in a higher resolution version of our image, keeping the current placement.
+     * The transform, which is in pixel coordinates, is rescaled to match.
+     * @param img the same image decoded with the given reduction (smaller than ours)
+     * @param hold kept while img is, if SourceRegistry shares it */
+    void adopt_resolution(QPixmap img, float reduction, std::shared_ptr<void const> hold);
+
+    /** Our transform in source (full resolution) pixels, as saved in sessions */
+    [[nodiscard]] transform source_transform() const noexcept;
+    /** Take a transform in source pixels (from source_transform) and run it */
+    void restore(transform const &);
+
+    /** Show the image from tiles when zoomed past the pixels we hold,
+     * for images too large to hold at full resolution */
+    void set_tiles(std::shared_ptr<TiledImage> tiles) { tiles_ = std::move(tiles); }
+    /** Whether the image is drawn from tiles (rather than img_) */
+    [[nodiscard]] bool tiled() const noexcept { return tiles_ && txfs_.zoom_ > 1.0f + 1e-4f; }
+
+    /** The part of wbox_ our pixels cover opaquely, so nothing under it need be drawn;
+     * empty if the image has alpha.  Loaded images have alpha only if they use it
+     * (see ImageLoader), so this is a format check, not a look at the pixels */
+    [[nodiscard]] QRect opaque_area() const noexcept
+    {
+        if(src_.hasAlphaChannel())
+            return QRect();
+        return tiled() ? wbox_ : QRect(wbox_.topLeft(), view_.size()) & wbox_;
+    }
+
+    /** Bytes held by the mip pyramid */
+    [[nodiscard]] std::size_t mip_bytes() const noexcept;
+    [[nodiscard]] std::size_t mip_levels() const noexcept { return mips_.size(); }
+
+    /** Bytes of pixels held, by what they are for */
+    struct memory {
+        /** The pixels we transform, shared with every image of the same file (see SourceRegistry) */
+        std::size_t source;
+        /** Made from them for display (a zoom); none while the source is shown as it is */
+        std::size_t derived;
+        /** The mip pyramid */
+        std::size_t mips;
+        /** Decoded tiles, also shared by file */
+        std::size_t tiles;
+    };
+    [[nodiscard]] memory memory_use() const;
+    /** Identifies the source pixels, to count them once however many images share them */
+    [[nodiscard]] qint64 source_key() const noexcept { return src_.cacheKey(); }
+    /** What keeps the source pixels registered as in use (see SourceRegistry) */
+    [[nodiscard]] std::shared_ptr<void const> source_hold() const noexcept { return src_hold_; }
+
     /** Crop to relative box (in local pixmap coordinates)
      * Returns the global rectangle to redraw
      * Note the return value is in global coordinates like the other transform functions */
     virtual QRect crop(QRect);
 
-    struct transform {
-        // Starting from a new image in upper left (0,0) transformations are applied in the following order
-        // crop in pixmap-local coordinates (same as global as pre-transform images start top left (0,0)
-        QRect crop_;
-        // then zoom to absolute value keeping top left fixed
-        float zoom_;
-        // and finally move top left point to a new location
-        QPoint move_;
-
-        transform() : crop_(), zoom_(1.0), move_(0,0) {}
-
-        bool has_zoom() const noexcept { return std::fabs(zoom_-1.0f) > 1e-4; }
-    };
+    /** Scale the part from of an image to size target, reading only that part.
+     * Used for zooms; safe to call off the GUI thread */
+    static QImage resample(QImage const &img, QRectF from, QSize target, Qt::TransformationMode mode);
 
 protected:
-    /** The image to be transformed */
+    /** The image as displayed: src_ itself when not zoomed, else the zoomed crop */
     QPixmap img_;
-    /** Temporary cache of cropped image before zoom is applied
-     * Needed tp ensure we don't lose zoom resolution and to avoid redoing the crop.
-     * Note we can never uncrop from within this class itself
-     */
-     QPixmap cache_;
+    /** The part of img_ which is displayed (the crop, if img_ is src_) */
+    QRect view_;
+    /** The pixels we transform, never modified and shared with the Image we were copied from.
+     * Cropping just narrows txfs_.crop_ and view_, so it costs no pixel copies */
+    QPixmap src_;
+    /** Held with src_ while SourceRegistry shares it, so the registry knows it is in use; else null */
+    std::shared_ptr<void const> src_hold_;
+    /** Mip pyramid of src_: 1/2, 1/4, 1/8... built as smooth zooms need them,
+     * so a zoom resamples from the nearest larger level rather than from src_.
+     * Being of the whole image, they survive crops */
+    std::vector<QImage> mips_;
+    /** Full resolution tiles of an image too large to decode whole (see TiledImage); may be null.
+     * While tiled(), img_ is src_ and view_ the crop, drawn scaled where tiles are missing */
+    std::shared_ptr<TiledImage> tiles_;
     /** placement on main window; width and height equivalent to the image size times scale */
     xwParentBox wbox_;
 
+    /** Pixels have been allocated: a zoom made or a mip level built.  For
+     * XILImage, which holds its pixels within a budget (see MemoryBudget) */
+    virtual void allocated() {}
+
+    /** The crop in src_ coordinates (all of src_ if uncropped) */
+    [[nodiscard]] QRect source_rect() const noexcept { return txfs_.crop_.isValid() ? txfs_.crop_ : src_.rect(); }
+
+    /** The smallest of src and the levels of its mip pyramid in which the crop is at least
+     * target in size, building the levels missing from mips.  Safe off the GUI thread,
+     * given its own copy of the levels (the copies share their pixels)
+     * @param from the crop in src, set to the crop in the level's coordinates */
+    static QImage mip_level(QImage const &src, std::vector<QImage> &mips, QSize target, QRectF &from);
+    /** mip_level for src_ and mips_
+     * @param from set to the crop in the level's coordinates */
+    QImage mip_for(QSize target, QRectF &from);
+
+    /** Set img_ and view_ to the crop scaled to target */
+    void render_crop(QSize target, Qt::TransformationMode mode);
+
     QSize zoom_box(float g)
     {
-        QSize target{cache_.isNull() ? img_.size() : cache_.size()};
+        QSize target{source_rect().size()};
         target.setHeight(target.height() * g + 0.99f );
         target.setWidth(target.width() * g + 0.99f );
         return target;
@@ -108,6 +232,9 @@ protected:
 
     struct transform txfs_;
 
+    /** Source pixels per pixel of the image we hold (decode-to-fit, previews) */
+    float reduction_;
+
     friend std::ostream &operator<<(std::ostream &, transform const &);
     /** Serialise */
 
@@ -0,0 +1,64 @@
+#include "workers.hh"
+#include <algorithm>
+
+
+WorkerPool::WorkerPool(unsigned threads) : busy_(0), stop_(false)
+{
+    if(threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads_.reserve(threads);
+    for(unsigned i = 0; i < threads; ++i)
+        threads_.emplace_back(&WorkerPool::work, this);
+}
+
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        stop_ = true;
+        jobs_.clear();
+    }
+    more_.notify_all();
+    for(auto &t : threads_)
+        t.join();
+}
+
+
+void
+WorkerPool::submit(job_t job)
+{
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        jobs_.push_back(std::move(job));
+    }
+    more_.notify_one();
+}
+
+
+void
+WorkerPool::wait()
+{
+    std::unique_lock<std::mutex> lk(mtx_);
+    idle_.wait(lk, [this] { return jobs_.empty() && busy_ == 0; });
+}
+
+
+void
+WorkerPool::work()
+{
+    std::unique_lock<std::mutex> lk(mtx_);
+    for(;;) {
+        more_.wait(lk, [this] { return stop_ || !jobs_.empty(); });
+        if(stop_)
+            return;
+        job_t job{std::move(jobs_.front())};
+        jobs_.pop_front();
+        ++busy_;
+        lk.unlock();
+        job();
+        lk.lock();
+        --busy_;
+        idle_.notify_all();
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef __IMGEX_WORKERS_H
+#define __IMGEX_WORKERS_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/** WorkerPool is a fixed set of threads running jobs from a shared queue.
+ * Jobs run off the GUI thread so they must not touch QPixmap or QWindow;
+ * results are handed back by the job itself (see ImageLoader).
+ */
+class WorkerPool final {
+public:
+    typedef std::function<void()> job_t;
+
+    /** Start the pool
+     * \param threads number of threads, or 0 for one per core */
+    explicit WorkerPool(unsigned threads = 0);
+    /** Jobs not yet started are discarded; running jobs are joined */
+    ~WorkerPool();
+    WorkerPool(WorkerPool const &) = delete;
+    WorkerPool(WorkerPool &&) = delete;
+    WorkerPool &operator=(WorkerPool const &) = delete;
+    WorkerPool &operator=(WorkerPool &&) = delete;
+
+    /** Queue a job (does not block) */
+    void submit(job_t);
+
+    /** Block until the queue is empty and no job is running */
+    void wait();
+
+    [[nodiscard]] unsigned size() const noexcept { return static_cast<unsigned>(threads_.size()); }
+
+private:
+    std::mutex mtx_;
+    /** Signalled when a job is queued or the pool is stopping */
+    std::condition_variable more_;
+    /** Signalled when a job finishes */
+    std::condition_variable idle_;
+    std::deque<job_t> jobs_;
+    std::vector<std::thread> threads_;
+    /** Number of jobs currently running */
+    unsigned busy_;
+    bool stop_;
+
+    void work();
+};
+
+
+#endif
@@ -1,14 +1,21 @@
 #include "xwin.hh"
 #include "image.hh"
 #include "decor.hh"
+#include "source.hh"
+#include "tiled.hh"
 #include <iterator>
 #include <exception>
 #include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <memory>
+#include <set>
+#include <utility>
 
 #include <QGuiApplication>
 #include <QImage>
 #include <QPainter>
+#include <QScreen>
 #include <QString>
 #include <QSize>
 #include <QMouseEvent>
@@ -17,19 +24,28 @@
 #include <fstream>
 #include <fmt/core.h>
 
-XILImage::XILImage(XWindow &xw, std::unique_ptr<Image> img, QString const &name) : QWindow(&xw), Transformable(img->getImage()),
+XILImage::XILImage(Collage &c, XWindow &xw, std::unique_ptr<Image> img, QString const &name) : QWindow(&xw), Transformable(img->getImage()),
                                                                          // Note we take ownership of the Image and img is invalid from now on
-                                                                                   canvas_(this),
-                                                                                   parent_(&xw), loc(0,0), track_(false), focused_(false),
-                                                                                   resize_on_zoom_(true),
-                                                                                   zoom_(1.0f), name_(name)
+                                                                                   canvas_(),
+                                                                                   collage_(c), loc(0,0), track_(false), focused_(false),
+                                                                                   resize_on_zoom_(true), fetching_(false), loading_(false),
+                                                                                   zoom_(1.0f), name_(name),
+                                                                                   settle_(), rescale_gen_(std::make_shared<std::atomic<unsigned>>(0)),
+                                                                                   journal_id_(0), drawn_(0), evicted_(), remaking_(false), preview_()
 {
+    settle_.setSingleShot(true);
+    settle_.setInterval(150);
+    QObject::connect(&settle_, &QTimer::timeout, this, [this]() { collage_.rescale(*this); });
     orig_.swap(img);
 	// copy_from (re)sets wbox - we use the parent method since we're not ready to draw yet
     Transformable::copy_from(*orig_);
-    setGeometry(wbox_);
-    canvas_.resize(wbox_.size());
-	show();
+    place_window();
+    // A composited image never becomes a native window, being drawn by its parent
+    if(!xw.composited()) {
+        canvas_.emplace(this);
+        canvas_->resize(wbox_.size());
+        show();
+    }
 }
 
 
@@ -37,6 +53,7 @@ void
 XILImage::copy_from(Transformable const &orig)
 {
     QRect oldbox{wbox_};
+    cancel_rescale();
     Transformable::copy_from(orig);
     zoom_ = 1.0;
     mkexpose(oldbox | wbox_);
@@ -44,28 +61,247 @@ XILImage::copy_from(Transformable const &orig)
 
 
 void
-XILImage::render()
+XILImage::set_source(std::unique_ptr<Image> img)
+{
+    QRect oldbox{wbox_};
+    cancel_rescale();
+    loading_ = false;
+    orig_.swap(img);
+    Transformable::copy_from(*orig_);
+    allocated();
+    zoom_ = 1.0;
+    resize_canvas(wbox_.size());
+    place_window();
+    move_to(oldbox.topLeft());
+    if(restore_) {
+        // run (via restore) redraws
+        Transformable::restore(*restore_);
+        restore_.reset();
+        mkexpose(oldbox);
+        journal();
+        return;
+    }
+    mkexpose(oldbox | wbox_);
+}
+
+
+void
+XILImage::set_full_resolution(std::unique_ptr<Image> img)
+{
+    fetching_ = false;
+    if(img->reduction() >= reduction_)
+        return;
+    float const f = reduction_ / img->reduction();
+    // adopt_resolution resamples smoothly from the new pixels
+    cancel_rescale();
+    adopt_resolution(img->getImage(), img->reduction(), img->source_hold());
+    zoom_ /= f;
+    orig_.swap(img);
+    // The reduced pixels, unless another image still shows them
+    img.reset();
+    SourceRegistry::shared()->prune();
+    mkexpose(wbox_);
+}
+
+
+void
+XILImage::allocated()
+{
+    MemoryBudget::shared()->allocated();
+}
+
+
+void
+XILImage::remake()
+{
+    if(remaking_)
+        return;
+    remaking_ = true;
+    collage_.remake(*this);
+}
+
+
+std::size_t
+XILImage::evict_mips()
+{
+    std::size_t const n = mip_bytes();
+    // Built again as smooth zooms need them
+    mips_.clear();
+    return n;
+}
+
+
+std::size_t
+XILImage::evict_derived()
+{
+    if(evicted_ || img_.cacheKey() == src_.cacheKey())
+        return 0;
+    cancel_rescale();
+    remaking_ = false;
+    std::size_t const n = pixmap_bytes(img_);
+    // paint_image has it made again, seeing the zoom shown from the source
+    img_ = src_;
+    view_ = source_rect();
+    return n;
+}
+
+
+bool
+XILImage::evict_source()
+{
+    if(evicted_ || loading_ || fetching_ || tiles_ || src_.isNull())
+        return false;
+    cancel_rescale();
+    remaking_ = false;
+    // A little of what we showed stays, drawn scaled up until the source is back
+    QSize const small{wbox_.size().scaled(QSize(256, 256), Qt::KeepAspectRatio).boundedTo(wbox_.size())};
+    if(!small.isEmpty()) {
+        preview_ = QPixmap(small);
+        preview_.fill(Qt::transparent);
+        QPainter p(&preview_);
+        p.setRenderHint(QPainter::SmoothPixmapTransform);
+        p.drawPixmap(preview_.rect(), img_, view_);
+    }
+    evicted_ = source_transform();
+    // The file (for the session) and our place stay, without a pixel
+    orig_ = std::make_unique<Image>(orig_->getFile(), QPixmap(), reduction_);
+    src_ = img_ = QPixmap();
+    src_hold_.reset();
+    mips_.clear();
+    return true;
+}
+
+
+void
+XILImage::reinstate(std::unique_ptr<Image> img)
+{
+    if(!evicted_)
+        return;
+    transform t{*evicted_};
+    // Wherever we have been dragged to meanwhile
+    t.move_ = txfs_.move_;
+    evicted_.reset();
+    remaking_ = false;
+    preview_ = QPixmap();
+    QRect const oldbox{wbox_};
+    orig_.swap(img);
+    Transformable::copy_from(*orig_);
+    allocated();
+    // Replayed on pixels which may be of another reduction than before
+    Transformable::restore(t);
+    zoom_ = txfs_.zoom_;
+    if(zoom_ > 1.0f && reduced() && !fetching_) {
+        fetching_ = true;
+        collage_.fetch_full_resolution(*this);
+    }
+    resize_canvas(wbox_.size());
+    place_window();
+    mkexpose(oldbox | wbox_);
+}
+
+
+void
+XILImage::render(QRegion const &area)
 {
+	if(!canvas_) {
+		collage_.invalidate(area.translated(wbox_.topLeft()));
+		return;
+	}
 	if(!isExposed())
 		return;
     // local coordinates
-	QRect reg{0, 0, width(), height()};
-	canvas_.beginPaint(reg);
-	QPaintDevice *pd = canvas_.paintDevice();
+	QRegion reg{area & QRect(0, 0, width(), height())};
+	// Only what shows in the window hosting us
+	if(QWindow const *host = parent())
+		reg &= QRect(-position(), host->size());
+	if(reg.isEmpty())
+		return;
+	canvas_->beginPaint(reg);
+	QPaintDevice *pd = canvas_->paintDevice();
 	if(!pd) {
 		qWarning("Unable to get paint device");
-		// canvas_.endPaint(); - this will segfault though documentation is unclear
+		// canvas_->endPaint(); - this will segfault though documentation is unclear
 		return;
 	}
 	QPainter p(pd);
-	p.drawPixmap(0, 0, img_);
+	p.setClipRegion(reg);
+	paint(p);
+	p.end();
+	canvas_->endPaint();				// also frees pd
+	canvas_->flush(reg, this);
+}
+
+
+void
+XILImage::paint_image(QPainter &p)
+{
+	if(evicted_) {
+		// Until our pixels are back: what we kept of them, or else a grey box
+		if(preview_.isNull())
+			p.fillRect(box(), QColor(64, 64, 64));
+		else
+			p.drawPixmap(box(), preview_);
+		remake();
+		return;
+	}
+	if(!tiled() && txfs_.has_zoom() && img_.cacheKey() == src_.cacheKey()) {
+		// Our zoom was evicted: the source, scaled as it is drawn, until the zoom is made again
+		p.drawPixmap(box(), img_, view_);
+		remake();
+		return;
+	}
+	// Only the view (the crop) of img_ is drawn
+	if(tiled())
+		render_tiles(p);
+	else
+		p.drawPixmap(QPoint(0, 0), img_, view_);
+}
+
+
+void
+XILImage::paint_overlay(QPainter &p)
+{
+	if(decors_.empty())
+		return;
 	// shared painter properties for (presumably) all decorators
 	p.setBrush(Qt::NoBrush);
 	p.setBackgroundMode(Qt::TransparentMode);
 	std::for_each(decors_.begin(), decors_.end(), [&p](XILDecorator *dr) { dr->render(p); });
-	p.end();
-	canvas_.endPaint();				// also frees pd
-	canvas_.flush(reg, this);
+}
+
+
+void
+XILImage::render_tiles(QPainter &p)
+{
+    // Only what is being painted: the part of us in the window drawing us
+    QRect visible{box()};
+    if(p.hasClipping())
+        visible &= p.clipBoundingRect().toAlignedRect();
+    if(visible.isEmpty())
+        return;
+    // Local coordinates are held pixels (of src_) times zoom, less the crop;
+    // image (tile) pixels are held pixels times the reduction
+    qreal const z = txfs_.zoom_, r = reduction_;
+    QPointF const crop{source_rect().topLeft()};
+    QRect const area = QRectF((visible.x() / z + crop.x()) * r, (visible.y() / z + crop.y()) * r,
+                              visible.width() / z * r, visible.height() / z * r).toAlignedRect();
+    int const level = tiles_->level_for(z / r);
+    QRect const range = tiles_->tiles_in(level, area);
+    Collage *c = &collage_;
+    auto ready = [c, self = this] { c->refresh(self); };
+    p.setRenderHint(QPainter::SmoothPixmapTransform);
+    for(int ty = range.top(); ty <= range.bottom(); ++ty)
+        for(int tx = range.left(); tx <= range.right(); ++tx) {
+            QRect const tr = tiles_->tile_rect(level, QPoint(tx, ty));
+            QRectF const held{tr.x() / r, tr.y() / r, tr.width() / r, tr.height() / r};
+            QRectF const to{(held.x() - crop.x()) * z, (held.y() - crop.y()) * z, held.width() * z, held.height() * z};
+            QImage const img = tiles_->tile(level, QPoint(tx, ty), c, ready);
+            // Until the tile is decoded, show the pixels we hold
+            if(img.isNull())
+                p.drawPixmap(to, src_, held);
+            else
+                p.drawImage(to, img);
+        }
 }
 
 
@@ -88,12 +324,18 @@ XILImage::mousePressEvent(QMouseEvent *ev)
 		// Now find position relative to the top left corner
 		loc -= wbox_.topLeft();
 		track_ = true;
+		collage_.begin_drag(*this);
 	    break;
 	case Qt::MiddleButton:
+            // Nothing to edit until our pixels are back
+            if(evicted_)
+                break;
             zoom_to(1.0);
-            cache_ = QPixmap(); // Resetting size invalidates cache
+            journal();
 		break;
 	case Qt::RightButton:
+        if(evicted_)
+            break;
         // XXX for now, just start or end the crop process
         if(decors_.empty()) {
             add_decorator(new XILCropDecorator());
@@ -119,9 +361,21 @@ XILImage::mouseReleaseEvent(QMouseEvent *ev)
     if(decor_event(*ev))
         return;
 	switch(ev->button()) {
-	case Qt::LeftButton:
+	case Qt::LeftButton: {
 		track_ = false;
+		collage_.end_drag();
         move_to(wbox_.topLeft());
+        // A native window is in one window: dropped on another screen, it moves to that one's
+        if(canvas_) {
+            XWindow *to = collage_.containing(ev->screenPos().toPoint());
+            if(to && to != parent()) {
+                setParent(to);
+                place_window();
+            }
+        }
+        journal();
+		break;
+	}
 	default:
 		break;
 	}
@@ -140,7 +394,7 @@ XILImage::mouseMoveEvent(QMouseEvent *ev)
 		QPoint q{ev->globalPos()};
 		QPoint delta{ q-oldq_ };
 		oldq_ = q;
-		QPoint newpos{position() + delta };
+		QPoint newpos{wbox_.topLeft() + delta };
 		xwParentBox to{ newpos, from.size() };
 		wbox_ = to;
 		if(isTopLevel()) {
@@ -151,7 +405,7 @@ XILImage::mouseMoveEvent(QMouseEvent *ev)
 			q -= parent()->position();
 		}
 		// Move the window to the new location
-		setPosition(newpos);
+		place_window();
 		mkexpose( from | to );
 	}
 	QWindow::mouseMoveEvent(ev);
@@ -161,6 +415,8 @@ XILImage::mouseMoveEvent(QMouseEvent *ev)
 void
 XILImage::wheelEvent(QWheelEvent *ev)
 {
+	if(evicted_)
+		return;
 	// Area affected
     xwParentBox area = wbox_;
 
@@ -174,8 +430,8 @@ XILImage::wheelEvent(QWheelEvent *ev)
 // #if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
 //    resize(ev->globalPosition().toPoint(), resize_on_zoom_);
 
-	mkexpose(zoom_to(zoom_));
-    std::cerr << txfs_;
+	mkexpose(zoom_fast(zoom_));
+    journal();
 	QWindow::wheelEvent(ev);
 }
 
@@ -194,11 +450,8 @@ XILImage::exposeEvent(QExposeEvent *ev)
 void
 XILImage::mkexpose(xwParentBox const &area) const
 {
-	QWindow *parent = this->parent();
-	if(parent != nullptr) {
-		// XXX can't fail
-		dynamic_cast<XWindow *>(parent)->redraw(area);
-	}
+	collage_.placed(*this);
+	collage_.invalidate(area);
 }
 
 
@@ -208,6 +461,8 @@ XILImage::decor_event(QEvent &qev)
 	// Ask decorators if they want the event with most recent first
 	std::reverse_iterator<std::list<XILDecorator *>::iterator> p = decors_.rbegin(), q = decors_.rend();
 	while(p != q) {
+		// What the decorator covered, in case it changes
+		QRegion const before{(*p)->bounds()};
 		switch((*p)->handleEvent(qev)) {
 		case XILDecorator::event_status_t::EV_DELME:
 			// Delete decorator and return
@@ -217,7 +472,9 @@ XILImage::decor_event(QEvent &qev)
 		case XILDecorator::event_status_t::EV_NOP:
 			break;
 		case XILDecorator::event_status_t::EV_REDRAW:
-			render();
+			// Just where it was and is: the image under it is repainted from
+			// the pixels we hold, and the decorators drawn over that again
+			render(before + (*p)->bounds());
 			return true;
 		}
         ++p;
@@ -231,90 +488,311 @@ XILImage::run()
 {
     // This is like Transformable::run() except we need to track the bounding boxes
     QRect box{wbox_};
-    // TODO
-    mkexpose(box);
+    cancel_rescale();
+    Transformable::run();
+    zoom_ = txfs_.zoom_;
+    resize_canvas(wbox_.size());
+    place_window();
+    mkexpose(box | wbox_);
 }
 
-QRect
-XILImage::zoom_to(float g) {
+void
+XILImage::prepare_zoom(float g) {
+    // Zooming past 1:1 on a decode-to-fit image needs the real pixels
+    if(g > 1.0f && reduced() && !fetching_) {
+        fetching_ = true;
+        collage_.fetch_full_resolution(*this);
+    }
+    cancel_rescale();
     // Need to resize canvas before we call zoom
     QSize q = zoom_box(g);
-    canvas_.resize(q);
+    resize_canvas(q);
     QWindow::resize(q);
-    return Transformable::zoom_to(g);
+}
+
+QRect
+XILImage::zoom_to(float g) {
+    prepare_zoom(g);
+    QRect q = Transformable::zoom_to(g);
+    placed();
+    return q;
+}
+
+QRect
+XILImage::zoom_fast(float g) {
+    prepare_zoom(g);
+    QRect q = Transformable::zoom_with(g, Qt::FastTransformation);
+    placed();
+    // Restarted by each wheel tick, so only fires once the wheel has stopped
+    settle_.start();
+    return q;
 }
 
 QRect
 XILImage::crop(QRect rect) {
     fmt::print(stderr, "CROP {}x{}+{}+{}\n", rect.width(), rect.height(), rect.x(), rect.y());
+    cancel_rescale();
     QRect q = Transformable::crop(rect);
     fmt::print(stderr, "RDRW {}x{}+{}+{}\n", q.width(), q.height(), q.x(), q.y());
     fmt::print(stderr, "WBOX {}x{}+{}+{}\n", wbox_.width(), wbox_.height(), wbox_.x(), wbox_.y());
     fmt::print(stderr, "TXFS {}x{}+{}+{}\n", txfs_.crop_.width(), txfs_.crop_.height(), txfs_.crop_.x(), txfs_.crop_.y());
-    canvas_.resize(wbox_.size());
+    resize_canvas(wbox_.size());
     QWindow::resize(wbox_.size());
     // It is safe to ignore the return value here since we move wholly inside the larger (original) box q
     move_to(wbox_.topLeft());
+    journal();
     return q;
 }
 
+void
+XILImage::journal() const
+{
+    collage_.journal_edit(*this);
+}
+
+void
+XILImage::placed() const
+{
+    collage_.placed(*this);
+}
+
+
+void
+XILImage::place_window()
+{
+    auto const *host = dynamic_cast<XWindow const *>(parent());
+    setGeometry(host ? wbox_.translated(-host->origin()) : wbox_);
+}
+
+
 QRect
 XILImage::move_to(QPoint point) {
-    QWindow::setPosition(point);
-    return Transformable::move_to(point);
+    QRect q = Transformable::move_to(point);
+    place_window();
+    placed();
+    return q;
 }
 
 
-XWindow::XWindow(QScreen *scr) : QWindow(scr), qbs_(this)
+XWindow::XWindow(Collage &c, QScreen *scr) : QWindow(scr), collage_(c), hits_(), visible_(), qbs_(this),
+                                 composite_(!getenv("IMGEX_NATIVE_WINDOWS")), grab_(), under_(), dirty_(), update_pending_(false), stats_{0, 0, 0, 0, 0, 0},
+                                 budget_(MemoryBudget::shared())
 {
+	collage_.attach(this);
 }
 
 
-XILImage *
-XWindow::img_at(auto args...) noexcept
-{
-	// We must find the last (highest in stack) image that contains the point
-	std::reverse_iterator<std::list<std::shared_ptr<XILImage>>::iterator> p = ximgs_.rbegin(), q = ximgs_.rend();
-	// Annoyingly, std::find_if refuses to work with reverse iterator adaptors?
-	while( p != q ) {
-		if( (*p)->contains(args) ) return p->get();
-		++p;
+XWindow::~XWindow()
+{
+	collage_.detach(this);
+}
+
+
+/** What painting a rectangle costs beyond its area, in pixels: the clip,
+ * a draw call per image, the flush.  Found by eye rather than measured */
+static constexpr std::int64_t rect_overhead = 64 * 64;
+
+
+/** Paint either the dirty rectangles or their bounding box, whichever costs less.
+ * Rectangles far apart are painted separately; overlapping or nearby ones
+ * (e.g. a dragged image's successive positions) are painted as one */
+static QRegion
+coalesce(QRegion const &dirty)
+{
+	std::int64_t area = 0, n = 0;
+	for( QRect const &r : dirty ) {
+		area += std::int64_t(r.width()) * r.height();
+		++n;
 	}
-	return nullptr;
+	QRect const b{dirty.boundingRect()};
+	if(std::int64_t(b.width()) * b.height() + rect_overhead <= area + n * rect_overhead)
+		return QRegion(b);
+	return dirty;
+}
+
+
+void
+XWindow::invalidate(QRect area)
+{
+	area &= QRect(0, 0, width(), height());
+	if(area.isEmpty())
+		return;
+	++stats_.invalidations;
+	stats_.requested += std::uint64_t(area.width()) * area.height();
+	dirty_ += area;
+	if(!update_pending_) {
+		update_pending_ = true;
+		requestUpdate();
+	}
+}
+
+
+void
+XWindow::invalidate(QRegion const &area)
+{
+	for( QRect const &r : area )
+		invalidate(r);
+}
+
+
+bool
+XWindow::event(QEvent *ev)
+{
+	// Delivered at most once per display refresh
+	if(ev->type() == QEvent::UpdateRequest) {
+		update_pending_ = false;
+		if(!dirty_.isEmpty() && isExposed()) {
+			QRegion const r{coalesce(dirty_)};
+			dirty_ = QRegion();
+			redraw(r);
+		}
+		return true;
+	}
+	return QWindow::event(ev);
+}
+
+
+/** Number of pixels in a region */
+static std::uint64_t
+region_area(QRegion const &r)
+{
+	std::uint64_t n = 0;
+	for( QRect const &b : r )
+		n += std::uint64_t(b.width()) * b.height();
+	return n;
 }
 
 
 void
 XWindow::redraw(QRect area)
+{
+	redraw(QRegion(area));
+}
+
+
+void
+XWindow::redraw(QRegion area)
 {
 	QRect window(0, 0, width(), height());
-	if(area.isNull())
+	if(area.isEmpty())
 		area = window;
 	else
 		area &= window;
+	if(area.isEmpty())
+		return;
     //fmt::print(stderr, "REDRAW({: >3d} {: >3d} {: >3d} {: >3d})\n", area.x(), area.y(), area.width(), area.height());
 	qbs_.beginPaint(area);
 	QPaintDevice *dev = qbs_.paintDevice();
 	if(dev) {
 		QPainter qp(dev);
-		qp.fillRect(area, QColor(0,0,0));
-		qp.end();
-		for( auto &x : ximgs_ )
-			if(x->intersects(area))
-				x->render();
+		++stats_.frames;
+		stats_.painted += region_area(area);
+		budget_->tick();
+		// Images are placed on the canvas, which we show from here
+		QPoint const o{origin()};
+		if(!composite_) {
+			// The images are windows, which draw themselves over the background
+			for( QRect const &r : area )
+				qp.fillRect(r, QColor(0,0,0));
+			stats_.writes += region_area(area);
+			qp.end();
+			collage_.query(area.boundingRect().translated(o), hits_);
+			// Each in the window hosting it
+			for( XILImage *x : hits_ )
+				if(x->parent() == this && area.intersects(x->wbox_.translated(-o))) {
+					x->drawn_ = budget_->now();
+					x->render();
+				}
+		} else if(auto d = collage_.dragged()) {
+			// Everything else is as it was, in under_
+			if(under_.isNull())
+				compose_under(*d);
+			qp.setClipRegion(area);
+			for( QRect const &r : area )
+				qp.drawPixmap(r, under_, QRectF(r.topLeft() * under_.devicePixelRatio(), r.size() * under_.devicePixelRatio()));
+			QRect const box{d->wbox_.translated(-o)};
+			QRegion const vis{area & box};
+			if(!vis.isEmpty()) {
+				d->drawn_ = budget_->now();
+				qp.setClipRegion(vis);
+				qp.translate(box.topLeft());
+				d->paint(qp);
+			}
+			stats_.writes += region_area(area) + region_area(vis);
+		} else {
+			compose(qp, area, nullptr);
+		}
+		if(qp.isActive())
+			qp.end();
         qbs_.endPaint();
         qbs_.flush(area, this);
 	} else std::cerr << "No paint" << std::endl;
 }
 
 
+void
+XWindow::compose(QPainter &qp, QRegion const &area, XILImage const *skip)
+{
+	QPoint const o{origin()};
+	// Only the images in the area's bounding box, lowest first
+	collage_.query(area.boundingRect().translated(o), hits_);
+	// Front to back, each image paints only what the opaque images above it leave
+	// uncovered, and the background only what none of them cover
+	QRegion uncovered{area};
+	visible_.clear();
+	for( auto p = hits_.rbegin(); p != hits_.rend(); ++p ) {
+		XILImage *x = *p;
+		if(x == skip)
+			continue;
+		QRect const box{x->wbox_.translated(-o)};
+		QRegion vis{uncovered & box};
+		if(vis.isEmpty()) {
+			if(area.intersects(box))
+				++stats_.culled;
+			continue;
+		}
+		QRect const opaque{x->opaque_area()};
+		if(!opaque.isEmpty())
+			uncovered -= opaque.translated(-o);
+		visible_.emplace_back(x, std::move(vis));
+	}
+	qp.setClipRegion(uncovered);
+	for( QRect const &r : uncovered )
+		qp.fillRect(r, QColor(0,0,0));
+	stats_.writes += region_area(uncovered);
+	// Back to front, each in its own coordinates
+	for( auto p = visible_.rbegin(); p != visible_.rend(); ++p ) {
+		p->first->drawn_ = budget_->now();
+		qp.save();
+		qp.setClipRegion(p->second);
+		qp.translate(p->first->wbox_.topLeft() - o);
+		p->first->paint(qp);
+		qp.restore();
+		stats_.writes += region_area(p->second);
+	}
+}
+
+
+void
+XWindow::compose_under(XILImage const &dragged)
+{
+	qreal const dpr = devicePixelRatio();
+	under_ = QPixmap(size() * dpr);
+	under_.setDevicePixelRatio(dpr);
+	QPainter p(&under_);
+	compose(p, QRegion(0, 0, width(), height()), &dragged);
+}
+
+
 void
 XWindow::exposeEvent(QExposeEvent *ev)
 {
 	if(!isExposed())
 		return;
-	QRect bbox(ev->region().boundingRect());
-	redraw(bbox);
+	// Painted now (Qt expects it), taking anything waiting for the next frame along
+	QRegion const r{ev->region() + dirty_};
+	dirty_ = QRegion();
+	redraw(r);
 	QWindow::exposeEvent(ev);
 }
 
@@ -322,15 +800,42 @@ XWindow::exposeEvent(QExposeEvent *ev)
 void
 XWindow::resizeEvent(QResizeEvent *ev)
 {
+	under_ = QPixmap();
 	qbs_.resize(ev->size());
 	QWindow::resizeEvent(ev);
 }
 
 
+/** A mouse event as an image at offset in the window would get it were it a native window */
+static QMouseEvent
+image_event(QMouseEvent const *ev, QPoint offset)
+{
+	return QMouseEvent(ev->type(), ev->localPos() - offset, ev->windowPos() - offset, ev->screenPos(),
+	                   ev->button(), ev->buttons(), ev->modifiers());
+}
+
+
+XILImage *
+XWindow::mouse_target(QPoint p)
+{
+	if(auto g = grab_.lock())
+		return g.get();
+	return collage_.at(canvas(p));
+}
+
+
 void
 XWindow::mousePressEvent(QMouseEvent *ev)
 {
-	XILImage *w = img_at(ev->globalPos());
+	XILImage *w = collage_.at(canvas(ev->pos()));
+	if(!w) return;
+	if(composite_) {
+		grab_ = collage_.find(w);
+		QMouseEvent e{image_event(ev, w->wbox_.topLeft() - origin())};
+		w->mousePressEvent(&e);
+		QWindow::mousePressEvent(ev);
+		return;
+	}
 #if 0
 	if(!w) {
         // XXX temporary hack
@@ -357,9 +862,14 @@ XWindow::mousePressEvent(QMouseEvent *ev)
 void
 XWindow::mouseReleaseEvent(QMouseEvent *ev)
 {
-	XILImage *w = img_at(ev->globalPos());
+	XILImage *w = mouse_target(ev->pos());
+	grab_.reset();
 	if(!w) return;
-	w->mouseReleaseEvent(ev);
+	if(composite_) {
+		QMouseEvent e{image_event(ev, w->wbox_.topLeft() - origin())};
+		w->mouseReleaseEvent(&e);
+	} else
+		w->mouseReleaseEvent(ev);
 	QWindow::mouseReleaseEvent(ev);
 }
 
@@ -367,9 +877,13 @@ XWindow::mouseReleaseEvent(QMouseEvent *ev)
 void
 XWindow::mouseMoveEvent(QMouseEvent *ev)
 {
-	XILImage *w = img_at(ev->globalPos());
+	XILImage *w = mouse_target(ev->pos());
 	if(!w) return;
-	w->mouseMoveEvent(ev);
+	if(composite_) {
+		QMouseEvent e{image_event(ev, w->wbox_.topLeft() - origin())};
+		w->mouseMoveEvent(&e);
+	} else
+		w->mouseMoveEvent(ev);
 	QWindow::mouseMoveEvent(ev);
 }
 
@@ -379,9 +893,9 @@ XWindow::wheelEvent(QWheelEvent *ev)
 {
 	XILImage *w =
 #if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
-            img_at(ev->globalPosition().toPoint());
+            collage_.at(canvas(ev->position().toPoint()));
 #else
-            img_at(ev->globalPos());
+            collage_.at(canvas(ev->pos()));
 #endif
 	if(!w) return;
 	w->wheelEvent(ev);
@@ -389,9 +903,464 @@ XWindow::wheelEvent(QWheelEvent *ev)
 }
 
 
+Collage::Collage() : QObject(), ximgs_(), index_(), stacking_(0), drag_(), windows_(), loader_(), rescaler_(2),
+                     journal_(), budget_(MemoryBudget::shared())
+{
+	budget_->attach(this);
+}
+
+
+Collage::~Collage()
+{
+	budget_->detach(this);
+}
+
+
+void
+Collage::attach(XWindow *w)
+{
+	if(std::find(windows_.begin(), windows_.end(), w) == windows_.end())
+		windows_.push_back(w);
+}
+
+
+void
+Collage::detach(XWindow *w)
+{
+	windows_.erase(std::remove(windows_.begin(), windows_.end(), w), windows_.end());
+	// Its child windows would go with it, but the images are ours
+	XWindow *to = windows_.empty() ? nullptr : windows_.front();
+	for(auto const &x : ximgs_)
+		if(x->parent() == w) {
+			x->setParent(to);
+			x->place_window();
+		}
+}
+
+
+XWindow *
+Collage::containing(QPoint pt) const
+{
+	for( XWindow *w : windows_ )
+		if(QRect(w->origin(), w->size()).contains(pt))
+			return w;
+	return nullptr;
+}
+
+
+QSize
+Collage::fit() const
+{
+	QSize s;
+	for( XWindow const *w : windows_ )
+		s = s.expandedTo(w->screen()->size());
+	return s;
+}
+
+
+void
+Collage::invalidate(QRect area)
+{
+	// Each window its part, in its own coordinates
+	for( XWindow *w : windows_ )
+		w->invalidate(area.translated(-w->origin()));
+}
+
+
+void
+Collage::invalidate(QRegion const &area)
+{
+	for( XWindow *w : windows_ )
+		w->invalidate(area.translated(-w->origin()));
+}
+
+
+void
+Collage::begin_drag(XILImage const &xim)
+{
+	// A native window draws itself, over the windows
+	if(xim.canvas_)
+		return;
+	auto x = find(&xim);
+	if(!x)
+		return;
+	// The dragged image comes to the top, so the rest can be drawn once beneath it
+	auto p = std::find(ximgs_.begin(), ximgs_.end(), x);
+	ximgs_.splice(ximgs_.end(), ximgs_, p);
+	index_.restack(&xim, stacking_++);
+	drag_ = x;
+	for( XWindow *w : windows_ )
+		w->drop_under();
+	invalidate(xim.wbox_);
+}
+
+
+void
+Collage::end_drag()
+{
+	drag_.reset();
+	for( XWindow *w : windows_ )
+		w->drop_under();
+}
+
+
+void
+Collage::placed(XILImage const &xim)
+{
+	index_.update(&xim, xim.wbox_);
+	// Anything but the dragged image changing makes the layers under it stale
+	if(drag_.lock().get() != &xim)
+		for( XWindow *w : windows_ )
+			w->drop_under();
+}
+
+
+/** Stand-in pixmap shown while an image is being decoded */
+static QPixmap
+placeholder()
+{
+    QPixmap pm(160, 120);
+    pm.fill(QColor(64, 64, 64));
+    QPainter p(&pm);
+    p.setPen(QColor(128, 128, 128));
+    p.drawRect(pm.rect().adjusted(0, 0, -1, -1));
+    return pm;
+}
+
+
+void
+Collage::mkimage(ImageFile const &fn, QString name)
+{
+    // New images start at the top left of the first window
+    mkimage(fn, std::move(name), windows_.empty() ? QPoint() : windows_.front()->origin());
+}
+
+
 void
-XWindow::mkimage(ImageFile const &fn, QString name)
+Collage::mkimage(ImageFile const &fn, QString name, QPoint at)
 {
-    auto img = std::make_unique<Image>(fn);
-	ximgs_.push_back(std::make_shared<XILImage>(*this, std::move(img), name));
+    // A native window's host is the window showing its top left, if any
+    XWindow *host = containing(at);
+    auto img = std::make_unique<Image>(fn, placeholder());
+    auto xim = std::make_shared<XILImage>(*this, host ? *host : *windows_.front(), std::move(img), name);
+    xim->loading_ = true;
+	ximgs_.push_back(xim);
+	index_.insert(xim.get(), xim->wbox_, stacking_++);
+	xim->move_to(at);
+    if(journal_) {
+        Transformable::transform t;
+        t.move_ = at;
+        xim->journal_id_ = journal_->add(fn, t);
+    }
+    std::weak_ptr<XILImage> target{xim};
+    // Another image of the file holds its pixels already: show those, not a second copy
+    float held_reduction = 1.0f;
+    QByteArray held_sum;
+    SourceRegistry::holder hold;
+    QPixmap const held = SourceRegistry::shared()->best(fn, held_reduction, held_sum, hold);
+    if(!held.isNull()) {
+        ImageFile file{fn};
+        if(!held_sum.isEmpty())
+            file.setChecksum(held_sum);
+        // Queued as a decode would be, so a transform to restore is set first
+        QMetaObject::invokeMethod(this, [target, file, held, held_reduction, hold] {
+            auto xim = target.lock();
+            if(xim && xim->loading_)
+                xim->set_source(std::make_unique<Image>(file, held, held_reduction, hold));
+        }, Qt::QueuedConnection);
+        return;
+    }
+    QSize const screen{fit()};
+    // Only the hand-over of the decoded pixels happens on the GUI thread
+    loader_.load(fn, screen, this, [this, target, fn = ImageFile(fn), screen](ImageLoader::result &res) mutable {
+        auto xim = target.lock();
+        if(!xim)
+            return;
+        if(res.image.isNull()) {
+            std::cerr << "Cannot load " << fn.getPath().toStdString() << ": " << res.error.toStdString() << std::endl;
+            // Unless we have its embedded preview to show
+            if(xim->loading_)
+                remove(xim.get());
+            return;
+        }
+        fn.setChecksum(res.checksum);
+        QPixmap px{QPixmap::fromImage(std::move(res.image))};
+        SourceRegistry::holder hold;
+        // A preview is shown only until the decode replaces it
+        if(!res.interim)
+            px = SourceRegistry::shared()->share(fn, res.reduction, std::move(px), hold);
+        auto img = std::make_unique<Image>(fn, std::move(px), res.reduction, std::move(hold));
+        if(!xim->loading_) {
+            // The decoded image following an embedded preview
+            xim->set_full_resolution(std::move(img));
+            return;
+        }
+        // A restored image shows the preview with its saved transform instead
+        bool const restored = xim->restore_.has_value();
+        xim->set_source(std::move(img));
+        if(res.interim) {
+            // Show the preview at the size the decoded image will have, so it
+            // can take the preview's place (and any edits made meanwhile)
+            xim->fetching_ = true;
+            float const z = res.reduction / ImageLoader::reduction_for(res.source_size, screen);
+            if(z > 1.0f && !restored) {
+                xim->zoom_ = z;
+                xim->mkexpose(xim->zoom_to(z));
+            }
+        }
+    });
+}
+
+
+void
+Collage::mkimage(ImageFile const &fn, QString name, Transformable::transform const &tx)
+{
+    // Where it was, so a native window is hosted by the window showing it
+    mkimage(fn, std::move(name), tx.move_);
+    ximgs_.back()->restore_ = tx;
+    if(journal_)
+        journal_->edit(ximgs_.back()->journal_id_, tx);
+}
+
+
+void
+Collage::save(Session &ses) const
+{
+    for(auto const &x : ximgs_)
+        if(!x->loading_)
+            ses.add(x->orig_->getFile(), x->source_transform());
+}
+
+
+void
+Collage::journal_edit(XILImage const &xim)
+{
+    // A restoring image's transform was recorded with it; a loading one has none yet
+    if(journal_ && !xim.loading_)
+        journal_->edit(xim.journal_id_, xim.source_transform());
+}
+
+void
+Collage::fetch_full_resolution(XILImage const &xim)
+{
+    std::weak_ptr<XILImage> target{find(&xim)};
+    ImageFile const &fn = xim.orig_->getFile();
+    // Too large to decode whole: decode the parts on screen as they are shown
+    auto sources = SourceRegistry::shared();
+    if(auto tiles = sources->tiles(fn, fit())) {
+        // We are called as the image zooms, which then draws from the tiles
+        if(auto x = target.lock()) {
+            x->orig_->set_tiles(tiles);
+            x->set_tiles(tiles);
+        }
+        return;
+    }
+    // Another image of the file may have its full resolution already
+    float reduction = 1.0f;
+    QByteArray sum;
+    SourceRegistry::holder hold;
+    QPixmap const held = sources->best(fn, reduction, sum, hold);
+    if(!held.isNull() && reduction < xim.reduction()) {
+        ImageFile const file{fn};
+        QMetaObject::invokeMethod(this, [target, file, held, reduction, hold] {
+            if(auto x = target.lock())
+                x->set_full_resolution(std::make_unique<Image>(file, held, reduction, hold));
+        }, Qt::QueuedConnection);
+        return;
+    }
+    loader_.load(fn, QSize(), this, [target, fn](ImageLoader::result &res) {
+        auto xim = target.lock();
+        if(!xim)
+            return;
+        if(res.image.isNull()) {
+            std::cerr << "Cannot load " << fn.getPath().toStdString() << ": " << res.error.toStdString() << std::endl;
+            return;
+        }
+        SourceRegistry::holder hold;
+        QPixmap px{SourceRegistry::shared()->share(fn, res.reduction, QPixmap::fromImage(std::move(res.image)), hold)};
+        xim->set_full_resolution(std::make_unique<Image>(fn, std::move(px), res.reduction, std::move(hold)));
+    });
+}
+
+
+void
+Collage::rescale(XILImage &xim)
+{
+    // Tiles are drawn at the right resolution as they are
+    if(xim.tiled())
+        return;
+    std::weak_ptr<XILImage> target{find(&xim)};
+    auto const t0 = std::chrono::steady_clock::now();
+    QSize const size = xim.wbox_.size();
+    QRectF from{xim.source_rect()};
+    // Raster pixmaps share their pixels with toImage, and QImage is safe to use in the worker.
+    // The worker builds what the pyramid lacks in its own copy of it
+    QImage src = xim.src_.toImage();
+    std::vector<QImage> mips{xim.mips_};
+    qint64 const key = xim.source_key();
+    auto latest = xim.rescale_gen_;
+    unsigned const gen = ++*latest;
+    rescaler_.submit([this, target, t0, latest, gen, key, size, src, mips, from]() mutable {
+        if(*latest != gen)
+            return;
+        QImage const level = Transformable::mip_level(src, mips, size, from);
+        QImage out = Transformable::resample(level, from, size, Qt::SmoothTransformation);
+        if(*latest != gen)
+            return;
+        QMetaObject::invokeMethod(this, [target, t0, latest, gen, key, mips = std::move(mips), out = std::move(out)]() mutable {
+            auto xim = target.lock();
+            if(!xim || *latest != gen)
+                return;
+            // The levels the worker built, unless the source was replaced meanwhile
+            if(xim->source_key() == key && mips.size() > xim->mips_.size())
+                xim->mips_ = std::move(mips);
+            xim->img_ = QPixmap::fromImage(out);
+            xim->view_ = xim->img_.rect();
+            xim->allocated();
+            // A zoom the budget evicted, made again
+            if(std::exchange(xim->remaking_, false))
+                MemoryBudget::shared()->rematerialised(std::chrono::steady_clock::now() - t0);
+            xim->mkexpose();
+        }, Qt::QueuedConnection);
+    });
+}
+
+
+void
+Collage::refresh(XILImage const *xim)
+{
+    if(auto x = find(xim))
+        x->mkexpose();
+}
+
+
+std::shared_ptr<XILImage>
+Collage::find(XILImage const *xim) const noexcept
+{
+    auto p = std::find_if(ximgs_.begin(), ximgs_.end(), [xim](auto const &x) { return x.get() == xim; });
+    return p == ximgs_.end() ? std::shared_ptr<XILImage>() : *p;
+}
+
+
+void
+Collage::remove(XILImage const *xim)
+{
+    auto p = std::find_if(ximgs_.begin(), ximgs_.end(), [xim](auto const &x) { return x.get() == xim; });
+    if(p == ximgs_.end())
+        return;
+    QRect area{xim->wbox_};
+    index_.erase(xim);
+    for( XWindow *w : windows_ )
+        w->drop_under();
+    if(journal_)
+        journal_->remove(xim->journal_id_);
+    ximgs_.erase(p);
+    // Its pixels, unless another image shows the same file
+    SourceRegistry::shared()->prune();
+    invalidate(area);
+}
+
+
+void
+Collage::reload(XILImage const &xim)
+{
+    std::weak_ptr<XILImage> target{find(&xim)};
+    ImageFile const &fn = xim.orig_->getFile();
+    auto const t0 = std::chrono::steady_clock::now();
+    auto done = [target, t0](std::unique_ptr<Image> img) {
+        auto x = target.lock();
+        if(!x)
+            return;
+        x->reinstate(std::move(img));
+        MemoryBudget::shared()->rematerialised(std::chrono::steady_clock::now() - t0);
+    };
+    // Another image of the file may still hold its pixels
+    float reduction = 1.0f;
+    QByteArray sum;
+    SourceRegistry::holder hold;
+    QPixmap const held = SourceRegistry::shared()->best(fn, reduction, sum, hold);
+    if(!held.isNull()) {
+        ImageFile const file{fn};
+        QMetaObject::invokeMethod(this, [done, file, held, reduction, hold] {
+            done(std::make_unique<Image>(file, held, reduction, hold));
+        }, Qt::QueuedConnection);
+        return;
+    }
+    // Decoded to fit, so usually read back from the preview cache
+    loader_.load(fn, fit(), this, [done, fn](ImageLoader::result &res) {
+        // Only the decode will do: the transform was made on it
+        if(res.interim)
+            return;
+        if(res.image.isNull()) {
+            std::cerr << "Cannot reload " << fn.getPath().toStdString() << ": " << res.error.toStdString() << std::endl;
+            return;
+        }
+        SourceRegistry::holder hold;
+        QPixmap px{SourceRegistry::shared()->share(fn, res.reduction, QPixmap::fromImage(std::move(res.image)), hold)};
+        done(std::make_unique<Image>(fn, std::move(px), res.reduction, std::move(hold)));
+    });
+}
+
+
+void
+Collage::remake(XILImage const &xim)
+{
+    std::weak_ptr<XILImage> target{find(&xim)};
+    // Not while painting: the frame shows what the image holds meanwhile
+    QMetaObject::invokeMethod(this, [this, target] {
+        auto x = target.lock();
+        if(!x)
+            return;
+        if(x->evicted_)
+            reload(*x);
+        else
+            rescale(*x);
+    }, Qt::QueuedConnection);
+}
+
+
+void
+Collage::images(std::vector<XILImage *> &out) const
+{
+    for(auto const &x : ximgs_)
+        out.push_back(x.get());
+}
+
+
+void
+Collage::on_screen(std::unordered_set<XILImage const *> &out) const
+{
+    for(XWindow const *w : windows_) {
+        // Front to back, as the window's compose culls
+        QRegion uncovered{QRect(w->origin(), w->size())};
+        for(auto p = ximgs_.rbegin(); p != ximgs_.rend() && !uncovered.isEmpty(); ++p) {
+            XILImage const *x = p->get();
+            if(!uncovered.intersects(x->wbox_))
+                continue;
+            out.insert(x);
+            QRect const opaque{x->opaque_area()};
+            if(!opaque.isEmpty())
+                uncovered -= opaque;
+        }
+    }
+}
+
+
+Transformable::memory
+Collage::memory_use() const
+{
+    Transformable::memory total{0, 0, 0, 0};
+    std::set<qint64> sources;
+    std::set<TiledImage const *> tiles;
+    for(auto const &x : ximgs_) {
+        auto const m = x->memory_use();
+        // Shared pixels count once
+        if(sources.insert(x->source_key()).second)
+            total.source += m.source;
+        if(x->tiles_ && tiles.insert(x->tiles_.get()).second)
+            total.tiles += m.tiles;
+        total.derived += m.derived;
+        total.mips += m.mips;
+    }
+    return total;
 }
@@ -4,21 +4,35 @@
 #define __IMGEX_XWIN_H
 
 
+#include <atomic>
+#include <cstdint>
 #include <list>
 #include <memory>
+#include <optional>
+#include <unordered_set>
+#include <vector>
 
 #include <QPaintDeviceWindow>
 #include <QBackingStore>
 #include <QPainter>
+#include <QPixmap>
+#include <QTimer>
 #include <QWindow>
 #include <QRect>
+#include <QRegion>
 
 
 #include "transform.hh"
 #include "session.hh"
+#include "journal.hh"
+#include "spatial.hh"
 #include "image.hh"
+#include "loader.hh"
+#include "memory.hh"
+#include "workers.hh"
 
 
+class Collage;
 class XWindow;
 class QScreen;
 class XMain;
@@ -45,6 +59,11 @@ public:
 	virtual void render(QPainter &) = 0;
 	virtual ~XILDecorator() = default;
 
+	/** The pixels render draws, in the owner's coordinates.  When the
+	 * decorator changes, only its old and new bounds are repainted, so a
+	 * thin overlay should say so rather than claim its whole box (the default) */
+	[[nodiscard]] virtual QRegion bounds() const;
+
 	/** Decorator event handler can pass status back to XILImage */
     enum class event_status_t { EV_DONE, EV_NOP, EV_DELME, EV_REDRAW };
 
@@ -74,10 +93,12 @@ class XILImage final : public QWindow, public Transformable {
     /** Reference to the image which we need to update with transformations etc */
     std::unique_ptr<Image> orig_;
 
-	QBackingStore canvas_;
+	/** Our own backing store, when we are a native window; in compositor
+	 * mode (see XWindow) we are drawn into the parent's and have none */
+	std::optional<QBackingStore> canvas_;
 
-	/** Parent window */
-	QWindow *parent_;
+	/** The collage we are placed on, in its canvas coordinates (see XWindow) */
+	Collage &collage_;
 
 	/** Offset into the child window for dragging */
 	QPoint loc;
@@ -90,22 +111,86 @@ class XILImage final : public QWindow, public Transformable {
 	bool focused_;
 	/** Whether to resize on zoom */
 	bool resize_on_zoom_;
+	/** Whether a better (full resolution or decoded) image has been requested */
+	bool fetching_;
+	/** Whether we are showing a placeholder while the image loads */
+	bool loading_;
+	/** Transform (in source pixels) to apply once loaded, when restoring a session */
+	std::optional<transform> restore_;
 
 	/** scaling factor */
 	float zoom_;
 
 	QString name_;
 
+	/** While the wheel turns we show a fast (nearest neighbour) zoom;
+	 * when it has been still for a moment, a smooth one is made off the GUI thread */
+	QTimer settle_;
+	/** Bumped by every change of the image, so outdated smooth zooms are
+	 * abandoned by the worker or discarded on arrival: the latest request wins */
+	std::shared_ptr<std::atomic<unsigned>> rescale_gen_;
+	/** Our number in the session journal, see Collage::set_journal */
+	std::uint32_t journal_id_;
+	/** Frame we were last drawn in, see MemoryBudget */
+	std::uint64_t drawn_;
+	/** While our pixels are evicted: the transform (in source pixels) to replay once they are back */
+	std::optional<transform> evicted_;
+	/** Whether what the budget evicted (our source or our zoom) has been asked for again */
+	bool remaking_;
+	/** While our source is evicted: a small copy of what we showed, drawn until it is back */
+	QPixmap preview_;
+
     /** Storage for decorators (overlays) */
 	std::list<XILDecorator *> decors_;
 
-	/** Render the image in the window */
-	void render();
+	/** Render the image in our native window, or have the windows showing us redraw us when composited */
+	void render() { render(QRegion(box())); }
+	/** Render part of the image, in our own coordinates */
+	void render(QRegion const &);
+	/** Draw the image and its decorators, in our own coordinates */
+	void paint(QPainter &p)
+	{
+		paint_image(p);
+		paint_overlay(p);
+	}
+	void paint_image(QPainter &);
+	/** Draw the decorators over the image */
+	void paint_overlay(QPainter &);
+	/** Size the backing store, if we have one */
+	void resize_canvas(QSize size)
+	{
+		if(canvas_)
+			canvas_->resize(size);
+	}
+	/** Render the visible part of a tiled image, see Transformable::tiled */
+	void render_tiles(QPainter &);
 
 	/** Optionally pass (mouse) event to Decorator
 	 * \return true if event handled */
 	bool decor_event(QEvent &);
 
+	/** Work common to all zooms: fetch better pixels if needed, resize the canvas, cancel rescaling */
+	void prepare_zoom(float);
+	/** Zoom for interaction: show a fast zoom now and a smooth one once settled */
+	QRect zoom_fast(float);
+	/** Abandon any smooth zoom requested or in progress */
+	void cancel_rescale() noexcept
+	{
+		++*rescale_gen_;
+		settle_.stop();
+	}
+	/** Record our transform in the session journal, after an edit */
+	void journal() const;
+	/** Have the memory budget enforced, after the event in hand */
+	void allocated() override;
+	/** Ask, once, for what the budget evicted to be made again; called while painting */
+	void remake();
+	/** Tell the collage our box may have changed */
+	void placed() const;
+	/** Place our window (native, or just standing for us when composited) in
+	 * the window hosting it, which shows the canvas from its origin */
+	void place_window();
+
 #if 0
 	/** Move window */
 	void moveto(int x, int y) noexcept
@@ -116,7 +201,8 @@ class XILImage final : public QWindow, public Transformable {
 #endif
 
 public:
-	XILImage(XWindow &, std::unique_ptr<Image>, QString const &);
+	/** Made in a collage, hosted by one of its windows */
+	XILImage(Collage &, XWindow &, std::unique_ptr<Image>, QString const &);
 	~XILImage() = default;
 	XILImage(XILImage const &) = delete;
     // base class QImage has deleted move constructor
@@ -127,6 +213,13 @@ public:
     /** (Re)copy orig to working copy */
     void copy_from(Transformable const &orig) override;
 
+    /** Replace the image (e.g. a placeholder by the decoded image), keeping our position */
+    void set_source(std::unique_ptr<Image>);
+
+    /** Replace a reduced (decode-to-fit) image by a higher resolution one
+     * of the same file, keeping the current transform and placement */
+    void set_full_resolution(std::unique_ptr<Image>);
+
     QRect zoom_to(float) override;
 
     QRect crop(QRect rect) override;
@@ -138,7 +231,7 @@ public:
 
     /** Call clear */
 	// void clear(Display *d, Window w) const { XClearArea(d, w, wbox_.x, wbox_.y, wbox_.h, wbox_.y, 0); }
-	/** Does this image contain point x,y (as mapped on window) */
+	/** Does this image contain point x,y (as placed on the canvas) */
 	bool contains(int x, int y) const noexcept { return wbox_.contains(x,y); }
 	bool contains(QPoint p) const noexcept { return wbox_.contains(p); }
 	/** Does this image intersect a given box? */
@@ -147,7 +240,7 @@ public:
 	/** Bounding box in own coordinates */
 	QRect box() const noexcept { return QRect(0, 0, wbox_.width(), wbox_.height()); }
 
-    /** Create an expose event for the parent window */
+    /** Create an expose event for the windows showing an area of the canvas */
     void mkexpose(xwParentBox const &) const;
     void mkexpose() const { mkexpose(wbox_); }
 
@@ -162,41 +255,189 @@ public:
 	void wheelEvent(QWheelEvent *) override;
 	void exposeEvent(QExposeEvent *) override;
 
+	/** For MemoryBudget: the frame we were last drawn in */
+	[[nodiscard]] std::uint64_t last_drawn() const noexcept { return drawn_; }
+	/** Give up pixels which can be made again when next drawn
+	 * \return bytes released */
+	std::size_t evict_mips();
+	std::size_t evict_derived();
+	/** Give up our source, decoded again when next drawn; not while loading or tiled
+	 * \return whether it was given up (its bytes are freed once no other image shares them) */
+	bool evict_source();
+	/** Our evicted source, decoded again: replay our transform on it */
+	void reinstate(std::unique_ptr<Image>);
+
 	void add_decorator(XILDecorator *dec)
 	{
 		dec->owner_ = this;
 		decors_.push_back(dec);
 	}
 
+	friend class Collage;
 	friend class XWindow;
 };
 
 
 
+/** Collage - the images, placed on a canvas spanning every screen: the virtual
+ * desktop, whose coordinates sessions and the journal place images in.
+ * Each XWindow shows its screen's part of the canvas, so an image across two
+ * screens is drawn by both, and is dragged from one to the other like anywhere else.
+ */
+class Collage final : public QObject {
+	/** List of images, lowest first */
+	std::list<std::shared_ptr<XILImage>> ximgs_;
+	/** Where the images are on the canvas, for at and the windows' redraws */
+	SpatialIndex index_;
+	/** Stacking order for the next image made, see SpatialIndex::insert */
+	std::uint64_t stacking_;
+	/** The image being dragged, if any, which the windows draw over a layer of everything else */
+	std::weak_ptr<XILImage> drag_;
+	/** The windows showing the canvas; new images are placed in the first */
+	std::vector<XWindow *> windows_;
+	/** Decodes images for mkimage off the GUI thread */
+	ImageLoader loader_;
+	/** Makes the smooth zooms after interactive (fast) zooming */
+	WorkerPool rescaler_;
+	/** Where edits are recorded as they happen, if anywhere */
+	std::shared_ptr<Journal> journal_;
+	/** Limits the pixels held by our images */
+	std::shared_ptr<MemoryBudget> budget_;
+	/** Make an image with its top left at a point of the canvas */
+	void mkimage(ImageFile const &, QString, QPoint);
+	/** Remove an image, e.g. one which failed to load */
+	void remove(XILImage const *);
+	/** The size images are decoded to fit: the largest screen's, as they may be dragged to any */
+	[[nodiscard]] QSize fit() const;
+ public:
+	Collage();
+	~Collage();
+	Collage(Collage const &) = delete;
+	Collage &operator=(Collage const &) = delete;
+
+	/** Windows showing the canvas (see XWindow); at least one is needed to make images */
+	void attach(XWindow *);
+	/** A window going away: images it hosts as native windows move to another */
+	void detach(XWindow *);
+	/** The window showing a point of the canvas, or nullptr */
+	[[nodiscard]] XWindow *containing(QPoint) const;
+
+	/** Make an image at the top left of the first window
+	 * The image is shown as a placeholder until the loader has decoded it */
+	void mkimage(ImageFile const &, QString);
+	/** Make an image restored from a session, with its transform in source pixels */
+	void mkimage(ImageFile const &, QString, Transformable::transform const &);
+	/** Add our images to a session, lowest first */
+	void save(Session &) const;
+	/** Record images made and edited from now on in a journal */
+	void set_journal(std::shared_ptr<Journal> j) noexcept { journal_ = std::move(j); }
+	/** Record an image's current transform in the journal */
+	void journal_edit(XILImage const &);
+	/** Ask for the full resolution pixels of an image which was decoded to fit the screen */
+	void fetch_full_resolution(XILImage const &);
+	/** Decode again the source an image gave up (see MemoryBudget) */
+	void reload(XILImage const &);
+	/** Make again, after the frame being painted, what the budget evicted from an
+	 * image: its source (see reload) or its zoom (see rescale) */
+	void remake(XILImage const &);
+	/** Add our images to a list */
+	void images(std::vector<XILImage *> &) const;
+	/** Add the images at least partly visible: in a window and not hidden by opaque images */
+	void on_screen(std::unordered_set<XILImage const *> &) const;
+	/** Smoothly rescale an image's current zoom off the GUI thread, replacing
+	 * its fast zoom when done unless the image has changed meanwhile */
+	void rescale(XILImage &);
+	/** Redraw an image, if it is still ours (e.g. when more of it has been decoded) */
+	void refresh(XILImage const *);
+	/** An image's box has (or may have) changed: keep the index up to date */
+	void placed(XILImage const &);
+	/** An image starts being dragged: it is raised, and until end_drag the windows
+	 * are redrawn from a layer of everything else, with the image over it */
+	void begin_drag(XILImage const &);
+	void end_drag();
+	/** Find our owning pointer for an image */
+	[[nodiscard]] std::shared_ptr<XILImage> find(XILImage const *) const noexcept;
+	/** The topmost image at a point of the canvas, or nullptr */
+	[[nodiscard]] XILImage *at(QPoint p) const noexcept { return index_.at(p); }
+	/** The images in an area of the canvas, lowest first */
+	void query(QRect area, std::vector<XILImage *> &out) const { index_.query(area, out); }
+	/** The image being dragged, if any */
+	[[nodiscard]] std::shared_ptr<XILImage> dragged() const noexcept { return drag_.lock(); }
+	/** Have every window showing part of an area of the canvas repaint it with its next frame */
+	void invalidate(QRect);
+	void invalidate(QRegion const &);
+
+	/** Bytes of pixels our images hold, by what they are for; pixels shared by images count once */
+	[[nodiscard]] Transformable::memory memory_use() const;
+};
+
+
+
 /** XWindow - full screen window to draw stuff on.
  * A Window will be full size, the size of the screen, if possible.
- * Images are moved around inside windows, or between windows.
+ * It shows the part of the collage's canvas at its origin, images being
+ * moved around inside windows, or between windows.
  */
 class XWindow final : public QWindow {
-	/** List of images, lowest first */
-	std::list<std::shared_ptr<XILImage>> ximgs_;
-	/** Return a ptr to image at x,y or nullptr if there isn't one
-	 * Note this can't be const because it returns a pointer to a
-	 * non-const XILImage
-	 */
-	XILImage *img_at(auto args...) noexcept;
-	/** Background */
+ public:
+	/** Counts of painting, so the saving of frame pacing can be seen */
+	struct paint_stats {
+		/** Repaints, and the invalidations they served */
+		std::uint64_t frames, invalidations;
+		/** Pixels invalidated (counting overlaps each time), and those actually painted */
+		std::uint64_t requested, painted;
+		/** Pixels written: the background plus what each image drew (overdraw counts every time) */
+		std::uint64_t writes;
+		/** Images skipped as hidden behind opaque ones */
+		std::uint64_t culled;
+	};
+ private:
+	/** The images, shared with the windows of the other screens */
+	Collage &collage_;
+	/** Images found by the collage, reused by redraw */
+	std::vector<XILImage *> hits_;
+	/** Images to draw and what of them shows, topmost first, reused by redraw */
+	std::vector<std::pair<XILImage *, QRegion>> visible_;
+	/** Background, and in compositor mode the images too */
 	QBackingStore qbs_;
+	/** Whether images are drawn into qbs_ in stacking order (one flush per frame)
+	 * rather than each being a native child window with its own backing store */
+	bool composite_;
+	/** In compositor mode, the image under the mouse when a button was pressed,
+	 * which gets the mouse until it is released (as a native window would) */
+	std::weak_ptr<XILImage> grab_;
+	/** While an image is dragged, everything else composited, if made yet */
+	QPixmap under_;
+	/** Invalidated since the last frame */
+	QRegion dirty_;
+	/** Whether a frame (QEvent::UpdateRequest) has been asked for */
+	bool update_pending_;
+	paint_stats stats_;
+	/** Whose clock stamps the images we draw */
+	std::shared_ptr<MemoryBudget> budget_;
+	/** A point of the window, on the canvas */
+	[[nodiscard]] QPoint canvas(QPoint p) const { return p + origin(); }
+	/** Paint area (background and images, leaving out skip), drawing nothing hidden by an opaque image */
+	void compose(QPainter &, QRegion const &area, XILImage const *skip);
+	/** Make under_, everything but the dragged image */
+	void compose_under(XILImage const &dragged);
+	/** The image to get a mouse event: the grabbing one, or else the one under the mouse */
+	XILImage *mouse_target(QPoint);
  public:
-	XWindow(QScreen *scr = nullptr);
+	/** Images are composited (see composite_) unless IMGEX_NATIVE_WINDOWS is set */
+	XWindow(Collage &, QScreen *scr = nullptr);
+	~XWindow();
 	XWindow(XWindow const &) = delete;
     // The move ctor is unsafe (probably) because XWindow inherits from QWindow
 	XWindow(XWindow &&) = delete;
 	XWindow &operator=(XWindow const &) = delete;
 	XWindow &operator=(XWindow &&) = delete;
 
-	/** Make an image in this window */
-	void mkimage(ImageFile const &, QString);
+	/** Where our top left is on the canvas spanning every screen: the virtual
+	 * desktop, whose coordinates sessions and the journal place images in */
+	[[nodiscard]] QPoint origin() const { return mapToGlobal(QPoint(0, 0)); }
+	/** Something other than the dragged image changed: the layer under it is made again */
+	void drop_under() noexcept { under_ = QPixmap(); }
 	/** Events may be received by the main window, in which case the event needs dispatching to the child window */
 	void resizeEvent(QResizeEvent *) override;
 	void mousePressEvent(QMouseEvent *) override;
@@ -207,6 +448,16 @@ class XWindow final : public QWindow {
 
 	/** Redraw the whole window */
 	void redraw(QRect);
+	/** Repaint a region now (the whole window if empty), with one flush */
+	void redraw(QRegion);
+	/** Mark part of the window for repainting with the next frame.  Any number
+	 * of invalidations between frames cost one repaint, of their union */
+	void invalidate(QRect);
+	void invalidate(QRegion const &);
+	bool event(QEvent *) override;
+	[[nodiscard]] bool composited() const noexcept { return composite_; }
+
+	[[nodiscard]] paint_stats statistics() const noexcept { return stats_; }
 
 	/** handle expose */
 	void expose(QRect const &);
@@ -0,0 +1,118 @@
+/** hash128 must give MurmurHash3 x64 128 bit digests, bit for bit, however the
+ * data is fed to it: checksums are remembered across runs and compared
+ * between cards, so they may never change */
+
+#include <QByteArray>
+#include <QFile>
+#include <QTemporaryDir>
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <fmt/core.h>
+#include "checksum.hh"
+
+
+namespace {
+
+int failures = 0;
+
+
+void
+expect(bool ok, char const *what)
+{
+    fmt::print("{}: {}\n", ok ? "ok" : "FAILED", what);
+    if(!ok)
+        ++failures;
+}
+
+
+/** 0, 1, 2... as bytes */
+std::string
+counting(std::size_t n)
+{
+    std::string s(n, '\0');
+    for(std::size_t i = 0; i < n; ++i)
+        s[i] = static_cast<char>(i);
+    return s;
+}
+
+
+QByteArray
+hashed(std::string const &data, std::uint64_t seed = 0)
+{
+    hash128 h(seed);
+    h.update(data.data(), data.size());
+    return h.digest();
+}
+
+
+/** Digests of the reference implementation (MurmurHash3_x64_128), as its
+ * 16 bytes of output in order */
+void
+known_vectors()
+{
+    std::string const fox{"The quick brown fox jumps over the lazy dog"};
+    expect(hashed("").toHex() == "00000000000000000000000000000000", "vectors: empty");
+    expect(hashed("a").toHex() == "897859f6655555855a890e51483ab5e6", "vectors: one byte");
+    expect(hashed("abc").toHex() == "6778ad3f3f3f96b4522dca264174a23b", "vectors: three bytes");
+    expect(hashed(fox).toHex() == "6c1b07bc7bbc4be347939ac4a93c437a", "vectors: two blocks and a tail");
+    expect(hashed(counting(31)).toHex() == "94d02ca3e1d33d05905400b4ef9ae59e", "vectors: a block and a 15 byte tail");
+    expect(hashed(counting(256)).toHex() == "b9126fdc13c3991c1ecc34ab7f07d670", "vectors: whole blocks");
+    expect(hashed("", 42).toHex() == "23851bfa7da72af0b9cb11da106601d1", "vectors: empty, seeded");
+    expect(hashed(fox, 42).toHex() == "d7d50bfe93cf0d748f5c70ecf46c54c4", "vectors: seeded");
+}
+
+
+void
+streaming()
+{
+    std::string const data{counting(1000)};
+    QByteArray const whole{hashed(data)};
+    bool same = true;
+    // Pieces smaller than, equal to and larger than a block, splitting blocks anywhere
+    for(std::size_t piece : {1, 7, 15, 16, 17, 100, 999}) {
+        hash128 h;
+        for(std::size_t at = 0; at < data.size(); at += piece)
+            h.update(data.data() + at, std::min(piece, data.size() - at));
+        same = same && h.digest() == whole;
+    }
+    expect(same, "streaming: any pieces give the same digest");
+
+    hash128 h;
+    h.update(data.data(), 500);
+    QByteArray const half{h.digest()};
+    h.update(data.data() + 500, 500);
+    expect(half == hashed(data.substr(0, 500)), "streaming: a digest midway is of the data so far");
+    expect(h.digest() == whole, "streaming: taking a digest does not disturb the state");
+}
+
+
+void
+files(QTemporaryDir const &dir)
+{
+    std::string const data{counting(70000)};
+    QString const path{dir.filePath("file")};
+    QFile f(path);
+    bool const written = f.open(QIODevice::WriteOnly) && f.write(data.data(), data.size()) == qint64(data.size());
+    f.close();
+    expect(written, "files: write the file");
+    expect(Checksummer::hash_file(path) == hashed(data), "files: hash_file hashes the whole file");
+    expect(Checksummer::hash_file(dir.filePath("missing")).isEmpty(), "files: a missing file has no checksum");
+}
+
+}
+
+
+int
+main()
+{
+    QTemporaryDir dir;
+    if(!dir.isValid()) {
+        fmt::print("FAILED: no temporary directory\n");
+        return EXIT_FAILURE;
+    }
+    known_vectors();
+    streaming();
+    files(dir);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,388 @@
+/** ExifReader must find the JPEG previews a TIFF structure points to, and
+ * come to an end without them (rather than hang or crash) when its IFDs are
+ * truncated, point outside the file or point back at each other */
+
+#include <QByteArray>
+#include <QFile>
+#include <QTemporaryDir>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <fmt/core.h>
+#include "exif.hh"
+
+
+namespace {
+
+int failures = 0;
+
+
+void
+expect(bool ok, std::string const &what)
+{
+    fmt::print("{}: {}\n", ok ? "ok" : "FAILED", what);
+    if(!ok)
+        ++failures;
+}
+
+
+/** A JPEG stream with just a frame header: all ExifReader looks at */
+std::string
+jpeg(unsigned frame, unsigned width, unsigned height)
+{
+    return std::string{'\xff', '\xd8', '\xff', static_cast<char>(frame), 0, 17, 8,
+                       static_cast<char>(height >> 8), static_cast<char>(height),
+                       static_cast<char>(width >> 8), static_cast<char>(width)}
+           + std::string(12, '\0') + "\xff\xd9";
+}
+
+
+/** Builds a TIFF structure; offsets are from its header */
+class tiff_writer {
+public:
+    struct field {
+        unsigned tag, type;
+        std::uint32_t count, value;
+    };
+
+    explicit tiff_writer(bool big_endian) : be_(big_endian)
+    {
+        data_ = big_endian ? std::string("MM\0*", 4) : std::string("II*\0", 4);
+        put32(8);
+    }
+
+    [[nodiscard]] std::uint32_t end() const { return static_cast<std::uint32_t>(data_.size()); }
+
+    /** Append data, returning its offset */
+    std::uint32_t
+    append(std::string const &data)
+    {
+        std::uint32_t const at = end();
+        data_ += data;
+        return at;
+    }
+
+    /** Append an IFD, returning its offset */
+    std::uint32_t
+    ifd(std::vector<field> const &fields, std::uint32_t next = 0)
+    {
+        std::uint32_t const at = end();
+        put16(static_cast<unsigned>(fields.size()));
+        for(auto const &f : fields) {
+            put16(f.tag);
+            put16(f.type);
+            put32(f.count);
+            if(f.type == 3) {
+                put16(f.value);
+                put16(0);
+            } else {
+                put32(f.value);
+            }
+        }
+        put32(next);
+        return at;
+    }
+
+    /** Point the header at the first IFD */
+    void first(std::uint32_t ifd) { patch32(4, ifd); }
+
+    /** Point an IFD at the next one in its chain */
+    void
+    next(std::uint32_t ifd, std::uint32_t to)
+    {
+        auto const *p = reinterpret_cast<unsigned char const *>(data_.data()) + ifd;
+        unsigned const n = be_ ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+        patch32(ifd + 2 + 12 * n, to);
+    }
+
+    [[nodiscard]] std::string const &data() const noexcept { return data_; }
+
+private:
+    bool be_;
+    std::string data_;
+
+    void
+    put16(unsigned v)
+    {
+        char const b[2] = {static_cast<char>(v >> 8), static_cast<char>(v)};
+        data_ += be_ ? std::string{b[0], b[1]} : std::string{b[1], b[0]};
+    }
+
+    void
+    put32(std::uint32_t v)
+    {
+        if(be_) {
+            put16(v >> 16);
+            put16(v & 0xffff);
+        } else {
+            put16(v & 0xffff);
+            put16(v >> 16);
+        }
+    }
+
+    void
+    patch32(std::uint32_t at, std::uint32_t v)
+    {
+        std::string const saved{data_.substr(at + 4)};
+        data_.resize(at);
+        put32(v);
+        data_ += saved;
+    }
+};
+
+
+// Tags and types (see exif.cc)
+enum : unsigned {
+    tag_width = 256, tag_compression = 259, tag_strip_offsets = 273, tag_strip_bytes = 279,
+    tag_subifds = 330, tag_jpeg_offset = 513, tag_jpeg_length = 514, tag_exif_ifd = 34665
+};
+enum : unsigned { t_short = 3, t_long = 4 };
+
+
+std::vector<tiff_writer::field>
+thumbnail_at(std::uint32_t offset, std::uint32_t length)
+{
+    return {{tag_jpeg_offset, t_long, 1, offset}, {tag_jpeg_length, t_long, 1, length}};
+}
+
+
+/** The previews ExifReader finds in data, written to path */
+std::vector<ExifReader::preview>
+previews(QString const &path, std::string const &data)
+{
+    QFile f(path);
+    if(f.open(QIODevice::WriteOnly))
+        f.write(data.data(), data.size());
+    f.close();
+    int const fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+    if(fd < 0)
+        return {};
+    std::vector<ExifReader::preview> found{ExifReader(fd).previews()};
+    ::close(fd);
+    return found;
+}
+
+
+bool
+one(std::vector<ExifReader::preview> const &found, unsigned width, unsigned height)
+{
+    return found.size() == 1 && found[0].width == width && found[0].height == height;
+}
+
+
+void
+valid(QString const &path)
+{
+    for(bool be : {false, true}) {
+        std::string const order{be ? "big endian" : "little endian"};
+        tiff_writer t(be);
+        std::string const thumb{jpeg(0xc0, 160, 120)}, large{jpeg(0xc2, 1620, 1080)}, raw{jpeg(0xc3, 6000, 4000)};
+        std::uint32_t const thumb_at = t.append(thumb), large_at = t.append(large), raw_at = t.append(raw);
+        // The raw data in a SubIFD, the large preview in the EXIF IFD, the thumbnail in IFD1
+        std::uint32_t const sub = t.ifd({{tag_compression, t_short, 1, 7}, {tag_strip_offsets, t_long, 1, raw_at},
+                                         {tag_strip_bytes, t_long, 1, static_cast<std::uint32_t>(raw.size())}});
+        std::uint32_t const exif = t.ifd({{tag_compression, t_short, 1, 7}, {tag_strip_offsets, t_long, 1, large_at},
+                                          {tag_strip_bytes, t_long, 1, static_cast<std::uint32_t>(large.size())}});
+        std::uint32_t const ifd1 = t.ifd(thumbnail_at(thumb_at, thumb.size()));
+        t.first(t.ifd({{tag_width, t_short, 1, 6000}, {tag_subifds, t_long, 1, sub}, {tag_exif_ifd, t_long, 1, exif}}, ifd1));
+        auto const found = previews(path, t.data());
+        ExifReader::preview const *largest = nullptr;
+        for(auto const &p : found)
+            if(p.width == 1620)
+                largest = &p;
+        expect(found.size() == 2, "valid, " + order + ": two previews, not the lossless raw data");
+        expect(largest && largest->offset == large_at && largest->length == std::int64_t(large.size())
+                       && largest->height == 1080,
+               "valid, " + order + ": the large preview's place and size");
+    }
+
+    // A camera JPEG: the TIFF structure, and offsets, start after "Exif\0\0"
+    tiff_writer t(false);
+    std::string const thumb{jpeg(0xc0, 160, 120)};
+    std::uint32_t const at = t.append(thumb);
+    t.first(t.ifd({{tag_width, t_short, 1, 4000}}, t.ifd(thumbnail_at(at, thumb.size()))));
+    std::uint32_t const length = 2 + 6 + t.data().size();
+    std::string const app1 = std::string{'\xff', '\xe1', static_cast<char>(length >> 8), static_cast<char>(length)}
+                             + std::string("Exif\0\0", 6) + t.data();
+    std::string const file = std::string("\xff\xd8", 2) + app1 + jpeg(0xc0, 4000, 3000).substr(2);
+    auto const found = previews(path, file);
+    expect(one(found, 160, 120) && found[0].offset == std::int64_t(2 + 4 + 6 + at), "valid: the thumbnail in a JPEG");
+    std::string const the_same_twice = [&] {
+        tiff_writer t(false);
+        std::uint32_t const at = t.append(thumb);
+        std::uint32_t const ifd1 = t.ifd(thumbnail_at(at, thumb.size()));
+        t.first(t.ifd(thumbnail_at(at, thumb.size()), ifd1));
+        return t.data();
+    }();
+    expect(one(previews(path, the_same_twice), 160, 120), "valid: a preview two IFDs point to is found once");
+}
+
+
+void
+truncated(QString const &path)
+{
+    std::string const thumb{jpeg(0xc0, 160, 120)};
+    tiff_writer t(false);
+    std::vector<tiff_writer::field> const fields{{tag_width, t_short, 1, 4000}, {tag_compression, t_short, 1, 6},
+                                                 {tag_jpeg_offset, t_long, 1, 8 + 2 + 12 * 4 + 4},
+                                                 {tag_jpeg_length, t_long, 1, std::uint32_t(thumb.size())}};
+    t.first(t.ifd(fields));
+    std::uint32_t const at = t.append(thumb);
+    std::string const whole{t.data()};
+    expect(one(previews(path, whole), 160, 120), "truncated: whole, the preview is found");
+    // Cut in the next IFD offset, the entries, the count and the header
+    bool none = true;
+    for(std::uint32_t keep : {at - 1, at - 4, at - 20, 11u, 9u, 8u, 5u})
+        none = none && previews(path, whole.substr(0, keep)).empty();
+    expect(none, "truncated: inside the IFD, nothing is found");
+    expect(previews(path, whole.substr(0, at + 5)).empty(), "truncated: inside the preview, it is not found");
+    expect(previews(path, "II*").empty(), "truncated: inside the header");
+
+    tiff_writer far(true);
+    far.first(0x7ffffff0);
+    expect(previews(path, far.data()).empty(), "truncated: first IFD past the end");
+    tiff_writer outside(false);
+    outside.first(outside.ifd({{tag_width, t_short, 1, 4000}, {tag_subifds, t_long, 16, 0xfffffff0},
+                               {tag_exif_ifd, t_long, 1, 0xfffffff0}}, 0xffffff00));
+    expect(previews(path, outside.data()).empty(), "truncated: SubIFDs, EXIF IFD and next IFD past the end");
+    tiff_writer thumb_outside(false);
+    thumb_outside.first(thumb_outside.ifd(thumbnail_at(0xfffffff0, 5000)));
+    expect(previews(path, thumb_outside.data()).empty(), "truncated: preview past the end");
+    tiff_writer lots(false);
+    lots.first(lots.ifd({}));
+    std::string huge{lots.data() + std::string(64, '\0')};
+    huge[8] = huge[9] = '\xff';
+    expect(previews(path, huge).empty(), "truncated: an IFD claiming 65535 entries");
+}
+
+
+void
+looping(QString const &path)
+{
+    std::string const thumb{jpeg(0xc0, 160, 120)};
+    {
+        tiff_writer t(false);
+        std::uint32_t const at = t.append(thumb);
+        std::uint32_t const ifd0 = t.ifd(thumbnail_at(at, thumb.size()));
+        t.next(ifd0, ifd0);
+        t.first(ifd0);
+        expect(one(previews(path, t.data()), 160, 120), "looping: an IFD followed by itself");
+    }
+    {
+        tiff_writer t(true);
+        std::uint32_t const at = t.append(thumb);
+        std::uint32_t const ifd0 = t.ifd({{tag_width, t_short, 1, 4000}});
+        std::uint32_t const ifd1 = t.ifd(thumbnail_at(at, thumb.size()), ifd0);
+        t.next(ifd0, ifd1);
+        t.first(ifd0);
+        expect(one(previews(path, t.data()), 160, 120), "looping: two IFDs followed by each other");
+    }
+    {
+        tiff_writer t(false);
+        std::uint32_t const at = t.append(thumb);
+        std::uint32_t const ifd0 = t.end();
+        // The EXIF IFD and the SubIFD are IFD0 itself
+        t.first(t.ifd({{tag_jpeg_offset, t_long, 1, at}, {tag_jpeg_length, t_long, 1, std::uint32_t(thumb.size())},
+                       {tag_subifds, t_long, 1, ifd0}, {tag_exif_ifd, t_long, 1, ifd0}}));
+        expect(one(previews(path, t.data()), 160, 120), "looping: an IFD its own child");
+    }
+    {
+        // A SubIFD whose next IFD has its parent as EXIF IFD
+        tiff_writer t(false);
+        std::uint32_t const at = t.append(thumb);
+        std::uint32_t const sub = t.ifd(thumbnail_at(at, thumb.size()));
+        std::uint32_t const ifd0 = t.ifd({{tag_subifds, t_long, 1, sub}});
+        t.next(sub, t.ifd({{tag_exif_ifd, t_long, 1, ifd0}}));
+        t.first(ifd0);
+        expect(one(previews(path, t.data()), 160, 120), "looping: a child pointing back at its parent");
+    }
+    {
+        // Many SubIFDs, each a chain through all the others
+        tiff_writer t(false);
+        std::uint32_t const at = t.append(thumb);
+        std::vector<std::uint32_t> subs;
+        for(int i = 0; i < 16; ++i)
+            subs.push_back(t.ifd(thumbnail_at(at, thumb.size())));
+        for(int i = 0; i < 16; ++i)
+            t.next(subs[i], subs[(i + 1) % 16]);
+        std::string offsets;
+        for(auto s : subs)
+            offsets += std::string{static_cast<char>(s), static_cast<char>(s >> 8), static_cast<char>(s >> 16), 0};
+        std::uint32_t const list = t.append(offsets);
+        t.first(t.ifd({{tag_subifds, t_long, 16, list}}));
+        expect(one(previews(path, t.data()), 160, 120), "looping: SubIFDs chained to each other");
+    }
+    {
+        // Not a loop but a long chain: only the first few IFDs are read
+        tiff_writer t(false);
+        std::uint32_t const at = t.append(thumb);
+        std::uint32_t prev = 0, first = 0;
+        for(int i = 0; i < 1000; ++i) {
+            std::uint32_t const ifd = t.ifd({{tag_width, t_short, 1, 10}});
+            if(prev)
+                t.next(prev, ifd);
+            else
+                first = ifd;
+            prev = ifd;
+        }
+        t.next(prev, t.ifd(thumbnail_at(at, thumb.size())));
+        t.first(first);
+        expect(previews(path, t.data()).empty(), "looping: a chain of a thousand IFDs comes to an end");
+    }
+}
+
+
+bool
+jpeg_sized(QString const &path, std::string const &data, std::uint32_t &width, std::uint32_t &height)
+{
+    QFile f(path);
+    if(f.open(QIODevice::WriteOnly))
+        f.write(data.data(), data.size());
+    f.close();
+    int const fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+    bool const sized = fd >= 0 && ExifReader::jpeg_size(fd, 0, width, height);
+    if(fd >= 0)
+        ::close(fd);
+    return sized;
+}
+
+
+/** Fill bytes and empty segments move the reader on; a segment length which
+ * would not must end it */
+void
+jpeg_segments(QString const &path)
+{
+    std::string const soi("\xff\xd8", 2), frame{jpeg(0xc0, 8, 8).substr(2)};
+    std::uint32_t width = 0, height = 0;
+    bool const sized = jpeg_sized(path, soi + std::string(300, '\xff') + std::string{'\xff', '\xe0', 0, 2} + frame,
+                                  width, height);
+    expect(sized && width == 8 && height == 8, "jpeg: fill bytes and empty segments before the frame");
+    expect(!jpeg_sized(path, soi + std::string{'\xff', '\xe0', 0, 0} + frame, width, height),
+           "jpeg: a segment of length 0");
+    std::string endless{soi};
+    for(int i = 0; i < 1000; ++i)
+        endless += std::string{'\xff', '\xe0', 0, 2};
+    expect(!jpeg_sized(path, endless + frame, width, height), "jpeg: more segments than any real file has");
+}
+
+}
+
+
+int
+main()
+{
+    QTemporaryDir dir;
+    if(!dir.isValid()) {
+        fmt::print("FAILED: no temporary directory\n");
+        return EXIT_FAILURE;
+    }
+    QString const path{dir.filePath("file")};
+    valid(path);
+    truncated(path);
+    looping(path);
+    jpeg_segments(path);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
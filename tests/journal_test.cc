@@ -0,0 +1,159 @@
+/** Journal must give back, after a crash, the last transform it wrote for each
+ * image: ignoring an entry torn by the crash, after compacting, and nothing
+ * once cleared */
+
+#include <QByteArray>
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryDir>
+#include <cstdlib>
+#include <vector>
+#include <fmt/core.h>
+#include "image.hh"
+#include "journal.hh"
+
+
+namespace {
+
+int failures = 0;
+
+
+void
+expect(bool ok, char const *what)
+{
+    fmt::print("{}: {}\n", ok ? "ok" : "FAILED", what);
+    if(!ok)
+        ++failures;
+}
+
+
+Transformable::transform
+tx(int x, int y, float zoom = 1.0f, QRect crop = QRect())
+{
+    Transformable::transform t;
+    t.crop_ = crop;
+    t.zoom_ = zoom;
+    t.move_ = QPoint(x, y);
+    return t;
+}
+
+
+bool
+same(Transformable::transform const &a, Transformable::transform const &b)
+{
+    return a.crop_ == b.crop_ && a.zoom_ == b.zoom_ && a.move_ == b.move_;
+}
+
+
+/** What a new run would restore from the journal at path */
+std::vector<Journal::image>
+reopen(QString const &path)
+{
+    Journal j(path);
+    return j.recovered();
+}
+
+
+void
+torn_tail(QString const &path)
+{
+    ImageFile const a{"/nonexistent/a.jpg"}, b{"/nonexistent/b.jpg"};
+    {
+        Journal j(path);
+        std::uint32_t const ia = j.add(a, tx(10, 20, 0.5f, QRect(5, 6, 300, 200)));
+        j.add(b, tx(30, 40));
+        j.flush();
+        j.edit(ia, tx(50, 60, 0.25f));
+    }
+    // A crash part way through writing the edit
+    QFile f(path);
+    expect(f.resize(f.size() - 10), "torn tail: truncate the last entry");
+
+    auto const got = reopen(path);
+    expect(got.size() == 2, "torn tail: both images recovered");
+    expect(got.size() == 2 && got[0].path == a.getPath() && same(got[0].tx, tx(10, 20, 0.5f, QRect(5, 6, 300, 200))),
+           "torn tail: the torn edit is not applied");
+    expect(got.size() == 2 && got[1].path == b.getPath() && same(got[1].tx, tx(30, 40)),
+           "torn tail: entries before it are kept");
+
+    // Damage rather than truncation: the check fails and the rest is dropped the same way
+    {
+        Journal j(path);
+        std::vector<std::uint32_t> ids;
+        for(auto const &im : j.recovered())
+            ids.push_back(j.add(ImageFile(im.path), im.tx));
+        j.flush();
+        j.edit(ids.front(), tx(70, 80));
+    }
+    expect(f.open(QIODevice::ReadWrite), "torn tail: open to damage");
+    f.seek(f.size() - 5);
+    f.write("\x55", 1);
+    f.close();
+    auto const again = reopen(path);
+    expect(again.size() == 2 && same(again[0].tx, tx(10, 20, 0.5f, QRect(5, 6, 300, 200))),
+           "torn tail: a damaged last entry is not applied");
+}
+
+
+void
+compaction(QString const &path)
+{
+    ImageFile const a{"/nonexistent/a.jpg"}, b{"/nonexistent/b.jpg"};
+    {
+        Journal j(path);
+        std::uint32_t const ia = j.add(a, tx(0, 0));
+        std::uint32_t const ib = j.add(b, tx(0, 0));
+        // Well past the garbage that triggers compacting
+        for(int k = 0; k < 5000; ++k)
+            j.edit(ia, tx(k, k + 1));
+        j.remove(ib);
+        j.flush();
+        // Uncompacted, 5000 edits are 240 KB; compacted after 4096 or more of them, under 1000 are left
+        expect(QFileInfo(path).size() < 100000, "compaction: the file was compacted");
+    }
+    auto const got = reopen(path);
+    expect(got.size() == 1, "compaction: the removed image stays removed");
+    expect(got.size() == 1 && got[0].path == a.getPath() && same(got[0].tx, tx(4999, 5000)),
+           "compaction: the last edit survives");
+}
+
+
+void
+clearing(QString const &path)
+{
+    ImageFile const a{"/nonexistent/a.jpg"}, b{"/nonexistent/b.jpg"};
+    {
+        Journal j(path);
+        j.add(a, tx(1, 2));
+        j.flush();
+        j.clear();
+    }
+    expect(reopen(path).empty(), "clear: nothing is recovered");
+
+    {
+        Journal j(path);
+        j.add(a, tx(1, 2));
+        j.clear();
+        j.add(b, tx(3, 4));
+    }
+    auto const got = reopen(path);
+    expect(got.size() == 1 && got[0].path == b.getPath() && same(got[0].tx, tx(3, 4)),
+           "clear: what is added afterwards is kept");
+}
+
+}
+
+
+int
+main()
+{
+    QTemporaryDir dir;
+    if(!dir.isValid()) {
+        fmt::print("FAILED: no temporary directory\n");
+        return EXIT_FAILURE;
+    }
+    torn_tail(dir.filePath("torn.journal"));
+    compaction(dir.filePath("compact.journal"));
+    clearing(dir.filePath("clear.journal"));
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
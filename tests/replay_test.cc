@@ -0,0 +1,111 @@
+/** Replaying a transform (Transformable::run, as restoring a session does)
+ * must show what the interactive edits that made it showed */
+
+#include <QGuiApplication>
+#include <QImage>
+#include <QPainter>
+#include <QPixmap>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <fmt/core.h>
+#include "transform.hh"
+
+
+namespace {
+
+/** A Transformable whose results we can look at */
+class probe : public Transformable {
+public:
+    using Transformable::Transformable;
+    /** The pixels shown, as XILImage draws them */
+    [[nodiscard]] QImage shown() const { return img_.copy(view_).toImage().convertToFormat(QImage::Format_RGB32); }
+    [[nodiscard]] QRect box() const noexcept { return wbox_; }
+};
+
+
+/** Smooth enough that rounding a crop by a source pixel changes little,
+ * detailed enough that a wrong crop or scale shows */
+QPixmap
+source()
+{
+    QImage img(1200, 800, QImage::Format_RGB32);
+    for(int y = 0; y < img.height(); ++y)
+        for(int x = 0; x < img.width(); ++x)
+            img.setPixel(x, y, qRgb(x * 255 / img.width(), y * 255 / img.height(),
+                                    128 + 100 * std::sin(x / 60.0) * std::cos(y / 45.0)));
+    return QPixmap::fromImage(img);
+}
+
+
+int failures = 0;
+
+
+/** Apply edits interactively, replay the transform they made on the same pixels, and compare */
+void
+check(char const *name, std::function<void(Transformable &)> edits)
+{
+    QPixmap const src{source()};
+    probe live(src);
+    edits(live);
+    probe replay(src);
+    replay.restore(live.source_transform());
+
+    QRect const a{live.box()}, b{replay.box()};
+    bool ok = a.topLeft() == b.topLeft() && std::abs(a.width() - b.width()) <= 1 && std::abs(a.height() - b.height()) <= 1;
+    QImage const x{live.shown()}, y{replay.shown()};
+    int const w = std::min(x.width(), y.width()), h = std::min(x.height(), y.height());
+    double sum = 0;
+    int worst = 0;
+    for(int j = 0; j < h; ++j)
+        for(int i = 0; i < w; ++i) {
+            QRgb const p = x.pixel(i, j), q = y.pixel(i, j);
+            int const d = std::max({std::abs(qRed(p) - qRed(q)), std::abs(qGreen(p) - qGreen(q)), std::abs(qBlue(p) - qBlue(q))});
+            sum += d;
+            worst = std::max(worst, d);
+        }
+    double const mean = w && h ? sum / (double(w) * h) : 255;
+    // Resampling the crop in one pass rather than in steps moves edges by under a pixel
+    ok = ok && mean <= 3.0 && worst <= 32;
+    fmt::print("{}: {} box {}x{}+{}+{} replayed {}x{}+{}+{}, mean difference {:.2f}, worst {}\n", ok ? "ok" : "FAILED", name,
+               a.width(), a.height(), a.x(), a.y(), b.width(), b.height(), b.x(), b.y(), mean, worst);
+    if(!ok)
+        ++failures;
+}
+
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    // Pixmaps need a GUI application, but not a display
+    if(qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication app(argc, argv);
+
+    check("move", [](Transformable &t) { t.move_to(QPoint(30, 40)); });
+    check("crop, zoom out, move", [](Transformable &t) {
+        t.crop(QRect(100, 50, 600, 400));
+        t.zoom_to(0.5f);
+        t.move_to(QPoint(30, 40));
+    });
+    check("zoom out, crop", [](Transformable &t) {
+        t.zoom_to(0.37f);
+        t.crop(QRect(20, 30, 200, 150));
+        t.move_to(QPoint(5, 7));
+    });
+    check("zoom in, crop, zoom out", [](Transformable &t) {
+        t.zoom_to(1.6f);
+        t.crop(QRect(300, 200, 640, 480));
+        t.zoom_to(0.8f);
+    });
+    check("crop twice, zoom in", [](Transformable &t) {
+        t.crop(QRect(200, 100, 800, 600));
+        t.crop(QRect(50, 40, 300, 200));
+        t.zoom_to(2.0f);
+        t.move_to(QPoint(100, 0));
+    });
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+/** Resampler's SIMD kernels must give exactly what the plain C++ ones do,
+ * including at widths which leave a partial vector over, and with alpha */
+
+#include <QImage>
+#include <QRectF>
+#include <QSize>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <fmt/core.h>
+#include "resample.hh"
+
+
+namespace {
+
+int failures = 0;
+
+
+void
+expect(bool ok, std::string const &what)
+{
+    fmt::print("{}: {}\n", ok ? "ok" : "FAILED", what);
+    if(!ok)
+        ++failures;
+}
+
+
+/** Noise, so every tap matters; premultiplied (colours within alpha) if alpha */
+QImage
+noise(QSize size, bool alpha, std::mt19937 &rng)
+{
+    QImage img(size, alpha ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+    std::uniform_int_distribution<unsigned> byte(0, 255);
+    for(int y = 0; y < img.height(); ++y) {
+        auto *line = reinterpret_cast<std::uint32_t *>(img.scanLine(y));
+        for(int x = 0; x < img.width(); ++x) {
+            // Some fully transparent and fully opaque pixels among the rest
+            unsigned const a = alpha ? (x % 5 == 0 ? 0 : x % 5 == 1 ? 255 : byte(rng)) : 255;
+            unsigned const r = byte(rng) * a / 255, g = byte(rng) * a / 255, b = byte(rng) * a / 255;
+            line[x] = a << 24 | r << 16 | g << 8 | b;
+        }
+    }
+    return img;
+}
+
+
+bool
+identical(QImage const &a, QImage const &b)
+{
+    if(a.size() != b.size() || a.format() != b.format())
+        return false;
+    for(int y = 0; y < a.height(); ++y)
+        if(std::memcmp(a.constScanLine(y), b.constScanLine(y), 4 * static_cast<std::size_t>(a.width())))
+            return false;
+    return true;
+}
+
+
+/** Premultiplied colours stay within alpha, and RGB32 stays opaque */
+bool
+valid(QImage const &img)
+{
+    bool const alpha = img.format() == QImage::Format_ARGB32_Premultiplied;
+    for(int y = 0; y < img.height(); ++y) {
+        auto const *line = reinterpret_cast<std::uint32_t const *>(img.constScanLine(y));
+        for(int x = 0; x < img.width(); ++x) {
+            std::uint32_t const px = line[x], a = px >> 24;
+            if(alpha ? (px >> 16 & 0xff) > a || (px >> 8 & 0xff) > a || (px & 0xff) > a : a != 255)
+                return false;
+        }
+    }
+    return true;
+}
+
+
+struct scaling {
+    QSize source;
+    /** Part of the source, empty for all of it */
+    QRectF from;
+    QSize target;
+    Resampler::filter filter;
+};
+
+
+/** Scale alike with simd and scalar, named kernels in what is printed */
+void
+compare(std::string const &kernels, Resampler &simd, Resampler &scalar)
+{
+    // Odd widths either side of the 4 and 8 pixel vectors, reducing and enlarging
+    scaling const cases[] = {
+        {QSize(101, 67), QRectF(), QSize(33, 21), Resampler::filter::lanczos3},
+        {QSize(37, 29), QRectF(), QSize(115, 91), Resampler::filter::lanczos3},
+        {QSize(64, 48), QRectF(3.25, 1.5, 40.5, 31.75), QSize(13, 11), Resampler::filter::lanczos3},
+        {QSize(7, 5), QRectF(), QSize(3, 9), Resampler::filter::lanczos3},
+        {QSize(1, 3), QRectF(), QSize(5, 1), Resampler::filter::lanczos3},
+        {QSize(99, 77), QRectF(), QSize(50, 39), Resampler::filter::box},
+        {QSize(9, 17), QRectF(), QSize(5, 9), Resampler::filter::box},
+    };
+    std::mt19937 rng(2024);
+    for(auto const &c : cases)
+        for(bool alpha : {false, true}) {
+            QImage const src = noise(c.source, alpha, rng);
+            QRectF const from = c.from.isEmpty() ? QRectF(src.rect()) : c.from;
+            QImage const a = simd.scale(src, from, c.target, c.filter);
+            QImage const b = scalar.scale(src, from, c.target, c.filter);
+            std::string const what = fmt::format("{}: {}x{} to {}x{}, {}{}", kernels, c.source.width(), c.source.height(),
+                                                 c.target.width(), c.target.height(),
+                                                 c.filter == Resampler::filter::box ? "box" : "lanczos3",
+                                                 alpha ? ", alpha" : "");
+            expect(!a.isNull() && identical(a, b), what + " as scalar");
+            expect(valid(a), what + " in range");
+        }
+}
+
+}
+
+
+int
+main()
+{
+    // One thread, and bands of many threads: the split must not change the result
+    Resampler scalar(1, "scalar");
+    for(char const *isa : Resampler::supported()) {
+        if(std::strcmp(isa, "scalar") == 0)
+            continue;
+        Resampler one(1, isa), many(4, isa);
+        compare(isa, one, scalar);
+        compare(fmt::format("{} in bands", isa), many, scalar);
+    }
+    if(Resampler::supported().size() == 1)
+        fmt::print("ok: no SIMD kernels on this processor, nothing to compare\n");
+
+    bool refused = false;
+    try {
+        Resampler none(1, "mmx");
+    } catch(std::invalid_argument const &) {
+        refused = true;
+    }
+    expect(refused, "kernels this processor lacks are refused");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
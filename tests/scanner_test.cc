@@ -0,0 +1,197 @@
+/** ImageIndex must recognise images by their first bytes, whatever they are
+ * called, and read their dimensions from the headers without decoding */
+
+#include <QDir>
+#include <QFile>
+#include <QString>
+#include <QTemporaryDir>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <fmt/core.h>
+#include "scanner.hh"
+
+
+namespace {
+
+int failures = 0;
+
+
+void
+expect(bool ok, std::string const &what)
+{
+    fmt::print("{}: {}\n", ok ? "ok" : "FAILED", what);
+    if(!ok)
+        ++failures;
+}
+
+
+std::string
+be16(unsigned v)
+{
+    return {static_cast<char>(v >> 8), static_cast<char>(v)};
+}
+
+
+std::string
+le16(unsigned v)
+{
+    return {static_cast<char>(v), static_cast<char>(v >> 8)};
+}
+
+
+std::string
+be32(std::uint32_t v)
+{
+    return be16(v >> 16) + be16(v & 0xffff);
+}
+
+
+std::string
+le32(std::uint32_t v)
+{
+    return le16(v & 0xffff) + le16(v >> 16);
+}
+
+
+std::string
+le24(std::uint32_t v)
+{
+    return le16(v & 0xffff) + static_cast<char>(v >> 16);
+}
+
+
+void
+write_file(QString const &path, std::string const &data)
+{
+    QFile f(path);
+    if(f.open(QIODevice::WriteOnly))
+        f.write(data.data(), data.size());
+}
+
+
+/** A JPEG with an APP1 segment before its frame header */
+std::string
+jpeg(unsigned width, unsigned height)
+{
+    return std::string("\xff\xd8", 2) + "\xff\xe1" + be16(8) + std::string("Exif\0\0", 6) + "\xff\xc0" + be16(17) + '\x08'
+           + be16(height) + be16(width) + std::string(12, '\0');
+}
+
+
+/** A TIFF whose first IFD has the width as a SHORT and the height as a LONG */
+std::string
+tiff(bool big_endian, unsigned width, unsigned height)
+{
+    auto u16 = big_endian ? be16 : le16;
+    auto u32 = big_endian ? be32 : le32;
+    return (big_endian ? std::string("MM\0*", 4) : std::string("II*\0", 4)) + u32(8) + u16(2)
+           + u16(256) + u16(3) + u32(1) + u16(width) + u16(0)
+           + u16(257) + u16(4) + u32(1) + u32(height) + u32(0);
+}
+
+
+struct sample {
+    char const *what;
+    std::string data;
+    ImageIndex::kind type;
+    std::uint32_t width, height;
+};
+
+
+void
+sniffing(QTemporaryDir const &dir)
+{
+    using kind = ImageIndex::kind;
+    std::string const png_sig{"\x89PNG\r\n\x1a\n"};
+    sample const samples[] = {
+        {"jpeg", jpeg(1024, 768), kind::jpeg, 1024, 768},
+        {"jpeg without a frame header", std::string("\xff\xd8\xff\xd9", 4) + std::string(12, '\0'), kind::jpeg, 0, 0},
+        {"png", png_sig + be32(13) + "IHDR" + be32(640) + be32(480) + std::string(5, '\0'), kind::png, 640, 480},
+        {"gif87a", "GIF87a" + le16(320) + le16(200) + std::string(8, '\0'), kind::gif, 320, 200},
+        {"gif89a", "GIF89a" + le16(16) + le16(9) + std::string(8, '\0'), kind::gif, 16, 9},
+        {"bmp, top-down", "BM" + std::string(12, '\0') + le32(40) + le32(200) + le32(static_cast<std::uint32_t>(-100)),
+         kind::bmp, 200, 100},
+        {"bmp, OS/2 header", "BM" + std::string(12, '\0') + le32(12) + le16(64) + le16(48) + std::string(6, '\0'),
+         kind::bmp, 64, 48},
+        {"tiff, little endian", tiff(false, 300, 200), kind::tiff, 300, 200},
+        {"tiff, big endian", tiff(true, 300, 200), kind::tiff, 300, 200},
+        {"webp, extended", "RIFF" + le32(30) + "WEBP" + "VP8X" + le32(10) + le32(0) + le24(1919) + le24(1079),
+         kind::webp, 1920, 1080},
+        {"webp, lossless", "RIFF" + le32(30) + "WEBP" + "VP8L" + le32(5) + '\x2f' + le32(799 | 599u << 14) + std::string(8, '\0'),
+         kind::webp, 800, 600},
+        {"webp, lossy", "RIFF" + le32(30) + "WEBP" + "VP8 " + le32(10) + std::string(3, '\0') + "\x9d\x01\x2a" + le16(640)
+                            + le16(360) + std::string(4, '\0'),
+         kind::webp, 640, 360},
+        {"heif", std::string("\0\0\0\x18", 4) + "ftypheic" + std::string(12, '\0'), kind::heif, 0, 0},
+        {"avif", std::string("\0\0\0\x18", 4) + "ftypavif" + std::string(12, '\0'), kind::heif, 0, 0},
+        {"mp4 is not an image", std::string("\0\0\0\x18", 4) + "ftypisom" + std::string(12, '\0'), kind::unknown, 0, 0},
+        {"text", "just some notes, not an image\n", kind::unknown, 0, 0},
+        {"too short to tell", std::string("\xff\xd8\xff", 3), kind::unknown, 0, 0},
+    };
+    int i = 0;
+    for(auto const &s : samples) {
+        QString const path{dir.filePath(QString("sample%1").arg(i++))};
+        write_file(path, s.data);
+        int const fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+        std::uint32_t width = 1, height = 1;
+        ImageIndex::kind const type = fd < 0 ? kind::unknown : ImageIndex::sniff(fd, width, height);
+        bool const unmoved = fd >= 0 && lseek(fd, 0, SEEK_CUR) == 0;
+        if(fd >= 0)
+            ::close(fd);
+        expect(type == s.type && width == s.width && height == s.height && unmoved,
+               fmt::format("sniff: {} ({}x{})", s.what, width, height));
+    }
+}
+
+
+/** The index holds the images whatever their names, and nothing else; a link
+ * back up the tree is not followed */
+void
+scanning(QTemporaryDir const &dir)
+{
+    QString const top{dir.filePath("card")};
+    QString const sub{top + "/DCIM/100CANON"};
+    if(!QDir().mkpath(sub)) {
+        expect(false, "scan: make the directories");
+        return;
+    }
+    QFile::link(top, sub + "/loop");
+    write_file(sub + "/IMG_0001.JPG", jpeg(4000, 3000));
+    write_file(sub + "/renamed.dat", tiff(false, 30, 20));
+    write_file(sub + "/notes.jpg", "not a jpeg at all, despite the name\n");
+    ImageIndex index(top);
+    index.scan(2);
+    bool jpg = false, dat = false, notes = false;
+    for(auto const &e : index) {
+        QString const rel{index.relative_path(e)};
+        if(rel == "DCIM/100CANON/IMG_0001.JPG")
+            jpg = e.type == ImageIndex::kind::jpeg && e.width == 4000 && e.height == 3000;
+        else if(rel == "DCIM/100CANON/renamed.dat")
+            dat = e.type == ImageIndex::kind::tiff && e.width == 30 && e.height == 20;
+        else if(rel == "DCIM/100CANON/notes.jpg")
+            notes = true;
+    }
+    expect(index.size() == 2, "scan: two images found, once each");
+    expect(jpg, "scan: a jpeg, with its size");
+    expect(dat, "scan: an image with another extension");
+    expect(!notes, "scan: a text file named .jpg is left out");
+}
+
+}
+
+
+int
+main()
+{
+    QTemporaryDir dir;
+    if(!dir.isValid()) {
+        fmt::print("FAILED: no temporary directory\n");
+        return EXIT_FAILURE;
+    }
+    sniffing(dir);
+    scanning(dir);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
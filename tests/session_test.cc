@@ -0,0 +1,179 @@
+/** Session must load back what it persisted, and refuse (rather than crash on
+ * or misread) a file whose header does not describe what follows it */
+
+#include <QByteArray>
+#include <QFile>
+#include <QTemporaryDir>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <fmt/core.h>
+#include "image.hh"
+#include "session.hh"
+
+
+namespace {
+
+int failures = 0;
+
+
+void
+expect(bool ok, char const *what)
+{
+    fmt::print("{}: {}\n", ok ? "ok" : "FAILED", what);
+    if(!ok)
+        ++failures;
+}
+
+
+Transformable::transform
+tx(int x, int y, float zoom = 1.0f, QRect crop = QRect())
+{
+    Transformable::transform t;
+    t.crop_ = crop;
+    t.zoom_ = zoom;
+    t.move_ = QPoint(x, y);
+    return t;
+}
+
+
+bool
+same(Transformable::transform const &a, Transformable::transform const &b)
+{
+    return a.crop_ == b.crop_ && a.zoom_ == b.zoom_ && a.move_ == b.move_;
+}
+
+
+/** Offsets of the header fields (see session.cc) */
+enum field : int {
+    f_magic = 0, f_version = 4, f_count = 24, f_record_size = 28, f_records = 32, f_strings = 40, f_strings_size = 48
+};
+
+
+template<typename T>
+void
+poke(QByteArray &data, int at, T value)
+{
+    std::memcpy(data.data() + at, &value, sizeof(value));
+}
+
+
+template<typename T>
+T
+peek(QByteArray const &data, int at)
+{
+    T value;
+    std::memcpy(&value, data.constData() + at, sizeof(value));
+    return value;
+}
+
+
+QByteArray
+slurp(QString const &path)
+{
+    QFile f(path);
+    return f.open(QIODevice::ReadOnly) ? f.readAll() : QByteArray();
+}
+
+
+void
+spit(QString const &path, QByteArray const &data)
+{
+    QFile f(path);
+    if(f.open(QIODevice::WriteOnly))
+        f.write(data);
+}
+
+
+void
+round_trip(QString const &path, QString const &image)
+{
+    ImageFile a{image, 'c'};
+    a.setChecksum(QByteArray::fromHex("00112233445566778899aabbccddeeff"));
+    ImageFile const b{"/nonexistent/b.jpg"};
+    {
+        Session s;
+        s.add(a, tx(-1920, 40, 0.25f, QRect(10, 20, 300, 200)));
+        s.add(b, tx(5, 6));
+        s.persist(QFile::encodeName(path).constData());
+    }
+    Session s;
+    bool const loaded = s.load(QFile::encodeName(path).constData());
+    expect(loaded, "round trip: load");
+    auto const images = s.images();
+    expect(images.size() == 2, "round trip: both images, in order");
+    if(images.size() != 2)
+        return;
+    auto const &r = images[0];
+    expect(QFile::decodeName(r.path.ptr) == a.getPath() && QFile::decodeName(images[1].path.ptr) == b.getPath(),
+           "round trip: paths");
+    expect(r.size == a.getSize() && r.mtime == a.getModified() && r.size > 0, "round trip: file identity");
+    expect(QByteArray(reinterpret_cast<char const *>(r.checksum), r.checksum_length) == a.getChecksum(),
+           "round trip: checksum");
+    expect(r.drive == 'c' && images[1].drive == 0, "round trip: drives");
+    expect(same(r.transform(), tx(-1920, 40, 0.25f, QRect(10, 20, 300, 200))), "round trip: transform, off the first screen");
+    expect(same(images[1].transform(), tx(5, 6)) && !images[1].transform().crop_.isValid(), "round trip: uncropped transform");
+}
+
+
+/** Load path after damaging a good session file with corrupt; it must be refused,
+ * leaving the session that was loaded before */
+void
+refused(QString const &good, QString const &path, std::function<void(QByteArray &)> const &corrupt, char const *what)
+{
+    QByteArray data{slurp(good)};
+    corrupt(data);
+    spit(path, data);
+    Session s;
+    s.load(QFile::encodeName(good).constData());
+    bool const ok = !s.load(QFile::encodeName(path).constData()) && s.images().size() == 2;
+    expect(ok, what);
+}
+
+
+void
+corrupt_headers(QString const &good, QString const &path)
+{
+    QByteArray const data{slurp(good)};
+    auto const strings_size = peek<std::uint64_t>(data, f_strings_size);
+    auto const records = peek<std::uint64_t>(data, f_records);
+    refused(good, path, [](QByteArray &d) { d[f_magic] = 'X'; }, "corrupt: wrong magic");
+    refused(good, path, [](QByteArray &d) { poke<std::uint32_t>(d, f_version, 1); }, "corrupt: an earlier version");
+    refused(good, path, [](QByteArray &d) { d.truncate(40); }, "corrupt: shorter than a header");
+    refused(good, path, [](QByteArray &d) { d.truncate(0); }, "corrupt: empty");
+    refused(good, path, [](QByteArray &d) { poke<std::uint32_t>(d, f_record_size, 80); }, "corrupt: other record size");
+    refused(good, path, [](QByteArray &d) { poke<std::uint32_t>(d, f_count, 0x7fffffff); }, "corrupt: more records than the file holds");
+    refused(good, path, [](QByteArray &d) { poke<std::uint64_t>(d, f_records, 12); }, "corrupt: records inside the header");
+    refused(good, path, [](QByteArray &d) { poke<std::uint64_t>(d, f_records, 68); }, "corrupt: misaligned records");
+    refused(good, path, [](QByteArray &d) { poke<std::uint64_t>(d, f_records, ~std::uint64_t(0) - 7); },
+            "corrupt: records offset wrapping around");
+    refused(good, path, [](QByteArray &d) { poke<std::uint64_t>(d, f_strings, 1ull << 40); }, "corrupt: strings past the end");
+    refused(good, path, [](QByteArray &d) { poke<std::uint64_t>(d, f_strings_size, ~std::uint64_t(0)); },
+            "corrupt: strings running past the end");
+    refused(good, path, [](QByteArray &d) { d.chop(1); }, "corrupt: truncated in the strings");
+    refused(good, path, [](QByteArray &d) { d[d.size() - 1] = 'x'; }, "corrupt: last path not terminated");
+    // The first record starts with its path's offset into the strings
+    refused(good, path, [=](QByteArray &d) { poke<std::uint64_t>(d, records, strings_size); },
+            "corrupt: path outside the strings");
+}
+
+}
+
+
+int
+main()
+{
+    QTemporaryDir dir;
+    if(!dir.isValid()) {
+        fmt::print("FAILED: no temporary directory\n");
+        return EXIT_FAILURE;
+    }
+    // A file of our own, so the identity recorded is a real one
+    QString const image{dir.filePath("a.jpg")};
+    spit(image, QByteArray(1234, 'a'));
+    QString const good{dir.filePath("good.session")};
+    round_trip(good, image);
+    corrupt_headers(good, dir.filePath("bad.session"));
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+/** SpatialIndex::query must report each image intersecting the area once,
+ * however many cells it covers (or if it covers too many to list in each),
+ * lowest first; at must find the topmost */
+
+#include <cstdlib>
+#include <vector>
+#include <fmt/core.h>
+#include "spatial.hh"
+
+
+namespace {
+
+int failures = 0;
+
+
+void
+expect(bool ok, char const *what)
+{
+    fmt::print("{}: {}\n", ok ? "ok" : "FAILED", what);
+    if(!ok)
+        ++failures;
+}
+
+
+/** The index never looks at its images, so any distinct addresses will do */
+char slots[8];
+
+XILImage *
+image(int i) noexcept
+{
+    return reinterpret_cast<XILImage *>(&slots[i]);
+}
+
+}
+
+
+int
+main()
+{
+    SpatialIndex idx(100);
+    std::vector<XILImage *> got;
+
+    // Spanning 4x4 cells, across the origin, and a small one inside it
+    idx.insert(image(0), QRect(-150, -150, 400, 400), 3);
+    idx.insert(image(1), QRect(10, 10, 50, 50), 1);
+    idx.insert(image(2), QRect(500, 500, 100, 100), 2);
+
+    idx.query(QRect(-1000, -1000, 3000, 3000), got);
+    expect(got == std::vector<XILImage *>{image(1), image(2), image(0)}, "query: each image once, lowest first");
+
+    idx.query(QRect(-120, -120, 200, 200), got);
+    expect(got == std::vector<XILImage *>{image(1), image(0)}, "query: an image over many of the area's cells once");
+
+    // In a cell the area covers, but not overlapping it
+    idx.query(QRect(70, 70, 20, 20), got);
+    expect(got == std::vector<XILImage *>{image(0)}, "query: only images overlapping the area");
+
+    idx.query(QRect(260, 260, 100, 100), got);
+    expect(got.empty(), "query: nothing in an empty area");
+
+    idx.restack(image(1), 4);
+    idx.query(QRect(0, 0, 100, 100), got);
+    expect(got == std::vector<XILImage *>{image(0), image(1)}, "query: order follows restacking");
+
+    // Into cells of its own, and back within those it covered
+    idx.update(image(2), QRect(-90, 150, 300, 30));
+    idx.query(QRect(-1000, -1000, 3000, 3000), got);
+    expect(got == std::vector<XILImage *>{image(2), image(0), image(1)}, "query: a moved image once");
+    idx.update(image(2), QRect(-80, 160, 300, 30));
+    idx.query(QRect(200, 100, 100, 100), got);
+    expect(got == std::vector<XILImage *>{image(2), image(0)}, "query: a moved image at its new box");
+    idx.query(QRect(-100, 150, 15, 10), got);
+    expect(got == std::vector<XILImage *>{image(0)}, "query: a moved image not at its old box");
+
+    expect(idx.at(QPoint(20, 20)) == image(1), "at: the topmost image");
+    expect(idx.at(QPoint(100, 100)) == image(0), "at: the only image");
+    expect(idx.at(QPoint(1000, 1000)) == nullptr, "at: no image");
+
+    idx.erase(image(0));
+    idx.query(QRect(-1000, -1000, 3000, 3000), got);
+    expect(got == std::vector<XILImage *>{image(2), image(1)} && idx.size() == 2, "erase: gone from every cell");
+
+    // Millions of cells: listed apart, but found like the others
+    idx.insert(image(3), QRect(-200000, -200000, 400000, 400000), 3);
+    idx.query(QRect(0, 0, 100, 100), got);
+    expect(got == std::vector<XILImage *>{image(3), image(1)}, "large: once, in stacking order");
+    expect(idx.at(QPoint(-150000, 7)) == image(3) && idx.at(QPoint(20, 20)) == image(1), "large: at");
+    idx.restack(image(3), 5);
+    idx.query(QRect(0, 0, 100, 100), got);
+    expect(got == std::vector<XILImage *>{image(1), image(3)} && idx.at(QPoint(20, 20)) == image(3), "large: restacked");
+    idx.update(image(3), QRect(-200000, 0, 400000, 50));
+    idx.query(QRect(400, 60, 50, 50), got);
+    expect(got.empty(), "large: moved from its old box");
+    idx.query(QRect(400, 0, 50, 50), got);
+    expect(got == std::vector<XILImage *>{image(3)}, "large: moved to its new box");
+    // Small enough for the grid again
+    idx.update(image(3), QRect(300, 300, 50, 50));
+    idx.query(QRect(-1000, -1000, 3000, 3000), got);
+    expect(got == std::vector<XILImage *>{image(2), image(1), image(3)}, "large: back in the grid");
+    idx.update(image(3), QRect(-200000, -200000, 400000, 400000));
+    idx.erase(image(3));
+    idx.query(QRect(-1000, -1000, 3000, 3000), got);
+    expect(got == std::vector<XILImage *>{image(2), image(1)} && idx.at(QPoint(-150000, 7)) == nullptr, "large: erased");
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}